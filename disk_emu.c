@@ -1,180 +1,1600 @@
-#include <stdio.h>
-#include <stdlib.h> 
-#include <string.h>
-#include <unistd.h>
-#include <time.h>
-#include "disk_emu.h"
-
-
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
-
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
-{
-    if(NULL != fp)
-    {
-        fclose(fp);
-    }
-    return 0;
-}
-
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
-{
-    int i, j;
-    
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not create new disk file %s\n\n", filename);
-        return -1;
-    }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
-    return 0;
-}
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
-{
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
-
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
-    
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
-
-    if (fp == NULL)
-    {
-        printf("Could not open %s\n\n", filename);
-        return -1;
-    }
-    return 0;
-}
-
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error %d\n", start_address);
-        return -1;
-    }
-
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-       for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
-    }
-
-    free(blockRead);
-
-
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
-
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
-{
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
-    {
-        printf("out of bound error\n");
-        return -1;
-    }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
-    {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
-
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
-}
+#include <stdio.h>
+#include <stdlib.h> 
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include "disk_emu.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  /*Defined by <linux/fs.h>; here it is the disk's block size*/
+#define DISK_HAVE_URING
+#endif
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int disk_fd = -1;
+int disk_backend = DISK_BACKEND_PREAD;
+char* disk_map = NULL;  // Whole image when the mmap backend is in use
+size_t disk_map_len = 0;
+int sync_mode = DISK_SYNC_DEFERRED;
+int disk_dirty = 0;
+double L, p;
+double r;
+int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int lru = DISK_CACHE_DEFAULT_BLOCKS;  // Capacity of the block cache, 0 disables it
+
+/*Block cache: a two-queue LRU. Blocks enter the probation queue and move*/
+/*to the protected queue when they are hit again, so one long sequential */
+/*scan cannot push the hot metadata blocks out of the cache.             */
+#define CACHE_PROBATION 0
+#define CACHE_PROTECTED 1
+
+typedef struct cache_entry {
+    int block;
+    int dirty;
+    int prefetched;  // Read ahead and not used yet
+    int queue;
+    int prev;
+    int next;
+} cache_entry;
+
+cache_entry* cache = NULL;
+char* cache_data = NULL;  // One block of data per cache entry
+#define CACHE_PENDING -2  // Entry of a block the io_uring backend is reading into the cache
+int cache_capacity = 0;
+int cache_used = 0;
+int cache_pending = 0;  // Blocks marked CACHE_PENDING
+
+/*Index from disk block to cache entry: an open-addressed hash table*/
+/*sized for the cache, not the disk, so large images cost no more   */
+/*memory. Each cached or pending block takes one slot.              */
+typedef struct index_slot {
+    int block;  // -1 for an empty slot
+    int entry;
+} index_slot;
+
+index_slot* cache_index = NULL;
+unsigned int index_mask = 0;
+int index_bits = 0;
+int queue_head[2], queue_tail[2], queue_len[2];
+long cache_hits = 0, cache_misses = 0;
+
+/*Every public function holds disk_lock, so the disk can be used from*/
+/*several threads. It is recursive as public functions call others.  */
+pthread_mutex_t disk_lock;
+pthread_once_t disk_lock_once = PTHREAD_ONCE_INIT;
+
+static void init_disk_lock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&disk_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void lock_disk()
+{
+    pthread_once(&disk_lock_once, init_disk_lock);
+    pthread_mutex_lock(&disk_lock);
+}
+
+static void unlock_disk()
+{
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*Resolves block i of a transfer that uses either one flat buffer or one buffer per block*/
+#define BUF_AT(flat, vec, i) ((vec) != NULL ? (char *)(vec)[i] : (flat) + (size_t)(i) * BLOCK_SIZE)
+
+/*----------------------------------------------------------*/
+/*Reads len bytes at offset, retrying on short reads. Bytes */
+/*past the end of the file read back as 0's.                */
+/*----------------------------------------------------------*/
+static int pread_full(void *buffer, size_t len, off_t offset)
+{
+    char *dst = buffer;
+
+    while (len > 0)
+    {
+        ssize_t n = pread(disk_fd, dst, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+        {
+            memset(dst, 0, len);
+            break;
+        }
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Writes len bytes at offset, retrying on short writes.     */
+/*----------------------------------------------------------*/
+static int pwrite_full(const void *buffer, size_t len, off_t offset)
+{
+    const char *src = buffer;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(disk_fd, src, len, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Drops the first n bytes from an iovec array after a short */
+/*transfer. Returns the number of entries still pending.    */
+/*----------------------------------------------------------*/
+static int advance_iov(struct iovec **iov, int cnt, size_t n)
+{
+    while (cnt > 0 && n >= (*iov)->iov_len)
+    {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        cnt--;
+    }
+    if (cnt > 0)
+    {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+    return cnt;
+}
+
+/*----------------------------------------------------------*/
+/*Transfers an iovec array at offset, retrying on short     */
+/*transfers. The array is consumed as it goes.              */
+/*----------------------------------------------------------*/
+static int transfer_iov(struct iovec *iov, int cnt, off_t offset, int write)
+{
+    while (cnt > 0)
+    {
+        ssize_t n = write ? pwritev(disk_fd, iov, cnt, offset)
+                          : preadv(disk_fd, iov, cnt, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (write)
+                return -1;
+            /*Past the end of the file, the rest reads back as 0's*/
+            for (int i = 0; i < cnt; i++)
+                memset(iov[i].iov_base, 0, iov[i].iov_len);
+            break;
+        }
+        offset += n;
+        cnt = advance_iov(&iov, cnt, n);
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Scatter/gather transfer of one contiguous range of blocks */
+/*to or from one buffer per block.                          */
+/*----------------------------------------------------------*/
+static int transfer_blocks_v(int start_address, int nblocks, void **buffers, int write)
+{
+    struct iovec iov[IOV_MAX];
+    off_t offset = (off_t)start_address * BLOCK_SIZE;
+    int done = 0;
+
+    while (done < nblocks)
+    {
+        int cnt = nblocks - done;
+        if (cnt > IOV_MAX)
+            cnt = IOV_MAX;
+
+        for (int i = 0; i < cnt; i++)
+        {
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+
+        if (transfer_iov(iov, cnt, offset, write) < 0)
+            return -1;
+        offset += (off_t)cnt * BLOCK_SIZE;
+        done += cnt;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Selects when writes are made durable. DISK_SYNC_STRICT     */
+/*syncs after every write, DISK_SYNC_DEFERRED batches writes */
+/*until the next call to sync_disk.                          */
+/*----------------------------------------------------------*/
+int set_disk_sync_mode(int mode)
+{
+    if (mode != DISK_SYNC_DEFERRED && mode != DISK_SYNC_STRICT)
+        return -1;
+
+    /*Pushes out anything batched under the old mode*/
+    lock_disk();
+    if (mode == DISK_SYNC_STRICT)
+        sync_disk();
+
+    sync_mode = mode;
+    unlock_disk();
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Selects how the image is accessed. Takes effect the next  */
+/*time a disk is initialized.                               */
+/*----------------------------------------------------------*/
+int set_disk_backend(int backend)
+{
+    if (backend != DISK_BACKEND_PREAD && backend != DISK_BACKEND_MMAP && backend != DISK_BACKEND_URING)
+        return -1;
+
+    lock_disk();
+    disk_backend = backend;
+    unlock_disk();
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Syncs the part of the mapping holding a range of blocks.  */
+/*----------------------------------------------------------*/
+static int msync_blocks(int start_address, int nblocks)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t begin = (size_t)start_address * BLOCK_SIZE;
+    size_t end = begin + (size_t)nblocks * BLOCK_SIZE;
+
+    begin -= begin % page;
+    return msync(disk_map + begin, end - begin, MS_SYNC);
+}
+
+/*----------------------------------------------------------*/
+/*Makes every write issued so far durable on the disk file. */
+/*----------------------------------------------------------*/
+int sync_disk()
+{
+    lock_disk();
+    int res = flush_cache();
+
+    if (res == 0 && disk_fd >= 0 && disk_dirty)
+    {
+        res = disk_map != NULL ? msync(disk_map, disk_map_len, MS_SYNC)
+                               : fdatasync(disk_fd);
+        if (res < 0)
+            printf("sync error\n");
+        else
+            disk_dirty = 0;
+    }
+    unlock_disk();
+    return res < 0 ? -1 : 0;
+}
+
+/*----------------------------------------------------------*/
+/*Ends a write: syncs now in strict mode, else defers it.   */
+/*----------------------------------------------------------*/
+static int complete_write(int start_address, int nblocks)
+{
+    if (sync_mode != DISK_SYNC_STRICT)
+    {
+        disk_dirty = 1;
+        return 0;
+    }
+
+    if (disk_map != NULL)
+    {
+        if (msync_blocks(start_address, nblocks) < 0)
+        {
+            printf("sync error\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    disk_dirty = 1;
+    return sync_disk();
+}
+
+/*----------------------------------------------------------*/
+/*Maps the whole image into memory for the mmap backend.    */
+/*----------------------------------------------------------*/
+static int map_disk()
+{
+    struct stat st;
+
+    disk_map_len = (size_t)MAX_BLOCK * BLOCK_SIZE;
+    if (fstat(disk_fd, &st) < 0)
+        return -1;
+
+    /*Grows a short image so every block is backed by the file*/
+    if ((size_t)st.st_size < disk_map_len && ftruncate(disk_fd, disk_map_len) < 0)
+        return -1;
+
+    void *map = mmap(NULL, disk_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    disk_map = map;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Returns the slot where the search for a block starts.     */
+/*----------------------------------------------------------*/
+static unsigned int index_home(int block)
+{
+    return (unsigned int)block * 2654435761u >> (32 - index_bits);
+}
+
+/*----------------------------------------------------------*/
+/*Returns the slot holding block, or the empty slot where it*/
+/*would go. The table is never more than half full.         */
+/*----------------------------------------------------------*/
+static unsigned int index_find(int block)
+{
+    unsigned int i = index_home(block);
+
+    while (cache_index[i].block != -1 && cache_index[i].block != block)
+        i = (i + 1) & index_mask;
+    return i;
+}
+
+/*----------------------------------------------------------*/
+/*Returns the cache entry of a block, CACHE_PENDING, or -1. */
+/*----------------------------------------------------------*/
+static int cache_lookup(int block)
+{
+    unsigned int i = index_find(block);
+
+    return cache_index[i].block == block ? cache_index[i].entry : -1;
+}
+
+/*----------------------------------------------------------*/
+/*Empties a slot, moving later slots of the same probe run  */
+/*back so lookups still find them.                          */
+/*----------------------------------------------------------*/
+static void index_remove(unsigned int i)
+{
+    unsigned int j = i;
+
+    cache_index[i].block = -1;
+    for (;;)
+    {
+        j = (j + 1) & index_mask;
+        if (cache_index[j].block == -1)
+            return;
+
+        /*A slot can move back unless its home lies in (i, j]*/
+        unsigned int home = index_home(cache_index[j].block);
+        if (((j - home) & index_mask) >= ((j - i) & index_mask))
+        {
+            cache_index[i] = cache_index[j];
+            cache_index[j].block = -1;
+            i = j;
+        }
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Sets the cache entry of a block; -1 removes it.           */
+/*----------------------------------------------------------*/
+static void cache_map(int block, int e)
+{
+    unsigned int i = index_find(block);
+
+    if (cache_index[i].block == block && cache_index[i].entry == CACHE_PENDING)
+        cache_pending--;
+    if (e == CACHE_PENDING)
+        cache_pending++;
+
+    if (e == -1)
+    {
+        if (cache_index[i].block == block)
+            index_remove(i);
+        return;
+    }
+    cache_index[i].block = block;
+    cache_index[i].entry = e;
+}
+
+/*----------------------------------------------------------*/
+/*Removes a cache entry from the queue it is in.            */
+/*----------------------------------------------------------*/
+static void queue_unlink(int e)
+{
+    int q = cache[e].queue;
+
+    if (cache[e].prev >= 0)
+        cache[cache[e].prev].next = cache[e].next;
+    else
+        queue_head[q] = cache[e].next;
+
+    if (cache[e].next >= 0)
+        cache[cache[e].next].prev = cache[e].prev;
+    else
+        queue_tail[q] = cache[e].prev;
+
+    queue_len[q]--;
+}
+
+/*----------------------------------------------------------*/
+/*Puts a cache entry at the most recently used end of q.    */
+/*----------------------------------------------------------*/
+static void queue_push(int e, int q)
+{
+    cache[e].queue = q;
+    cache[e].prev = -1;
+    cache[e].next = queue_head[q];
+
+    if (queue_head[q] >= 0)
+        cache[queue_head[q]].prev = e;
+    else
+        queue_tail[q] = e;
+
+    queue_head[q] = e;
+    queue_len[q]++;
+}
+
+/*----------------------------------------------------------*/
+/*Records a hit: the entry moves to the protected queue. If */
+/*that queue outgrows 3/4 of the cache, its least recently  */
+/*used entry goes back to probation. The first use of a     */
+/*prefetched block only counts as the access that loaded it.*/
+/*----------------------------------------------------------*/
+static void cache_touch(int e)
+{
+    queue_unlink(e);
+    if (cache[e].prefetched)
+    {
+        cache[e].prefetched = 0;
+        queue_push(e, CACHE_PROBATION);
+        return;
+    }
+    queue_push(e, CACHE_PROTECTED);
+
+    if (queue_len[CACHE_PROTECTED] > cache_capacity - cache_capacity / 4)
+    {
+        int demoted = queue_tail[CACHE_PROTECTED];
+        queue_unlink(demoted);
+        queue_push(demoted, CACHE_PROBATION);
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Frees the slot of the least valuable entry, writing it    */
+/*back first if it is dirty. Returns the slot.              */
+/*----------------------------------------------------------*/
+static int cache_evict()
+{
+    int q = queue_len[CACHE_PROBATION] > 0 ? CACHE_PROBATION : CACHE_PROTECTED;
+    int e = queue_tail[q];
+
+    if (cache[e].dirty)
+    {
+        if (pwrite_full(cache_data + (size_t)e * BLOCK_SIZE, BLOCK_SIZE, (off_t)cache[e].block * BLOCK_SIZE) < 0)
+            return -1;
+        disk_dirty = 1;
+    }
+
+    queue_unlink(e);
+    cache_map(cache[e].block, -1);
+    return e;
+}
+
+/*----------------------------------------------------------*/
+/*Adds a copy of a block that is not cached yet.            */
+/*----------------------------------------------------------*/
+static int cache_insert(int block, const char *src, int dirty)
+{
+    int e;
+
+    if (cache_used < cache_capacity)
+        e = cache_used++;
+    else if ((e = cache_evict()) < 0)
+        return -1;
+
+    cache[e].block = block;
+    cache[e].dirty = dirty;
+    cache[e].prefetched = 0;
+    memcpy(cache_data + (size_t)e * BLOCK_SIZE, src, BLOCK_SIZE);
+    cache_map(block, e);
+    queue_push(e, CACHE_PROBATION);
+    return 0;
+}
+
+/*Ways transfer_range can put the blocks it reads into the cache*/
+#define FILL_NONE 0
+#define FILL_CACHE 1
+#define FILL_PREFETCH 2  /*Cached and marked as read ahead*/
+
+/*Outcome of a group of transfers that can still be in flight*/
+typedef struct io_status {
+    int pending;
+    int failed;
+} io_status;
+
+__thread io_status submitted = {0, 0};  /*This thread's transfers started by submit_read_blocks/submit_write_blocks*/
+io_status prefetched = {0, 0};  /*Read-ahead; a failed one just leaves its blocks uncached*/
+
+/*io_uring backend: transfers are queued on a submission ring and */
+/*up to RING_DEPTH of them are in flight at once. read_blocks and */
+/*write_blocks still wait for their own transfers, but read-ahead,*/
+/*cache write-back and the submit_ calls overlap. The ring is set */
+/*up with raw system calls, and the pread path is used whenever   */
+/*the kernel does not provide one.                                */
+#ifdef DISK_HAVE_URING
+
+#define RING_DEPTH 64
+
+/*A transfer submitted to the ring and not completed yet*/
+typedef struct ring_op {
+    int active;
+    int write;
+    int block;
+    int nblocks;
+    int fill;
+    char *owned;  /*Buffer freed once the transfer completes*/
+    io_status *status;
+    struct iovec *iov;  /*One entry per block*/
+} ring_op;
+
+int ring_fd = -1;
+unsigned *sq_tail, *sq_mask, *sq_array;
+unsigned *cq_head, *cq_tail, *cq_mask;
+struct io_uring_sqe *sqes;
+struct io_uring_cqe *cqes;
+void *sq_map, *cq_map;
+size_t sq_map_len, cq_map_len, sqes_len;
+ring_op ring_ops[RING_DEPTH];
+int ring_queued = 0;  /*Added to the ring since the last io_uring_enter*/
+int ring_inflight = 0;
+
+/*----------------------------------------------------------*/
+/*Creates the ring. Returns -1, leaving ring_fd at -1, when */
+/*the kernel does not support io_uring or does not allow it.*/
+/*----------------------------------------------------------*/
+static int setup_ring()
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, RING_DEPTH, &params);
+    if (fd < 0)
+        return -1;
+
+    sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_map_len > sq_map_len)
+            sq_map_len = cq_map_len;
+        cq_map_len = sq_map_len;
+    }
+    sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_map = mmap(NULL, sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? sq_map
+           : mmap(NULL, cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_len);
+        if (cq_map != MAP_FAILED && cq_map != sq_map)
+            munmap(cq_map, cq_map_len);
+        if (sq_map != MAP_FAILED)
+            munmap(sq_map, sq_map_len);
+        close(fd);
+        return -1;
+    }
+
+    sq_tail = (unsigned *)((char *)sq_map + params.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_map + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_map + params.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_map + params.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_map + params.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_map + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_map + params.cq_off.cqes);
+
+    ring_fd = fd;
+    ring_queued = 0;
+    ring_inflight = 0;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Finishes a transfer. A short one is completed on the      */
+/*pread path, and blocks that were read go into the cache   */
+/*unless they were written or dropped in the meantime.      */
+/*----------------------------------------------------------*/
+static void ring_complete(ring_op *op, int res)
+{
+    if (res >= 0 && (size_t)res < (size_t)op->nblocks * BLOCK_SIZE)
+    {
+        struct iovec rest[IOV_MAX];
+        struct iovec *cur = rest;
+        memcpy(rest, op->iov, sizeof(struct iovec) * op->nblocks);
+        int cnt = advance_iov(&cur, op->nblocks, res);
+        if (transfer_iov(cur, cnt, (off_t)op->block * BLOCK_SIZE + res, op->write) < 0)
+            res = -1;
+    }
+
+    for (int i = 0; op->fill != FILL_NONE && i < op->nblocks; i++)
+    {
+        int block = op->block + i;
+        if (cache == NULL || cache_lookup(block) != CACHE_PENDING)
+            continue;
+
+        cache_map(block, -1);
+        if (res >= 0 && cache_insert(block, op->iov[i].iov_base, 0) == 0)
+            cache[cache_lookup(block)].prefetched = op->fill == FILL_PREFETCH;
+    }
+
+    if (op->status != NULL)
+    {
+        op->status->pending--;
+        if (res < 0)
+            op->status->failed = 1;
+    }
+    free(op->iov);
+    free(op->owned);
+    op->active = 0;
+    ring_inflight--;
+}
+
+/*----------------------------------------------------------*/
+/*Submits what was queued and handles the completions that  */
+/*arrived. With wait set, blocks until there is at least one.*/
+/*----------------------------------------------------------*/
+static int ring_reap(int wait)
+{
+    while (ring_queued > 0 || wait)
+    {
+        int n = syscall(__NR_io_uring_enter, ring_fd, ring_queued, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0)
+        {
+            ring_queued -= n;
+            break;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            printf("io_uring error\n");
+            return -1;
+        }
+    }
+
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        ring_complete(&ring_ops[cqe->user_data], cqe->res);
+        head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Waits until the transfers counted in status complete.     */
+/*----------------------------------------------------------*/
+static int ring_wait(io_status *status)
+{
+    while (status->pending > 0)
+    {
+        if (ring_reap(1) < 0)
+        {
+            /*Whatever is left completes unreported*/
+            for (int i = 0; i < RING_DEPTH; i++)
+            {
+                if (ring_ops[i].active && ring_ops[i].status == status)
+                    ring_ops[i].status = NULL;
+            }
+            status->pending = 0;
+            status->failed = 1;
+        }
+    }
+
+    int failed = status->failed;
+    status->failed = 0;
+    return failed ? -1 : 0;
+}
+
+/*----------------------------------------------------------*/
+/*Waits until every transfer in flight has completed.       */
+/*----------------------------------------------------------*/
+static void ring_drain()
+{
+    while (ring_fd >= 0 && ring_inflight > 0 && ring_reap(1) == 0)
+        ;
+}
+
+/*----------------------------------------------------------*/
+/*Queues one transfer of at most IOV_MAX blocks, waiting for*/
+/*a free slot if the ring is full.                          */
+/*----------------------------------------------------------*/
+static int ring_push(int start_address, int nblocks, char *flat, void **vec, int write, int fill, char *owned,
+                     io_status *status)
+{
+    while (ring_inflight == RING_DEPTH)
+    {
+        if (ring_reap(1) < 0)
+            return -1;
+    }
+
+    int id = 0;
+    while (ring_ops[id].active)
+        id++;
+
+    ring_op *op = &ring_ops[id];
+    op->active = 1;
+    op->write = write;
+    op->block = start_address;
+    op->nblocks = nblocks;
+    /*Blocks read past what the index has room for are left uncached*/
+    op->fill = cache != NULL && cache_pending + nblocks <= cache_capacity ? fill : FILL_NONE;
+    op->owned = owned;
+    op->status = status;
+    op->iov = malloc(sizeof(struct iovec) * nblocks);
+    if (op->iov == NULL)
+    {
+        op->active = 0;
+        return -1;
+    }
+    for (int i = 0; i < nblocks; i++)
+    {
+        op->iov[i].iov_base = BUF_AT(flat, vec, i);
+        op->iov[i].iov_len = BLOCK_SIZE;
+        if (op->fill != FILL_NONE)
+            cache_map(start_address + i, CACHE_PENDING);
+    }
+    status->pending++;
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = disk_fd;
+    sqe->off = (off_t)start_address * BLOCK_SIZE;
+    sqe->addr = (unsigned long)op->iov;
+    sqe->len = nblocks;
+    sqe->user_data = id;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring_queued++;
+    ring_inflight++;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Queues a transfer of any length on the ring and submits it.*/
+/*----------------------------------------------------------*/
+static int ring_transfer(int start_address, int nblocks, char *flat, void **vec, int write, int fill, char *owned,
+                         io_status *status)
+{
+    for (int done = 0; done < nblocks; )
+    {
+        int cnt = nblocks - done < IOV_MAX ? nblocks - done : IOV_MAX;
+
+        /*The last part of the transfer frees the buffer*/
+        if (ring_push(start_address + done, cnt, flat != NULL ? flat + (size_t)done * BLOCK_SIZE : NULL,
+                      vec != NULL ? vec + done : NULL, write, fill,
+                      done + cnt == nblocks ? owned : NULL, status) < 0)
+        {
+            status->failed = 1;
+            return -1;
+        }
+        done += cnt;
+    }
+    return ring_reap(0);
+}
+
+/*----------------------------------------------------------*/
+/*Releases the ring once nothing is in flight.              */
+/*----------------------------------------------------------*/
+static void teardown_ring()
+{
+    if (ring_fd < 0)
+        return;
+
+    ring_drain();
+    munmap(sqes, sqes_len);
+    if (cq_map != sq_map)
+        munmap(cq_map, cq_map_len);
+    munmap(sq_map, sq_map_len);
+    close(ring_fd);
+    ring_fd = -1;
+    submitted.pending = 0;
+    submitted.failed = 0;
+    prefetched.pending = 0;
+}
+
+#endif
+
+/*----------------------------------------------------------*/
+/*Moves a range of blocks between the disk file and one flat*/
+/*buffer or one buffer per block. Blocks that are read can  */
+/*also be put into the cache, and owned, if given, is freed */
+/*once the transfer is done. With async set the transfer    */
+/*may still be in flight on return, counted in async.       */
+/*----------------------------------------------------------*/
+static int transfer_range(int start_address, int nblocks, char *flat, void **vec, int write, int fill, char *owned,
+                          io_status *async)
+{
+#ifdef DISK_HAVE_URING
+    if (ring_fd >= 0)
+    {
+        io_status own = {0, 0};
+        if (async != NULL)
+            return ring_transfer(start_address, nblocks, flat, vec, write, fill, owned, async);
+        if (ring_transfer(start_address, nblocks, flat, vec, write, fill, owned, &own) < 0)
+        {
+            ring_wait(&own);
+            return -1;
+        }
+        return ring_wait(&own);
+    }
+#endif
+
+    int res;
+    if (vec != NULL)
+        res = transfer_blocks_v(start_address, nblocks, vec, write);
+    else if (write)
+        res = pwrite_full(flat, (size_t)nblocks * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE);
+    else
+        res = pread_full(flat, (size_t)nblocks * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE);
+
+    for (int i = 0; res == 0 && cache != NULL && fill != FILL_NONE && i < nblocks; i++)
+    {
+        if (cache_insert(start_address + i, BUF_AT(flat, vec, i), 0) < 0)
+            res = -1;
+        else
+            cache[cache_lookup(start_address + i)].prefetched = fill == FILL_PREFETCH;
+    }
+    free(owned);
+    return res;
+}
+
+/*----------------------------------------------------------*/
+/*Waits for the transfers counted in status. Returns -1 if  */
+/*any of them failed.                                       */
+/*----------------------------------------------------------*/
+static int wait_io(io_status *status)
+{
+#ifdef DISK_HAVE_URING
+    if (ring_fd >= 0)
+        return ring_wait(status);
+#endif
+    int failed = status->failed;
+    status->failed = 0;
+    return failed ? -1 : 0;
+}
+
+/*----------------------------------------------------------*/
+/*Waits for a block the ring is reading into the cache.     */
+/*----------------------------------------------------------*/
+static void wait_for_block(int block)
+{
+#ifdef DISK_HAVE_URING
+    while (cache_lookup(block) == CACHE_PENDING)
+    {
+        if (ring_reap(1) < 0)
+        {
+            cache_map(block, -1);
+            return;
+        }
+    }
+#else
+    (void)block;
+#endif
+}
+
+static int compare_cache_blocks(const void *a, const void *b)
+{
+    return cache[*(const int *)a].block - cache[*(const int *)b].block;
+}
+
+/*----------------------------------------------------------*/
+/*Writes back every dirty cached block. Blocks are sorted   */
+/*so each run of adjacent blocks goes out in one pwritev.   */
+/*----------------------------------------------------------*/
+int flush_cache()
+{
+    int ndirty = 0;
+
+    lock_disk();
+#ifdef DISK_HAVE_URING
+    /*Writes already in flight are part of what gets flushed*/
+    ring_drain();
+#endif
+
+    if (cache == NULL)
+    {
+        unlock_disk();
+        return 0;
+    }
+
+    int *dirty = malloc(sizeof(int) * cache_used);
+    void **bufs = malloc(sizeof(void *) * cache_used);
+    if (dirty == NULL || bufs == NULL)
+    {
+        free(dirty);
+        free(bufs);
+        unlock_disk();
+        return -1;
+    }
+    for (int e = 0; e < cache_used; e++)
+    {
+        if (cache[e].dirty)
+            dirty[ndirty++] = e;
+    }
+    qsort(dirty, ndirty, sizeof(int), compare_cache_blocks);
+
+    /*With the ring, every run is in flight at the same time*/
+    int res = 0;
+    io_status written = {0, 0};
+    for (int i = 0; i < ndirty; )
+    {
+        int run = 0;
+        do
+        {
+            bufs[i + run] = cache_data + (size_t)dirty[i + run] * BLOCK_SIZE;
+            run++;
+        } while (i + run < ndirty && cache[dirty[i + run]].block == cache[dirty[i]].block + run);
+
+        if (transfer_range(cache[dirty[i]].block, run, NULL, bufs + i, 1, FILL_NONE, NULL, &written) < 0)
+        {
+            printf("write error %d\n", cache[dirty[i]].block);
+            res = -1;
+            break;
+        }
+        i += run;
+    }
+    if (wait_io(&written) < 0)
+        res = -1;
+
+    for (int i = 0; res == 0 && i < ndirty; i++)
+        cache[dirty[i]].dirty = 0;
+    if (ndirty > 0)
+        disk_dirty = 1;
+
+    free(bufs);
+    free(dirty);
+    unlock_disk();
+    return res;
+}
+
+static void flush_cache_at_exit()
+{
+    flush_cache();
+}
+
+/*----------------------------------------------------------*/
+/*Releases the cache tables without writing anything back.  */
+/*----------------------------------------------------------*/
+static void free_cache()
+{
+    free(cache);
+    free(cache_data);
+    free(cache_index);
+    cache = NULL;
+    cache_data = NULL;
+    cache_index = NULL;
+    cache_capacity = 0;
+    cache_used = 0;
+    cache_pending = 0;
+}
+
+/*----------------------------------------------------------*/
+/*Allocates the cache for the current disk geometry. The    */
+/*mmap backend is already memory, so it is left uncached.   */
+/*Returns -1, leaving the disk uncached, if memory runs out.*/
+/*----------------------------------------------------------*/
+static int setup_cache()
+{
+    static int flush_at_exit = 0;
+
+    if (lru <= 0 || disk_map != NULL)
+        return 0;
+
+    /*Dirty blocks must not be lost by a program that exits without syncing*/
+    if (!flush_at_exit)
+    {
+        atexit(flush_cache_at_exit);
+        flush_at_exit = 1;
+    }
+
+    /*Every cached block and as many pending ones fit in half the index*/
+    cache_capacity = lru < MAX_BLOCK ? lru : MAX_BLOCK;
+    index_bits = 2;
+    while ((1u << index_bits) < 4u * cache_capacity)
+        index_bits++;
+    index_mask = (1u << index_bits) - 1;
+
+    cache = malloc(sizeof(cache_entry) * cache_capacity);
+    cache_data = malloc((size_t)cache_capacity * BLOCK_SIZE);
+    cache_index = malloc(sizeof(index_slot) * (index_mask + 1));
+    if (cache == NULL || cache_data == NULL || cache_index == NULL)
+    {
+        printf("Could not allocate a cache of %d blocks\n", cache_capacity);
+        free_cache();
+        return -1;
+    }
+    for (unsigned int i = 0; i <= index_mask; i++)
+        cache_index[i].block = -1;
+
+    cache_used = 0;
+    cache_pending = 0;
+    for (int q = 0; q < 2; q++)
+    {
+        queue_head[q] = -1;
+        queue_tail[q] = -1;
+        queue_len[q] = 0;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Writes back and releases the cache.                       */
+/*----------------------------------------------------------*/
+static void teardown_cache()
+{
+    if (cache == NULL)
+        return;
+
+    /*Also waits for blocks still being read into the cache*/
+    flush_cache();
+    free_cache();
+}
+
+/*----------------------------------------------------------*/
+/*Sets how many blocks the cache holds, 0 to disable it.    */
+/*Dirty blocks are written back before the cache is resized.*/
+/*----------------------------------------------------------*/
+int set_disk_cache_size(int nblocks)
+{
+    if (nblocks < 0)
+        return -1;
+
+    lock_disk();
+    teardown_cache();
+    lru = nblocks;
+    int res = disk_fd >= 0 ? setup_cache() : 0;
+    unlock_disk();
+    return res;
+}
+
+/*----------------------------------------------------------*/
+/*Reports the cache hit and miss counts since the disk was  */
+/*initialized.                                              */
+/*----------------------------------------------------------*/
+void get_disk_cache_stats(long *hits, long *misses)
+{
+    lock_disk();
+    *hits = cache_hits;
+    *misses = cache_misses;
+    unlock_disk();
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int close_disk()
+{
+    lock_disk();
+    teardown_cache();
+#ifdef DISK_HAVE_URING
+    teardown_ring();
+#endif
+    if (disk_map != NULL)
+    {
+        munmap(disk_map, disk_map_len);
+        disk_map = NULL;
+    }
+    if (disk_fd >= 0)
+    {
+        close(disk_fd);
+        disk_fd = -1;
+    }
+    disk_dirty = 0;
+    unlock_disk();
+    return 0;
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    lock_disk();
+
+    /*Set up latency at 0.02 second*/
+    L = 00000.f;
+    /*Set up failure at 10%*/
+    p = -1.f;
+    /*Set up max retry attempts after failure to 3*/
+    MAX_RETRY = 3;
+
+    /*Releases a disk that was left open, flushing it with its own geometry*/
+    close_disk();
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+
+    /*Creates a new file*/
+    disk_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (disk_fd < 0)
+    {
+        printf("Could not create new disk file %s\n\n", filename);
+        unlock_disk();
+        return -1;
+    }
+    
+    /*Sizes the file in one step. The file was just truncated to 0, so every*/
+    /*block is a hole that reads back as 0's until something is written to it*/
+    if (ftruncate(disk_fd, (off_t)MAX_BLOCK * BLOCK_SIZE) < 0)
+    {
+        printf("Could not size disk file %s\n\n", filename);
+        close_disk();
+        unlock_disk();
+        return -1;
+    }
+
+    if (disk_backend == DISK_BACKEND_MMAP && map_disk() < 0)
+    {
+        printf("Could not map disk file %s\n\n", filename);
+        close_disk();
+        unlock_disk();
+        return -1;
+    }
+
+#ifdef DISK_HAVE_URING
+    /*Without a ring the pread path is used*/
+    if (disk_backend == DISK_BACKEND_URING)
+        setup_ring();
+#endif
+
+    /*Runs uncached if there is no memory for the cache*/
+    cache_hits = 0;
+    cache_misses = 0;
+    setup_cache();
+    unlock_disk();
+    return 0;
+}
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    lock_disk();
+
+    /*Set up latency at 0.02 second*/
+    L = 00000.f;
+    /*Set up failure at 10%*/
+    p = -1.f;
+    /*Set up max retry attempts after failure to 3*/
+    MAX_RETRY = 3;
+
+    /*Releases a disk that was left open, flushing it with its own geometry*/
+    close_disk();
+
+    BLOCK_SIZE = block_size;
+    MAX_BLOCK = num_blocks;
+    
+    /*Initializes the random number generator*/
+    srand((unsigned int)(time( 0 )) );
+    
+    /*Opens a file*/
+    disk_fd = open(filename, O_RDWR);
+
+    if (disk_fd < 0)
+    {
+        printf("Could not open %s\n\n", filename);
+        unlock_disk();
+        return -1;
+    }
+
+    if (disk_backend == DISK_BACKEND_MMAP && map_disk() < 0)
+    {
+        printf("Could not map %s\n\n", filename);
+        close_disk();
+        unlock_disk();
+        return -1;
+    }
+
+#ifdef DISK_HAVE_URING
+    /*Without a ring the pread path is used*/
+    if (disk_backend == DISK_BACKEND_URING)
+        setup_ring();
+#endif
+
+    /*Runs uncached if there is no memory for the cache*/
+    cache_hits = 0;
+    cache_misses = 0;
+    setup_cache();
+    unlock_disk();
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Reads a range of blocks, serving cached blocks from memory*/
+/*and fetching each run of missing blocks in one syscall.   */
+/*----------------------------------------------------------*/
+static int read_range(int start_address, int nblocks, char *flat, void **vec, io_status *async)
+{
+    if (disk_map != NULL)
+    {
+        for (int i = 0; i < nblocks; i++)
+            memcpy(BUF_AT(flat, vec, i), disk_map + (size_t)(start_address + i) * BLOCK_SIZE, BLOCK_SIZE);
+        return 0;
+    }
+
+    if (cache == NULL)
+        return transfer_range(start_address, nblocks, flat, vec, 0, FILL_NONE, NULL, async);
+
+    for (int i = 0; i < nblocks; )
+    {
+        int e = cache_lookup(start_address + i);
+        if (e == CACHE_PENDING)
+        {
+            wait_for_block(start_address + i);
+            continue;
+        }
+        if (e >= 0)
+        {
+            memcpy(BUF_AT(flat, vec, i), cache_data + (size_t)e * BLOCK_SIZE, BLOCK_SIZE);
+            cache_touch(e);
+            cache_hits++;
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < nblocks && cache_lookup(start_address + i + run) == -1)
+            run++;
+
+        cache_misses += run;
+        if (transfer_range(start_address + i, run, vec != NULL ? NULL : flat + (size_t)i * BLOCK_SIZE,
+                           vec != NULL ? vec + i : NULL, 0, FILL_CACHE, NULL, async) < 0)
+            return -1;
+        i += run;
+    }
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Writes a range of blocks. Cached writes are held as dirty */
+/*blocks until a flush; strict mode and writes larger than  */
+/*half the cache go straight to the disk file instead.      */
+/*----------------------------------------------------------*/
+static int write_range(int start_address, int nblocks, char *flat, void **vec, io_status *async)
+{
+    if (disk_map != NULL)
+    {
+        for (int i = 0; i < nblocks; i++)
+            memcpy(disk_map + (size_t)(start_address + i) * BLOCK_SIZE, BUF_AT(flat, vec, i), BLOCK_SIZE);
+        return complete_write(start_address, nblocks);
+    }
+
+    if (cache == NULL || sync_mode == DISK_SYNC_STRICT || nblocks > cache_capacity / 2)
+    {
+        if (transfer_range(start_address, nblocks, flat, vec, 1, FILL_NONE, NULL, async) < 0)
+            return -1;
+
+        /*Cached copies now match the disk file, and blocks still being*/
+        /*read into the cache are left out when their read completes   */
+        for (int i = 0; cache != NULL && i < nblocks; i++)
+        {
+            int e = cache_lookup(start_address + i);
+            if (e == CACHE_PENDING)
+                cache_map(start_address + i, -1);
+            if (e >= 0)
+            {
+                memcpy(cache_data + (size_t)e * BLOCK_SIZE, BUF_AT(flat, vec, i), BLOCK_SIZE);
+                cache[e].dirty = 0;
+            }
+        }
+        return complete_write(start_address, nblocks);
+    }
+
+    for (int i = 0; i < nblocks; i++)
+    {
+        int e = cache_lookup(start_address + i);
+        if (e >= 0)
+        {
+            memcpy(cache_data + (size_t)e * BLOCK_SIZE, BUF_AT(flat, vec, i), BLOCK_SIZE);
+            cache[e].dirty = 1;
+            cache_touch(e);
+        }
+        else if (cache_insert(start_address + i, BUF_AT(flat, vec, i), 1) < 0)
+        {
+            return -1;
+        }
+    }
+    disk_dirty = 1;
+    return 0;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    /*Reads the whole range straight into the caller's buffer*/
+    lock_disk();
+    int res = read_range(start_address, nblocks, buffer, NULL, NULL);
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("read error %d\n", start_address);
+        return -1;
+    }
+
+    /*Return the number of blocks read*/
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Pause until the latency duration is elapsed*/
+    if (L > 0)
+        usleep(L * nblocks);
+
+    /*Writes the whole range straight from the caller's buffer*/
+    lock_disk();
+    int res = write_range(start_address, nblocks, buffer, NULL, NULL);
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("write error %d\n", start_address);
+        return -1;
+    }
+
+    /*Return the number of blocks written*/
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Loads a series of blocks into the cache ahead of a read. Blocks    */
+/*already cached are left alone and each run of missing ones is read */
+/*in one call. At most a quarter of the cache, the part the probation*/
+/*queue always keeps, is filled so read-ahead cannot evict itself.   */
+/*Returns the number of blocks covered.                              */
+/*-------------------------------------------------------------------*/
+int prefetch_blocks(int start_address, int nblocks)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    lock_disk();
+    if (disk_map != NULL)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t from = (size_t)start_address * BLOCK_SIZE / page * page;
+        madvise(disk_map + from, (size_t)(start_address + nblocks) * BLOCK_SIZE - from, MADV_WILLNEED);
+        unlock_disk();
+        return nblocks;
+    }
+
+    if (cache == NULL)
+        nblocks = 0;
+    else if (nblocks > cache_capacity / 4)
+        nblocks = cache_capacity / 4;
+
+    /*Each run reads into a buffer of its own, freed once the read is*/
+    /*done, so in a batch the reads overlap with whatever comes next */
+    for (int i = 0; i < nblocks; )
+    {
+        if (cache_lookup(start_address + i) != -1)
+        {
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while (i + run < nblocks && cache_lookup(start_address + i + run) == -1)
+            run++;
+
+        char *buffer = malloc((size_t)run * BLOCK_SIZE);
+        if (buffer == NULL)
+        {
+            nblocks = i;
+            break;
+        }
+        if (transfer_range(start_address + i, run, buffer, NULL, 0, FILL_PREFETCH, buffer, &prefetched) < 0)
+        {
+            unlock_disk();
+            return -1;
+        }
+        i += run;
+    }
+    unlock_disk();
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a contiguous series of blocks into one buffer per block      */
+/*-------------------------------------------------------------------*/
+int readv_blocks(int start_address, int nblocks, void **buffers)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    lock_disk();
+    int res = read_range(start_address, nblocks, NULL, buffers, NULL);
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("read error %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a contiguous series of blocks from one buffer per block    */
+/*------------------------------------------------------------------*/
+int writev_blocks(int start_address, int nblocks, void **buffers)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Pause until the latency duration is elapsed*/
+    if (L > 0)
+        usleep(L * nblocks);
+
+    lock_disk();
+    int res = write_range(start_address, nblocks, NULL, buffers, NULL);
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("write error %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts reading a series of blocks into the buffer. With the        */
+/*io_uring backend the read may still be in flight on return, so the */
+/*buffer must be left alone until wait_disk_io. Otherwise this is    */
+/*read_blocks.                                                       */
+/*-------------------------------------------------------------------*/
+int submit_read_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    lock_disk();
+    int res = read_range(start_address, nblocks, buffer, NULL, &submitted);
+    /*Failures on the synchronous paths are reported by wait_disk_io too*/
+    if (res < 0)
+        submitted.failed = 1;
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("read error %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Starts writing a series of blocks from the buffer, which must be   */
+/*left alone until wait_disk_io when the write is still in flight.   */
+/*-------------------------------------------------------------------*/
+int submit_write_blocks(int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    /*Pause until the latency duration is elapsed*/
+    if (L > 0)
+        usleep(L * nblocks);
+
+    lock_disk();
+    int res = write_range(start_address, nblocks, buffer, NULL, &submitted);
+    /*Failures on the synchronous paths are reported by wait_disk_io too*/
+    if (res < 0)
+        submitted.failed = 1;
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("write error %d\n", start_address);
+        return -1;
+    }
+    return nblocks;
+}
+
+/*-------------------------------------------------------------------*/
+/*Waits for every transfer started with submit_read_blocks or        */
+/*submit_write_blocks. Returns -1 if any of them failed.             */
+/*-------------------------------------------------------------------*/
+int wait_disk_io()
+{
+    lock_disk();
+    int res = wait_io(&submitted);
+    unlock_disk();
+    if (res < 0)
+    {
+        printf("io error\n");
+        return -1;
+    }
+    return 0;
+}
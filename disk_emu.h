@@ -1,5 +1,26 @@
+#define DISK_SYNC_DEFERRED 0  // Writes are batched until sync_disk()
+#define DISK_SYNC_STRICT 1  // Every write is synced before it returns
+
+#define DISK_BACKEND_PREAD 0  // Blocks are transferred with pread/pwrite
+#define DISK_BACKEND_MMAP 1  // The whole image is mapped into memory
+#define DISK_BACKEND_URING 2  // Blocks are transferred through io_uring, several at a time; pread/pwrite where unavailable
+
+#define DISK_CACHE_DEFAULT_BLOCKS 256  // Blocks kept in the block cache unless configured
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int readv_blocks(int start_address, int nblocks, void **buffers);
+int writev_blocks(int start_address, int nblocks, void **buffers);
+int prefetch_blocks(int start_address, int nblocks);
+int submit_read_blocks(int start_address, int nblocks, void *buffer);
+int submit_write_blocks(int start_address, int nblocks, void *buffer);
+int wait_disk_io();
+int set_disk_backend(int backend);
+int set_disk_sync_mode(int mode);
+int set_disk_cache_size(int nblocks);
+void get_disk_cache_stats(long *hits, long *misses);
+int flush_cache();
+int sync_disk();
 int close_disk();
@@ -0,0 +1,546 @@
+/* fuse_lowlevel_test.c
+ *
+ * Tests for the low-level FUSE frontend. fuse_lowlevel_wrappers.c is
+ * compiled in with its main renamed, and the reply functions below take
+ * the place of the FUSE library's, so each handler can be called with no
+ * request behind it and its reply checked. Build it like the frontend,
+ * with the FUSE library.
+ */
+#define main fuse_lowlevel_wrappers_main
+#include "fuse_lowlevel_wrappers.c"
+#undef main
+
+/* What fuse_add_direntry() puts in a listing here */
+struct test_dirent {
+  off_t off;
+  fuse_ino_t ino;
+  mode_t mode;
+  off_t size;
+  char name[24];
+};
+
+/* The last reply a handler sent */
+static struct {
+  int err;  /* The error sent, or 0 for any other reply */
+  struct fuse_entry_param entry;
+  struct stat attr;
+  struct statvfs vfs;
+  size_t count;
+  char data[1 << 19];
+  size_t len;
+} reply;
+
+static int error_count = 0;
+
+int
+fuse_reply_err(fuse_req_t req, int err)
+{
+  reply.err = err;
+  return 0;
+}
+
+void
+fuse_reply_none(fuse_req_t req)
+{
+  reply.err = 0;
+}
+
+int
+fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+  reply.err = 0;
+  reply.entry = *e;
+  return 0;
+}
+
+int
+fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
+                  const struct fuse_file_info *fi)
+{
+  return fuse_reply_entry(req, e);
+}
+
+int
+fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout)
+{
+  reply.err = 0;
+  reply.attr = *attr;
+  return 0;
+}
+
+int
+fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+  reply.err = 0;
+  return 0;
+}
+
+int
+fuse_reply_write(fuse_req_t req, size_t count)
+{
+  reply.err = 0;
+  reply.count = count;
+  return 0;
+}
+
+int
+fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+  reply.err = 0;
+  memcpy(reply.data, buf, size);
+  reply.len = size;
+  return 0;
+}
+
+int
+fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+  return fuse_reply_buf(req, bufv->buf[0].mem, bufv->buf[0].size);
+}
+
+int
+fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
+{
+  reply.err = 0;
+  reply.vfs = *stbuf;
+  return 0;
+}
+
+size_t
+fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name,
+                  const struct stat *stbuf, off_t off)
+{
+  struct test_dirent d;
+
+  if (bufsize >= sizeof(d)) {
+    memset(&d, 0, sizeof(d));
+    d.off = off;
+    d.ino = stbuf->st_ino;
+    d.mode = stbuf->st_mode;
+    d.size = stbuf->st_size;
+    strncpy(d.name, name, sizeof(d.name) - 1);
+    memcpy(buf, &d, sizeof(d));
+  }
+  return sizeof(d);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+size_t
+fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize, const char *name,
+                       const struct fuse_entry_param *e, off_t off)
+{
+  return fuse_add_direntry(req, buf, bufsize, name, &e->attr, off);
+}
+#endif
+
+/* fill_data() - fills buf with bytes that depend on the offset and a
+ * seed, so data read back can be checked without keeping it.
+ */
+static void
+fill_data(char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (char)((offset + i) * 7 + seed);
+  }
+}
+
+/* check_data() - returns 1 if buf holds what fill_data() put there.
+ */
+static int
+check_data(const char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] != (char)((offset + i) * 7 + seed)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* write_buf() - writes len bytes of buf at off through ll_write_buf().
+ */
+static void
+write_buf(fuse_ino_t ino, char *buf, size_t len, off_t off, struct fuse_file_info *fi)
+{
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(len);
+
+  bufv.buf[0].mem = buf;
+  ll_write_buf(NULL, ino, &bufv, off, fi);
+}
+
+/* Names are found and made by inode, files are written and read through
+ * their handles, and each failure is answered with its own error.
+ */
+static void
+test_requests()
+{
+  static char buf[300000];
+  struct fuse_file_info fi, fi2;
+  struct stat attr;
+  fuse_ino_t dir, file;
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  memset(&fi2, 0, sizeof(fi2));
+
+  ll_lookup(NULL, FUSE_ROOT_ID, "missing");
+  if (reply.err != ENOENT) {
+    fprintf(stderr, "ERROR: looking up a missing name gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_mkdir(NULL, FUSE_ROOT_ID, "d", 0755);
+  dir = reply.entry.ino;
+  if (reply.err != 0 || !S_ISDIR(reply.entry.attr.st_mode)) {
+    fprintf(stderr, "ERROR: making directory d\n");
+    error_count++;
+  }
+  ll_mkdir(NULL, FUSE_ROOT_ID, "d", 0755);
+  if (reply.err != EEXIST) {
+    fprintf(stderr, "ERROR: making d twice gave %d\n", reply.err);
+    error_count++;
+  }
+
+  ll_create(NULL, dir, "f", 0644, &fi);
+  file = reply.entry.ino;
+  if (reply.err != 0 || !S_ISREG(reply.entry.attr.st_mode)) {
+    fprintf(stderr, "ERROR: creating d/f\n");
+    error_count++;
+  }
+  fill_data(buf, 0, sizeof(buf), 1);
+  write_buf(file, buf, sizeof(buf), 0, &fi);
+  if (reply.err != 0 || reply.count != sizeof(buf)) {
+    fprintf(stderr, "ERROR: writing %d bytes to d/f\n", (int)sizeof(buf));
+    error_count++;
+  }
+
+  /* A second open shares the file, and reads stop at its end */
+  ll_open(NULL, file, &fi2);
+  ll_read(NULL, file, 131072, 100000, &fi2);
+  if (reply.err != 0 || reply.len != 131072 || !check_data(reply.data, 100000, 131072, 1)) {
+    fprintf(stderr, "ERROR: reading 131072 bytes at 100000\n");
+    error_count++;
+  }
+  ll_read(NULL, file, 131072, 290000, &fi2);
+  if (reply.len != 10000 || !check_data(reply.data, 290000, 10000, 1)) {
+    fprintf(stderr, "ERROR: a read over the end of d/f gave %d bytes\n", (int)reply.len);
+    error_count++;
+  }
+  ll_read(NULL, file, 131072, 400000, &fi2);
+  if (reply.err != 0 || reply.len != 0) {
+    fprintf(stderr, "ERROR: a read past the end of d/f found data\n");
+    error_count++;
+  }
+  ll_getattr(NULL, file, NULL);
+  if (reply.err != 0 || reply.attr.st_size != sizeof(buf)) {
+    fprintf(stderr, "ERROR: d/f has size %ld\n", (long)reply.attr.st_size);
+    error_count++;
+  }
+  ll_unlink(NULL, dir, "f");
+  if (reply.err != EBUSY) {
+    fprintf(stderr, "ERROR: unlinking an open file gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_release(NULL, file, &fi2);
+  ll_release(NULL, file, &fi);
+
+  /* Only a file's size can be set */
+  memset(&attr, 0, sizeof(attr));
+  attr.st_size = 5000;
+  ll_setattr(NULL, file, &attr, FUSE_SET_ATTR_SIZE, NULL);
+  if (reply.err != 0 || reply.attr.st_size != 5000) {
+    fprintf(stderr, "ERROR: setting the size of d/f\n");
+    error_count++;
+  }
+  ll_setattr(NULL, dir, &attr, FUSE_SET_ATTR_SIZE, NULL);
+  if (reply.err != EISDIR) {
+    fprintf(stderr, "ERROR: setting the size of a directory gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_lookup(NULL, dir, "f");
+  if (reply.err != 0 || reply.entry.ino != file || reply.entry.attr.st_size != 5000) {
+    fprintf(stderr, "ERROR: looking up d/f\n");
+    error_count++;
+  }
+
+  ll_rmdir(NULL, FUSE_ROOT_ID, "d");
+  if (reply.err != ENOTEMPTY) {
+    fprintf(stderr, "ERROR: removing a directory that is not empty gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_unlink(NULL, dir, "f");
+  if (reply.err != 0) {
+    fprintf(stderr, "ERROR: unlinking d/f\n");
+    error_count++;
+  }
+  ll_unlink(NULL, dir, "f");
+  if (reply.err != ENOENT) {
+    fprintf(stderr, "ERROR: unlinking d/f twice gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_rmdir(NULL, FUSE_ROOT_ID, "d");
+  ll_getattr(NULL, dir, NULL);
+  if (reply.err != ENOENT) {
+    fprintf(stderr, "ERROR: d is still there after removing it\n");
+    error_count++;
+  }
+}
+
+/* list_dir() - lists dir with ll_readdir(), or ll_readdirplus() if plus
+ * is set, with room for three entries a reply. Checks the entries named
+ * gNN against inodes, and that each is listed once as a file of NN * 10
+ * bytes. Returns the number of entries, or -1 on an error reply.
+ */
+static int
+list_dir(fuse_ino_t dir, int plus, fuse_ino_t *inodes)
+{
+  struct test_dirent *d;
+  int seen[40];
+  off_t off = 0;
+  int k, total = 0;
+
+  memset(seen, 0, sizeof(seen));
+  for (;;) {
+#ifdef FUSE_CAP_READDIRPLUS
+    if (plus)
+      ll_readdirplus(NULL, dir, 3 * sizeof(struct test_dirent) + 10, off, NULL);
+    else
+#endif
+      ll_readdir(NULL, dir, 3 * sizeof(struct test_dirent) + 10, off, NULL);
+    if (reply.err != 0) {
+      return -1;
+    }
+    if (reply.len == 0) {
+      break;
+    }
+    for (d = (struct test_dirent *)reply.data; (char *)d < reply.data + reply.len; d++) {
+      if (d->name[0] == 'g') {
+        k = atoi(d->name + 1);
+        if (k < 0 || k >= 40 || d->ino != inodes[k] || seen[k]++
+            || !S_ISREG(d->mode) || d->size != k * 10) {
+          fprintf(stderr, "ERROR: bad entry %s in the listing\n", d->name);
+          error_count++;
+        }
+      }
+      off = d->off;
+      total++;
+    }
+  }
+  for (k = 0; k < 40; k++) {
+    if (seen[k] != 1) {
+      fprintf(stderr, "ERROR: g%02d listed %d times\n", k, seen[k]);
+      error_count++;
+      break;
+    }
+  }
+  return total;
+}
+
+/* A listing too large for one reply resumes from the offset of the
+ * last entry the kernel got, and gives every name once, with its inode
+ * and attributes.
+ */
+static void
+test_readdir()
+{
+  struct fuse_file_info fi;
+  fuse_ino_t dir, inodes[40];
+  char name[16], data[400];
+  int i;
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  memset(data, 1, sizeof(data));
+  ll_mkdir(NULL, FUSE_ROOT_ID, "list", 0755);
+  dir = reply.entry.ino;
+  for (i = 0; i < 40; i++) {
+    sprintf(name, "g%02d", i);
+    ll_create(NULL, dir, name, 0644, &fi);
+    inodes[i] = reply.entry.ino;
+    if (i > 0) {
+      write_buf(inodes[i], data, i * 10, 0, &fi);
+    }
+    ll_release(NULL, inodes[i], &fi);
+  }
+
+  if (list_dir(dir, 0, inodes) != 42) {
+    fprintf(stderr, "ERROR: listing did not give 42 entries\n");
+    error_count++;
+  }
+#ifdef FUSE_CAP_READDIRPLUS
+  if (list_dir(dir, 1, inodes) != 42) {
+    fprintf(stderr, "ERROR: listing with attributes did not give 42 entries\n");
+    error_count++;
+  }
+#endif
+
+  ll_readdir(NULL, inodes[0], 4096, 0, NULL);
+  if (reply.err != ENOTDIR) {
+    fprintf(stderr, "ERROR: listing a file gave %d\n", reply.err);
+    error_count++;
+  }
+}
+
+/* statfs reports what sfs_statfs() does, and follows a write.
+ */
+static void
+test_statfs()
+{
+  struct fuse_file_info fi;
+  sfs_statfs_t st;
+  char buf[10000];
+
+  mksfs(1);
+  sfs_statfs(&st);
+  ll_statfs(NULL, FUSE_ROOT_ID);
+  if (reply.err != 0 || reply.vfs.f_bsize != st.block_size
+      || reply.vfs.f_blocks != st.total_blocks || reply.vfs.f_bfree != st.free_blocks
+      || reply.vfs.f_files != st.total_inodes || reply.vfs.f_ffree != st.free_inodes
+      || reply.vfs.f_namemax != st.max_name_len) {
+    fprintf(stderr, "ERROR: statfs differs from sfs_statfs\n");
+    error_count++;
+  }
+
+  memset(&fi, 0, sizeof(fi));
+  memset(buf, 0, sizeof(buf));
+  ll_create(NULL, FUSE_ROOT_ID, "s", 0644, &fi);
+  write_buf(reply.entry.ino, buf, sizeof(buf), 0, &fi);
+  ll_release(NULL, 0, &fi);
+  ll_statfs(NULL, FUSE_ROOT_ID);
+  if (reply.vfs.f_bfree > st.free_blocks - sizeof(buf) / st.block_size
+      || reply.vfs.f_ffree != st.free_inodes - 1) {
+    fprintf(stderr, "ERROR: statfs after writing a file\n");
+    error_count++;
+  }
+}
+
+/* -o backend= takes each backend by name, and the default when the
+ * option is missing, and a file written under it reads back.
+ */
+static void
+test_backend_option()
+{
+  static char *names[] = {"mmap", "uring", "pread", NULL};
+  struct fuse_file_info fi;
+  char buf[3000];
+  int i;
+
+  if (set_backend("bogus") != -1) {
+    fprintf(stderr, "ERROR: an unknown backend was accepted\n");
+    error_count++;
+  }
+  for (i = 0; i < 4; i++) {
+    if (set_backend(names[i]) != 0) {
+      fprintf(stderr, "ERROR: backend %s was refused\n", names[i] ? names[i] : "(default)");
+      error_count++;
+      continue;
+    }
+    mksfs(1);
+    memset(&fi, 0, sizeof(fi));
+    fill_data(buf, 0, sizeof(buf), i);
+    ll_create(NULL, FUSE_ROOT_ID, "b", 0644, &fi);
+    write_buf(reply.entry.ino, buf, sizeof(buf), 0, &fi);
+    ll_read(NULL, reply.entry.ino, sizeof(buf), 0, &fi);
+    if (reply.err != 0 || reply.len != sizeof(buf) || !check_data(reply.data, 0, sizeof(buf), i)) {
+      fprintf(stderr, "ERROR: files under backend %s\n", names[i] ? names[i] : "(default)");
+      error_count++;
+    }
+    ll_release(NULL, 0, &fi);
+  }
+}
+
+/* Writes past the end of a file, as sparse or out of order writes
+ * come, grow it to meet them, and the gap reads as zeros.
+ */
+static void
+test_write_past_end()
+{
+  struct fuse_file_info fi;
+  fuse_ino_t file;
+  char buf[3000], zeros[5000];
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  memset(zeros, 0, sizeof(zeros));
+  ll_create(NULL, FUSE_ROOT_ID, "sparse", 0644, &fi);
+  file = reply.entry.ino;
+
+  fill_data(buf, 8000, sizeof(buf), 4);
+  write_buf(file, buf, sizeof(buf), 8000, &fi);
+  if (reply.err != 0 || reply.count != sizeof(buf)) {
+    fprintf(stderr, "ERROR: writing past the end gave %d\n", reply.err);
+    error_count++;
+  }
+  fill_data(buf, 1000, sizeof(buf), 5);
+  write_buf(file, buf, sizeof(buf), 1000, &fi);
+
+  ll_read(NULL, file, 20000, 0, &fi);
+  if (reply.err != 0 || reply.len != 11000 || memcmp(reply.data, zeros, 1000) != 0
+      || !check_data(reply.data + 1000, 1000, 3000, 5)
+      || memcmp(reply.data + 4000, zeros, 4000) != 0
+      || !check_data(reply.data + 8000, 8000, 3000, 4)) {
+    fprintf(stderr, "ERROR: sparse writes read back wrong (%d bytes)\n", (int)reply.len);
+    error_count++;
+  }
+  ll_release(NULL, file, &fi);
+}
+
+/* Requests too large for a buffer to be allocated are answered with
+ * ENOMEM, and the file is left as it was.
+ */
+static void
+test_out_of_memory()
+{
+  struct fuse_file_info fi;
+  struct fuse_bufvec bufv = FUSE_BUFVEC_INIT((size_t)1 << 62);
+  fuse_ino_t file;
+  char buf[100];
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  ll_create(NULL, FUSE_ROOT_ID, "big", 0644, &fi);
+  file = reply.entry.ino;
+  fill_data(buf, 0, sizeof(buf), 6);
+  write_buf(file, buf, sizeof(buf), 0, &fi);
+
+  ll_read(NULL, file, (size_t)1 << 62, 0, &fi);
+  if (reply.err != ENOMEM) {
+    fprintf(stderr, "ERROR: a read too large to buffer gave %d\n", reply.err);
+    error_count++;
+  }
+  bufv.buf[0].mem = buf;
+  ll_write_buf(NULL, file, &bufv, 0, &fi);
+  if (reply.err != ENOMEM) {
+    fprintf(stderr, "ERROR: a write too large to buffer gave %d\n", reply.err);
+    error_count++;
+  }
+  ll_readdir(NULL, FUSE_ROOT_ID, (size_t)1 << 62, 0, NULL);
+  if (reply.err != ENOMEM) {
+    fprintf(stderr, "ERROR: a listing too large to buffer gave %d\n", reply.err);
+    error_count++;
+  }
+
+  ll_read(NULL, file, sizeof(buf), 0, &fi);
+  if (reply.err != 0 || reply.len != sizeof(buf) || !check_data(reply.data, 0, sizeof(buf), 6)) {
+    fprintf(stderr, "ERROR: file changed by requests that failed\n");
+    error_count++;
+  }
+  ll_release(NULL, file, &fi);
+}
+
+int
+main(int argc, char **argv)
+{
+  test_requests();
+  test_readdir();
+  test_statfs();
+  test_backend_option();
+  test_write_past_end();
+  test_out_of_memory();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -0,0 +1,546 @@
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+/* Requests name files by inode, so nothing is looked up by path. FUSE  */
+/* inode numbers are sfs inode numbers plus one, which puts the root    */
+/* directory at FUSE_ROOT_ID.                                            */
+#define SFS_INO(ino) ((int)(ino) - 1)
+#define FUSE_INO(inode) ((fuse_ino_t)(inode) + 1)
+
+#define ATTR_TIMEOUT 1.0  /* Seconds the kernel may keep attributes and names */
+
+/* Open files keep the sfs descriptor in their handle until the last   */
+/* release. sfs opens a file only once, so opens of the same inode     */
+/* share one handle, counted in refs. handles is indexed by sfs inode. */
+typedef struct ll_handle {
+    int fd;
+    int refs;
+    pthread_mutex_t lock;  /* Keeps each seek together with its transfer */
+} ll_handle;
+
+static ll_handle **handles = NULL;
+static int num_handles = 0;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int open_handle(int inode, struct fuse_file_info *fi)
+{
+    int fd;
+
+    pthread_mutex_lock(&handles_lock);
+    if (inode < num_handles && handles[inode] != NULL) {
+        handles[inode]->refs++;
+        fi->fh = inode;
+        pthread_mutex_unlock(&handles_lock);
+        return 0;
+    }
+
+    fd = sfs_fopen_inode(inode);
+    if (fd == -1) {
+        pthread_mutex_unlock(&handles_lock);
+        return -ENOENT;
+    }
+
+    if (inode >= num_handles) {
+        handles = realloc(handles, (inode + 1) * sizeof(ll_handle *));
+        memset(handles + num_handles, 0, (inode + 1 - num_handles) * sizeof(ll_handle *));
+        num_handles = inode + 1;
+    }
+    handles[inode] = malloc(sizeof(ll_handle));
+    handles[inode]->fd = fd;
+    handles[inode]->refs = 1;
+    pthread_mutex_init(&handles[inode]->lock, NULL);
+
+    fi->fh = inode;
+    pthread_mutex_unlock(&handles_lock);
+    return 0;
+}
+
+static ll_handle *get_handle(struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&handles_lock);
+    ll_handle *handle = handles[fi->fh];
+    pthread_mutex_unlock(&handles_lock);
+    return handle;
+}
+
+static void release_handle(struct fuse_file_info *fi)
+{
+    int inode = fi->fh;
+
+    pthread_mutex_lock(&handles_lock);
+    if (--handles[inode]->refs == 0) {
+        sfs_fclose(handles[inode]->fd);
+        pthread_mutex_destroy(&handles[inode]->lock);
+        free(handles[inode]);
+        handles[inode] = NULL;
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+static void set_attr(int inode, int is_dir, int size, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = FUSE_INO(inode);
+    if (is_dir) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = size;
+    }
+}
+
+static int fill_stat(int inode, struct stat *stbuf)
+{
+    int size;
+    int type = sfs_istat(inode, &size);
+
+    if (type != -1)
+        set_attr(inode, type, size, stbuf);
+    return type;
+}
+
+static void set_entry(int inode, int is_dir, int size, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = FUSE_INO(inode);
+    e->attr_timeout = ATTR_TIMEOUT;
+    e->entry_timeout = ATTR_TIMEOUT;
+    set_attr(inode, is_dir, size, &e->attr);
+}
+
+static void reply_entry(fuse_req_t req, int inode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int size;
+    int type = sfs_istat(inode, &size);
+
+    if (type == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    set_entry(inode, type, size, &e);
+    if (fi != NULL)
+        fuse_reply_create(req, &e, fi);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    /* Ask for fewer, larger requests. libfuse already offers the largest */
+    /* max_write its buffers hold, but the kernel sends single pages      */
+    /* without big writes.                                                 */
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ
+            | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    /* Small writes are gathered in the page cache instead */
+    conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+    /* Listings carry attributes, so ls -l needs no lookup per name */
+    conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+#endif
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    int inode = sfs_lookup(SFS_INO(parent), name);
+
+    if (inode == -1)
+        fuse_reply_err(req, ENOENT);
+    else
+        reply_entry(req, inode, NULL);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+
+    if (fill_stat(SFS_INO(ino), &stbuf) == -1)
+        fuse_reply_err(req, ENOENT);
+    else
+        fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+static int truncate_inode(int inode, off_t size)
+{
+    struct fuse_file_info fi;
+    ll_handle *handle;
+    int cur_size;
+    int res;
+
+    res = sfs_istat(inode, &cur_size);
+    if (res == -1)
+        return -ENOENT;
+    if (res == 1)
+        return -EISDIR;
+    if (size > INT_MAX)
+        return -EFBIG;
+
+    /* Shares the descriptor if the file is already open */
+    memset(&fi, 0, sizeof(fi));
+    if ((res = open_handle(inode, &fi)) != 0)
+        return res;
+    handle = get_handle(&fi);
+
+    pthread_mutex_lock(&handle->lock);
+    res = sfs_ftruncate(handle->fd, size) == -1 ? -ENOSPC : 0;
+    pthread_mutex_unlock(&handle->lock);
+
+    release_handle(&fi);
+    return res;
+}
+
+/* Only the size can be changed; other attributes are fixed */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    int res = 0;
+
+    if (to_set & FUSE_SET_ATTR_SIZE)
+        res = truncate_inode(SFS_INO(ino), attr->st_size);
+
+    if (res == 0 && fill_stat(SFS_INO(ino), &stbuf) == -1)
+        res = -ENOENT;
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    int inode = sfs_mkdirat(SFS_INO(parent), name);
+
+    if (inode == -1)
+        fuse_reply_err(req, EEXIST);
+    else
+        reply_entry(req, inode, NULL);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    /* sfs keeps open files, so they cannot be unlinked */
+    if (sfs_unlinkat(SFS_INO(parent), name) == -1)
+        fuse_reply_err(req, sfs_lookup(SFS_INO(parent), name) == -1 ? ENOENT : EBUSY);
+    else
+        fuse_reply_err(req, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    if (sfs_rmdirat(SFS_INO(parent), name) == -1)
+        fuse_reply_err(req, sfs_lookup(SFS_INO(parent), name) == -1 ? ENOENT : ENOTEMPTY);
+    else
+        fuse_reply_err(req, 0);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+        mode_t mode, struct fuse_file_info *fi)
+{
+    int inode = sfs_createat(SFS_INO(parent), name);
+    int res;
+
+    if (inode == -1)
+        fuse_reply_err(req, sfs_lookup(SFS_INO(parent), name) == -1 ? ENOSPC : EISDIR);
+    else if ((res = open_handle(inode, fi)) != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_entry(req, inode, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int res = open_handle(SFS_INO(ino), fi);
+
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_open(req, fi);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    release_handle(fi);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    ll_handle *handle = get_handle(fi);
+    char *buf = malloc(size);
+    int res;
+
+    if (buf == NULL && size > 0) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    /* Reads past the end of the file find nothing */
+    if (off > INT_MAX || sfs_frseek(handle->fd, off) == -1)
+        res = 0;
+    else
+        res = sfs_fread(handle->fd, buf, size);
+    pthread_mutex_unlock(&handle->lock);
+
+    if (res == -1) {
+        fuse_reply_err(req, EIO);
+    } else {
+        /* Spliced to the device when the kernel allows it */
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(res);
+        bufv.buf[0].mem = buf;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    }
+    free(buf);
+}
+
+/* Takes the data as the kernel sent it, which may be a spliced pipe */
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+        off_t off, struct fuse_file_info *fi)
+{
+    ll_handle *handle = get_handle(fi);
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    ssize_t copied;
+    int cur_size;
+    int res;
+
+    bufv.buf[0].mem = malloc(size);
+    if (bufv.buf[0].mem == NULL && size > 0) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    copied = fuse_buf_copy(&bufv, in_buf, 0);
+    if (copied < 0) {
+        free(bufv.buf[0].mem);
+        fuse_reply_err(req, -copied);
+        return;
+    }
+
+    pthread_mutex_lock(&handle->lock);
+    /* Sparse and out of order writes land past the end of the */
+    /* file, so it is grown to meet them, with a hole in the gap */
+    if (off > INT_MAX || sfs_istat(SFS_INO(ino), &cur_size) == -1)
+        res = -EINVAL;
+    else if (off > cur_size && sfs_ftruncate(handle->fd, off) == -1)
+        res = -ENOSPC;
+    else if (sfs_fwseek(handle->fd, off) == -1)
+        res = -EINVAL;
+    else if ((res = sfs_fwrite(handle->fd, bufv.buf[0].mem, copied)) == -1)
+        res = -ENOSPC;
+    pthread_mutex_unlock(&handle->lock);
+
+    free(bufv.buf[0].mem);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+    sfs_statfs_t st;
+
+    sfs_statfs(&st);
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.f_bsize = st.block_size;
+    stbuf.f_frsize = st.block_size;
+    stbuf.f_blocks = st.total_blocks;
+    stbuf.f_bfree = st.free_blocks;
+    stbuf.f_bavail = st.free_blocks;
+    stbuf.f_files = st.total_inodes;
+    stbuf.f_ffree = st.free_inodes;
+    stbuf.f_favail = st.free_inodes;
+    stbuf.f_namemax = st.max_name_len;
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+/* Entries listed per sfs_readdirplusat call */
+#define READDIR_BATCH 32
+
+/* Adds name to a readdir reply, with its attributes if plus is set. */
+/* Returns 0, adding nothing, once the buffer is full.                */
+static int add_direntry(fuse_req_t req, char *buf, size_t size, size_t *used,
+        const char *name, const struct fuse_entry_param *e, off_t next, int plus)
+{
+    size_t len;
+
+#ifdef FUSE_CAP_READDIRPLUS
+    if (plus)
+        len = fuse_add_direntry_plus(req, buf + *used, size - *used, name, e, next);
+    else
+#endif
+        len = fuse_add_direntry(req, buf + *used, size - *used, name, &e->attr, next);
+    if (len > size - *used)
+        return 0;
+    *used += len;
+    return 1;
+}
+
+/* The offset after "." is 1 and after ".." 2; after each name it is the */
+/* sfs_readdirplusat cookie plus 2, so a listing resumes where it        */
+/* stopped. The names and their attributes come from one walk of the     */
+/* directory.                                                            */
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, int plus)
+{
+    sfs_dirent entries[READDIR_BATCH];
+    struct fuse_entry_param e;
+    uint64_t cookie = off > 2 ? off - 2 : 0;
+    char *buf = malloc(size);
+    size_t used = 0;
+    int res = 1;
+    int i;
+
+    if (buf == NULL && size > 0) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* No attributes are given for the dot entries */
+    memset(&e, 0, sizeof(e));
+    e.attr.st_ino = ino;
+    e.attr.st_mode = S_IFDIR;
+    if ((off < 1 && !add_direntry(req, buf, size, &used, ".", &e, 1, plus))
+            || (off < 2 && !add_direntry(req, buf, size, &used, "..", &e, 2, plus)))
+        res = 0;
+
+    while (res > 0 && (res = sfs_readdirplusat(SFS_INO(ino), &cookie, entries, READDIR_BATCH)) > 0) {
+        for (i = 0; i < res; i++) {
+            set_entry(entries[i].inode_num, entries[i].is_dir, entries[i].size, &e);
+            if (!add_direntry(req, buf, size, &used, entries[i].name, &e, entries[i].cookie + 2, plus)) {
+                res = 0;
+                break;
+            }
+        }
+    }
+
+    if (res == -1)
+        fuse_reply_err(req, ENOTDIR);
+    else
+        fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, off, 0);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, off, 1);
+}
+#endif
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = ll_init,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mkdir = ll_mkdir,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .create = ll_create,
+    .open = ll_open,
+    .release = ll_release,
+    .read = ll_read,
+    .write_buf = ll_write_buf,
+    .statfs = ll_statfs,
+    .readdir = ll_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+    .readdirplus = ll_readdirplus,
+#endif
+};
+
+/* Options of our own, taken out before the rest are passed to FUSE. */
+/* -o backend=pread|mmap|uring picks how the image is accessed.       */
+struct sfs_config {
+    char *backend;
+};
+
+static struct fuse_opt sfs_opts[] = {
+    {"backend=%s", offsetof(struct sfs_config, backend), 0},
+    FUSE_OPT_END
+};
+
+static int set_backend(const char *name)
+{
+    if (name == NULL || strcmp(name, "pread") == 0)
+        return sfs_setbackend(SFS_BACKEND_PREAD);
+    if (strcmp(name, "mmap") == 0)
+        return sfs_setbackend(SFS_BACKEND_MMAP);
+    if (strcmp(name, "uring") == 0)
+        return sfs_setbackend(SFS_BACKEND_URING);
+
+    fprintf(stderr, "unknown backend %s\n", name);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct sfs_config config;
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    memset(&config, 0, sizeof(config));
+    if (fuse_opt_parse(&args, &config, sfs_opts, NULL) == -1 || set_backend(config.backend) == -1) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    mksfs(1);
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != -1 &&
+            (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (fuse_daemonize(foreground) != -1)
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+
+    return err ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/* fuse_test.c
+ *
+ * Tests for the FUSE wrappers. fuse_wrappers.c is compiled in with its
+ * main renamed, so the handlers can be called directly without
+ * mounting anything. Build it like the wrappers, with the FUSE library.
+ */
+#define main fuse_wrappers_main
+#include "fuse_wrappers.c"
+#undef main
+
+static int error_count = 0;
+
+/* fill_data() - fills buf with bytes that depend on the offset and a
+ * seed, so data read back can be checked without keeping it.
+ */
+static void
+fill_data(char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (char)((offset + i) * 7 + seed);
+  }
+}
+
+/* check_data() - returns 1 if buf holds what fill_data() put there.
+ */
+static int
+check_data(const char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] != (char)((offset + i) * 7 + seed)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Opens of one file share its descriptor until the last is released.
+ * Writes and reads through either handle go where their offsets say,
+ * and a read past the end of the file finds nothing.
+ */
+static void
+test_handles()
+{
+  struct fuse_file_info a, b;
+  struct stat st;
+  char buf[5000], back[5000];
+
+  mksfs(1);
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  if (fuse_create("/x", 0644, &a) != 0 || fuse_open("/x", &b) != 0 || a.fh != b.fh) {
+    fprintf(stderr, "ERROR: opening /x twice\n");
+    error_count++;
+    return;
+  }
+
+  fill_data(buf, 0, 5000, 1);
+  if (fuse_write("/x", buf, 5000, 0, &a) != 5000) {
+    fprintf(stderr, "ERROR: writing 5000 bytes through the first handle\n");
+    error_count++;
+  }
+  fill_data(buf, 10, 100, 2);
+  if (fuse_write("/x", buf, 100, 10, &b) != 100) {
+    fprintf(stderr, "ERROR: writing 100 bytes through the second handle\n");
+    error_count++;
+  }
+  if (fuse_read("/x", back, 5000, 0, &b) != 5000 || !check_data(back, 0, 10, 1)
+      || !check_data(back + 10, 10, 100, 2) || !check_data(back + 110, 110, 4890, 1)) {
+    fprintf(stderr, "ERROR: reading /x back\n");
+    error_count++;
+  }
+  if (fuse_read("/x", back, 10, 9000, &b) != 0) {
+    fprintf(stderr, "ERROR: a read past the end of /x found data\n");
+    error_count++;
+  }
+
+  /* The second handle outlives the first */
+  fuse_release("/x", &a);
+  if (fuse_read("/x", back, 10, 4990, &b) != 10 || !check_data(back, 4990, 10, 1)) {
+    fprintf(stderr, "ERROR: reading /x after releasing the other handle\n");
+    error_count++;
+  }
+  fuse_release("/x", &b);
+
+  if (fuse_open("/x", &a) != 0 || fuse_read("/x", back, 100, 10, &a) != 100
+      || !check_data(back, 10, 100, 2)) {
+    fprintf(stderr, "ERROR: reopening /x after releasing it\n");
+    error_count++;
+  }
+  fuse_release("/x", &a);
+
+  if (fuse_getattr("/x", &st) != 0 || st.st_size != 5000) {
+    fprintf(stderr, "ERROR: /x has the wrong size\n");
+    error_count++;
+  }
+  if (fuse_unlink("/x") != 0 || fuse_getattr("/x", &st) != -ENOENT) {
+    fprintf(stderr, "ERROR: removing /x\n");
+    error_count++;
+  }
+}
+
+/* Truncating through FUSE keeps the file and the bytes before the new
+ * end, by path or through an open handle, and growing it reads as
+ * zeros.
+ */
+static void
+test_truncate()
+{
+  struct fuse_file_info fi;
+  char buf[5000], zeros[1000];
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  memset(zeros, 0, sizeof(zeros));
+  fuse_create("/t", 0644, &fi);
+  fill_data(buf, 0, 5000, 3);
+  fuse_write("/t", buf, 5000, 0, &fi);
+
+  if (fuse_truncate("/t", 100) != 0 || sfs_getfilesize("/t") != 100) {
+    fprintf(stderr, "ERROR: truncating /t by path\n");
+    error_count++;
+  }
+  if (fuse_ftruncate("/t", 3000, &fi) != 0 || sfs_getfilesize("/t") != 3000
+      || fuse_read("/t", buf, 3000, 0, &fi) != 3000 || !check_data(buf, 0, 100, 3)
+      || memcmp(buf + 100, zeros, 1000) != 0) {
+    fprintf(stderr, "ERROR: growing /t through its handle\n");
+    error_count++;
+  }
+  fuse_release("/t", &fi);
+
+  if (fuse_truncate("/t", 10) != 0 || sfs_getfilesize("/t") != 10) {
+    fprintf(stderr, "ERROR: truncating /t with no handle open\n");
+    error_count++;
+  }
+  if (fuse_truncate("/missing", 10) != -ENOENT || sfs_getfilesize("/missing") != -1) {
+    fprintf(stderr, "ERROR: truncating a missing file\n");
+    error_count++;
+  }
+}
+
+/* What readdir_filler() was given */
+static struct {
+  int room;      /* Entries it takes before it reports a full buffer */
+  int count;
+  off_t last;
+  int seen[40];
+} listing;
+
+/* readdir_filler() - a filler for fuse_readdir() that takes a few
+ * entries a call and checks what it is given for each.
+ */
+static int
+readdir_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+  int k;
+
+  if (listing.count == listing.room) {
+    return 1;
+  }
+  if (off <= listing.last) {
+    fprintf(stderr, "ERROR: %s listed at offset %ld\n", name, (long)off);
+    error_count++;
+  }
+  if (name[0] == 'e') {
+    k = atoi(name + 1);
+    if (k < 0 || k >= 40 || stbuf == NULL || !S_ISREG(stbuf->st_mode)
+        || stbuf->st_size != k % 8) {
+      fprintf(stderr, "ERROR: bad entry %s in the listing\n", name);
+      error_count++;
+    }
+    else {
+      listing.seen[k]++;
+    }
+  }
+  listing.count++;
+  listing.last = off;
+  return 0;
+}
+
+/* A listing that fills the kernel's buffer resumes from the offset of
+ * the last entry taken, and gives each name once, with its attributes.
+ */
+static void
+test_readdir()
+{
+  struct fuse_file_info fi;
+  char path[16];
+  off_t off = 0;
+  int i, total = 0;
+
+  mksfs(1);
+  fuse_mkdir("/rd", 0755);
+  for (i = 0; i < 40; i++) {
+    sprintf(path, "/rd/e%02d", i);
+    memset(&fi, 0, sizeof(fi));
+    fuse_create(path, 0644, &fi);
+    fuse_write(path, "abcdefgh", i % 8, 0, &fi);
+    fuse_release(path, &fi);
+  }
+
+  memset(&listing, 0, sizeof(listing));
+  for (;;) {
+    listing.room = 7;
+    listing.count = 0;
+    if (fuse_readdir("/rd", NULL, readdir_filler, off, NULL) != 0) {
+      fprintf(stderr, "ERROR: listing /rd from offset %ld\n", (long)off);
+      error_count++;
+      break;
+    }
+    if (listing.count == 0) {
+      break;
+    }
+    total += listing.count;
+    off = listing.last;
+  }
+  for (i = 0; i < 40; i++) {
+    if (listing.seen[i] != 1) {
+      fprintf(stderr, "ERROR: e%02d listed %d times\n", i, listing.seen[i]);
+      error_count++;
+      break;
+    }
+  }
+  if (total != 42) {
+    fprintf(stderr, "ERROR: listed %d entries of /rd, expected 42\n", total);
+    error_count++;
+  }
+}
+
+/* statfs reports what sfs_statfs() does, and follows a write.
+ */
+static void
+test_statfs()
+{
+  struct fuse_file_info fi;
+  struct statvfs vfs;
+  sfs_statfs_t st;
+  char buf[10000];
+
+  mksfs(1);
+  sfs_statfs(&st);
+  if (fuse_statfs("/", &vfs) != 0 || vfs.f_bsize != st.block_size
+      || vfs.f_blocks != st.total_blocks || vfs.f_bfree != st.free_blocks
+      || vfs.f_bavail != st.free_blocks || vfs.f_files != st.total_inodes
+      || vfs.f_ffree != st.free_inodes || vfs.f_namemax != st.max_name_len) {
+    fprintf(stderr, "ERROR: statfs differs from sfs_statfs\n");
+    error_count++;
+  }
+
+  memset(&fi, 0, sizeof(fi));
+  memset(buf, 0, sizeof(buf));
+  fuse_create("/s", 0644, &fi);
+  fuse_write("/s", buf, sizeof(buf), 0, &fi);
+  fuse_release("/s", &fi);
+  if (fuse_statfs("/", &vfs) != 0 || vfs.f_bfree > st.free_blocks - sizeof(buf) / st.block_size
+      || vfs.f_ffree != st.free_inodes - 1) {
+    fprintf(stderr, "ERROR: statfs after writing a file\n");
+    error_count++;
+  }
+}
+
+/* -o backend= takes each backend by name, and the default when the
+ * option is missing, and a file written under it reads back.
+ */
+static void
+test_backend_option()
+{
+  static char *names[] = {"mmap", "uring", "pread", NULL};
+  struct fuse_file_info fi;
+  char buf[3000];
+  int i;
+
+  if (set_backend("bogus") != -1) {
+    fprintf(stderr, "ERROR: an unknown backend was accepted\n");
+    error_count++;
+  }
+  for (i = 0; i < 4; i++) {
+    if (set_backend(names[i]) != 0) {
+      fprintf(stderr, "ERROR: backend %s was refused\n", names[i] ? names[i] : "(default)");
+      error_count++;
+      continue;
+    }
+    mksfs(1);
+    memset(&fi, 0, sizeof(fi));
+    fill_data(buf, 0, sizeof(buf), i);
+    if (fuse_create("/b", 0644, &fi) != 0
+        || fuse_write("/b", buf, sizeof(buf), 0, &fi) != sizeof(buf)
+        || fuse_read("/b", buf, sizeof(buf), 0, &fi) != sizeof(buf)
+        || !check_data(buf, 0, sizeof(buf), i)) {
+      fprintf(stderr, "ERROR: files under backend %s\n", names[i] ? names[i] : "(default)");
+      error_count++;
+    }
+    fuse_release("/b", &fi);
+  }
+}
+
+/* Writes past the end of a file, as sparse or out of order writes
+ * come, grow it to meet them, and the gap reads as zeros.
+ */
+static void
+test_write_past_end()
+{
+  struct fuse_file_info fi;
+  char buf[3000], zeros[5000], data[20000];
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  memset(zeros, 0, sizeof(zeros));
+  fuse_create("/sparse", 0644, &fi);
+
+  fill_data(buf, 8000, sizeof(buf), 4);
+  if (fuse_write("/sparse", buf, sizeof(buf), 8000, &fi) != sizeof(buf)) {
+    fprintf(stderr, "ERROR: writing past the end of a file\n");
+    error_count++;
+  }
+  fill_data(buf, 1000, sizeof(buf), 5);
+  fuse_write("/sparse", buf, sizeof(buf), 1000, &fi);
+
+  if (fuse_read("/sparse", data, sizeof(data), 0, &fi) != 11000
+      || memcmp(data, zeros, 1000) != 0 || !check_data(data + 1000, 1000, 3000, 5)
+      || memcmp(data + 4000, zeros, 4000) != 0 || !check_data(data + 8000, 8000, 3000, 4)) {
+    fprintf(stderr, "ERROR: sparse writes read back wrong\n");
+    error_count++;
+  }
+  fuse_release("/sparse", &fi);
+}
+
+/* mkdir and rmdir fail with the error that fits: a name taken, a
+ * directory not empty, missing or a file, or a name too long.
+ */
+static void
+test_dir_errors()
+{
+  struct fuse_file_info fi;
+
+  mksfs(1);
+  memset(&fi, 0, sizeof(fi));
+  fuse_mkdir("/d", 0755);
+  fuse_create("/d/f", 0644, &fi);
+  fuse_release("/d/f", &fi);
+
+  if (fuse_mkdir("/d", 0755) != -EEXIST || fuse_mkdir("/missing/sub", 0755) != -ENOENT
+      || fuse_mkdir("/d/f/sub", 0755) != -ENOTDIR
+      || fuse_mkdir("/ANAMEMUCHTOOLONGFORANENTRY", 0755) != -ENAMETOOLONG) {
+    fprintf(stderr, "ERROR: mkdir errors\n");
+    error_count++;
+  }
+  if (fuse_rmdir("/d") != -ENOTEMPTY || fuse_rmdir("/missing") != -ENOENT
+      || fuse_rmdir("/d/f") != -ENOTDIR) {
+    fprintf(stderr, "ERROR: rmdir errors\n");
+    error_count++;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  test_handles();
+  test_truncate();
+  test_readdir();
+  test_statfs();
+  test_backend_option();
+  test_write_past_end();
+  test_dir_errors();
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}
@@ -1,18 +1,80 @@
 #define FUSE_USE_VERSION 30
 
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* Files opened through FUSE keep their sfs descriptor in fi->fh until  */
+/* release. sfs opens a file only once, so opens of the same path share */
+/* one descriptor, counted in refs. handles is indexed by descriptor.   */
+typedef struct fuse_handle {
+    char *path;
+    int refs;
+    pthread_mutex_t lock;  /* Keeps each seek together with its transfer */
+} fuse_handle;
+
+static fuse_handle **handles = NULL;
+static int num_handles = 0;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+    char filename[PATH_MAX];
+    int fd;
+
+    pthread_mutex_lock(&handles_lock);
+    for (fd = 0; fd < num_handles; fd++) {
+        if (handles[fd] != NULL && strcmp(handles[fd]->path, path) == 0) {
+            handles[fd]->refs++;
+            fi->fh = fd;
+            pthread_mutex_unlock(&handles_lock);
+            return 0;
+        }
+    }
+
+    strcpy(filename, path);
+    fd = sfs_fopen(filename);
+    if (fd == -1) {
+        pthread_mutex_unlock(&handles_lock);
+        return -ENOENT;
+    }
+
+    if (fd >= num_handles) {
+        handles = realloc(handles, (fd + 1) * sizeof(fuse_handle *));
+        memset(handles + num_handles, 0, (fd + 1 - num_handles) * sizeof(fuse_handle *));
+        num_handles = fd + 1;
+    }
+    handles[fd] = malloc(sizeof(fuse_handle));
+    handles[fd]->path = strdup(path);
+    handles[fd]->refs = 1;
+    pthread_mutex_init(&handles[fd]->lock, NULL);
+
+    fi->fh = fd;
+    pthread_mutex_unlock(&handles_lock);
+    return 0;
+}
+
+static fuse_handle *get_handle(struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&handles_lock);
+    fuse_handle *handle = handles[fi->fh];
+    pthread_mutex_unlock(&handles_lock);
+    return handle;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -20,7 +82,7 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
 
     memset(stbuf, 0, sizeof(struct stat));
 
-    if (strcmp(path, "/") == 0) {
+    if (sfs_isdir(path) == 1) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
     } else if((size = sfs_getfilesize(path)) != -1) {
@@ -33,28 +95,88 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
     return res;
 }
 
+/* Entries listed per sfs_readdirplus call */
+#define READDIR_BATCH 32
+
+static void fill_dirent_stat(const sfs_dirent *entry, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    if (entry->is_dir) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = entry->size;
+    }
+}
+
+/* The offset after "." is 1 and after ".." 2; after each name it is the */
+/* sfs_readdirplus cookie plus 2, so a listing resumes where it stopped. */
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    sfs_dirent entries[READDIR_BATCH];
+    uint64_t cookie = offset > 2 ? offset - 2 : 0;
+    struct stat stbuf;
+    int res, i;
 
-    if (strcmp(path, "/") != 0)
+    if (sfs_isdir(path) != 1)
         return -ENOENT;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (offset < 1 && filler(buf, ".", NULL, 1))
+        return 0;
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+        return 0;
+
+    while((res = sfs_readdirplus(path, &cookie, entries, READDIR_BATCH)) > 0) {
+        for (i = 0; i < res; i++) {
+            fill_dirent_stat(&entries[i], &stbuf);
+            if (filler(buf, entries[i].name, &stbuf, entries[i].cookie + 2))
+                return 0;
+        }
+    }
+
+    return res == -1 ? -ENOENT : 0;
+}
 
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+/* Turns what sfs_mkdir and sfs_rmdir return into an error for FUSE */
+static int dir_error(int res)
+{
+    switch (res) {
+    case 0:
+        return 0;
+    case SFS_ERR_EXIST:
+        return -EEXIST;
+    case SFS_ERR_NOTEMPTY:
+        return -ENOTEMPTY;
+    case SFS_ERR_NOENT:
+        return -ENOENT;
+    case SFS_ERR_NOTDIR:
+        return -ENOTDIR;
+    case SFS_ERR_NAMETOOLONG:
+        return -ENAMETOOLONG;
+    case SFS_ERR_NOSPC:
+        return -ENOSPC;
+    default:
+        return -EIO;
     }
+}
 
-    return 0;
+static int fuse_mkdir(const char *path, mode_t mode)
+{
+    return dir_error(sfs_mkdir(path));
+}
+
+static int fuse_rmdir(const char *path)
+{
+    return dir_error(sfs_rmdir(path));
 }
 
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
+    char filename[PATH_MAX];
 
     strcpy(filename, path);
     res = sfs_remove(filename);
@@ -66,82 +188,116 @@ static int fuse_unlink(const char *path)
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
-    char filename[MAXFILENAME];
-
-    strcpy(filename, path);
-
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    return open_handle(path, fi);
+}
 
-    sfs_fclose(res);
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    int fd = fi->fh;
+
+    pthread_mutex_lock(&handles_lock);
+    if (--handles[fd]->refs == 0) {
+        sfs_fclose(fd);
+        pthread_mutex_destroy(&handles[fd]->lock);
+        free(handles[fd]->path);
+        free(handles[fd]);
+        handles[fd] = NULL;
+    }
+    pthread_mutex_unlock(&handles_lock);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
+    fuse_handle *handle = get_handle(fi);
+    int fd = fi->fh;
     int res;
 
-    char filename[MAXFILENAME];
+    pthread_mutex_lock(&handle->lock);
+    /* Reads past the end of the file find nothing */
+    if (offset > INT_MAX || sfs_frseek(fd, offset) == -1)
+        res = 0;
+    else
+        res = sfs_fread(fd, buf, size);
+    pthread_mutex_unlock(&handle->lock);
 
-    strcpy(filename, path);
-
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-
-    if(sfs_frseek(fd, offset) == -1)
-        return -errno;
-
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-
-    sfs_fclose(fd);
-    return res;
+    return res == -1 ? -EIO : res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
+    fuse_handle *handle = get_handle(fi);
+    int fd = fi->fh;
     int res;
 
-    char filename[MAXFILENAME];
+    pthread_mutex_lock(&handle->lock);
+    /* Sparse and out of order writes land past the end of the */
+    /* file, so it is grown to meet them, with a hole in the gap */
+    if (offset > INT_MAX)
+        res = -EINVAL;
+    else if (offset > sfs_getfilesize(path) && sfs_ftruncate(fd, offset) == -1)
+        res = -ENOSPC;
+    else if (sfs_fwseek(fd, offset) == -1)
+        res = -EINVAL;
+    else if ((res = sfs_fwrite(fd, (char *)buf, size)) == -1)
+        res = -ENOSPC;
+    pthread_mutex_unlock(&handle->lock);
 
-    strcpy(filename, path);
+    return res;
+}
 
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
+static int fuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    fuse_handle *handle = get_handle(fi);
+    int res;
 
-    if(sfs_fwseek(fd, offset) == -1)
-        return -errno;
+    if (size > INT_MAX)
+        return -EFBIG;
 
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    pthread_mutex_lock(&handle->lock);
+    res = sfs_ftruncate(fi->fh, size);
+    pthread_mutex_unlock(&handle->lock);
 
-    sfs_fclose(fd);
-    return res;
+    return res == -1 ? -ENOSPC : 0;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    struct fuse_file_info fi;
+    int res;
 
-    strcpy(filename, path);
+    if (sfs_isdir(path) == 1)
+        return -EISDIR;
+    if (sfs_getfilesize(path) == -1)
+        return -ENOENT;
 
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    /* Shares the descriptor if the file is already open */
+    memset(&fi, 0, sizeof(fi));
+    if ((res = open_handle(path, &fi)) != 0)
+        return res;
+    res = fuse_ftruncate(path, size, &fi);
+    fuse_release(path, &fi);
+    return res;
+}
+
+static int fuse_statfs(const char *path, struct statvfs *stbuf)
+{
+    sfs_statfs_t st;
+
+    sfs_statfs(&st);
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = st.block_size;
+    stbuf->f_frsize = st.block_size;
+    stbuf->f_blocks = st.total_blocks;
+    stbuf->f_bfree = st.free_blocks;
+    stbuf->f_bavail = st.free_blocks;
+    stbuf->f_files = st.total_inodes;
+    stbuf->f_ffree = st.free_inodes;
+    stbuf->f_favail = st.free_inodes;
+    stbuf->f_namemax = st.max_name_len;
 
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -157,32 +313,66 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
-    int fd;
-
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
-
-    sfs_fclose(fd);
-    return 0;
+    return open_handle(path, fp);
 }
 
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
     .mknod = fuse_mknod,
+    .mkdir = fuse_mkdir,
     .unlink = fuse_unlink,
+    .rmdir = fuse_rmdir,
     .truncate = fuse_truncate,
+    .ftruncate = fuse_ftruncate,
     .open = fuse_open,
+    .release = fuse_release,
     .read = fuse_read,
     .write = fuse_write,
+    .statfs = fuse_statfs,
     .access = fuse_access,
     .create = fuse_create,
 };
 
+/* Options of our own, taken out before the rest are passed to FUSE. */
+/* -o backend=pread|mmap|uring picks how the image is accessed.       */
+struct sfs_config {
+    char *backend;
+};
+
+static struct fuse_opt sfs_opts[] = {
+    {"backend=%s", offsetof(struct sfs_config, backend), 0},
+    FUSE_OPT_END
+};
+
+static int set_backend(const char *name)
+{
+    if (name == NULL || strcmp(name, "pread") == 0)
+        return sfs_setbackend(SFS_BACKEND_PREAD);
+    if (strcmp(name, "mmap") == 0)
+        return sfs_setbackend(SFS_BACKEND_MMAP);
+    if (strcmp(name, "uring") == 0)
+        return sfs_setbackend(SFS_BACKEND_URING);
+
+    fprintf(stderr, "unknown backend %s\n", name);
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct sfs_config config;
+    int res;
+
+    memset(&config, 0, sizeof(config));
+    if (fuse_opt_parse(&args, &config, sfs_opts, NULL) == -1 || set_backend(config.backend) == -1) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
     mksfs(1);
 
-    return fuse_main(argc, argv, &xmp_oper, NULL);
+    res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
@@ -5,34 +5,1714 @@
 #include <fuse.h>
 #include <strings.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "disk_emu.h"
 
 #define DISK_NAME "sfs_will_guthrie.disk"
 #define MAGIC_NUMBER 0xACBD0005
 
-#define NUM_BLOCKS 1024  //Max number of blocks
-#define BLOCK_SIZE 1024
-#define NUM_INODES 100  //Max number of files
+// Geometry of the mounted image, as its superblock records it
+#define BLOCK_SIZE ((int)superblock.block_size)
+#define NUM_BLOCKS ((int)superblock.sfs_size)
+#define NUM_INODES ((int)superblock.inode_table_len)  //Max number of files
 #define ROOT_INODE 0
-#define MAX_FILE_SIZE BLOCK_SIZE * ((BLOCK_SIZE / sizeof(int)) + 12)
+#define DIR_NAME_LEN (MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1)
+#define DENTRY_CACHE_SIZE 1024  // Power of two
+#define MAX_FILE_SIZE INT_MAX  // Sizes and offsets are ints in the API
+#define READAHEAD_MIN 4  // Blocks read ahead once a read continues where the last one ended
+#define READAHEAD_MAX 32
+#define JOURNAL_BLOCKS 32  // Header block plus log, reserved by mksfs(1)
+#define JOURNAL_MAGIC 0x4A524E4C
+
+#define BITMAP_SIZE ((NUM_BLOCKS + 63) / 64)  // Calculates size of 64-bit word array to have a bit for each block
+#define INODE_TABLE_SIZE ((NUM_INODES + 63) / 64)  // Calculates size of 64-bit word array to have a bit for each inode
+#define SetBit(A,k)     ( A[((k)/64)] |= (1ULL << ((k)%64)) )
+#define ClearBit(A,k)   ( A[((k)/64)] &= ~(1ULL << ((k)%64)) )
+#define TestBit(A,k)    ( A[((k)/64)] & (1ULL << ((k)%64)) )
+
+// The tables below are sized for the mounted geometry by init_geometry
+inode_t* inode_table;  // Hold all inodes in memory
+uint64_t* inode_status_table;  // For each bit, 1 = occupied, 0 = not occupied
+uint64_t* block_bitmap;  // For each bit, 1 = occupied, 0 = not occupied
+int first_data_block;  // Blocks before this one hold the superblock and inode table
+int alloc_cursor;  // Next-fit position: block searches resume where the last allocation ended
+uint64_t* alloc_map;  // block_bitmap plus freed blocks the journal holds back until a checkpoint
+int free_block_count;  // Clear bits in alloc_map, kept up to date by set_block_used/set_block_free
+int bitmap_free_count;  // Clear bits in block_bitmap, which also counts blocks held back for the journal
+int free_inode_count;  // Clear bits in inode_status_table, kept up to date by set_inode/rm_inode
+
+file_descriptor* fd_table;  // Holds inode index, pointer and r/w pointer for each file
+uint64_t root_cursor;  // sfs_getnextfilename position in the root directory
 
-#define BITMAP_SIZE (NUM_BLOCKS / (sizeof(int) * 8))  // Calculates size of int array to have a bit for each block
-#define INODE_TABLE_SIZE (NUM_INODES / (sizeof(int) * 8))  // Calculates size of int array to have a bit for each inode
-#define SetBit(A,k)     ( A[(k/32)] |= (1 << (k%32)) )
-#define ClearBit(A,k)   ( A[(k/32)] &= ~(1 << (k%32)) )
-#define TestBit(A,k)    ( A[(k/32)] & (1 << (k%32)) )
+superblock_t superblock;
+
+// ---------------------------------------------------------------------------
+// Locking. The API may be called from several threads at once. A call takes
+// the locks it needs in this order and releases them all before returning:
+//
+//   fd_locks[fd]        a descriptor's pointers, read-ahead and write buffer
+//   txn_lock            shared by every call that changes metadata, and taken
+//                       exclusively to commit, so a commit never holds half
+//                       of another call's changes
+//   dir_lock            every directory tree and the names in them
+//   inode_locks[inode]  a file's size, block mapping and data; a write buffer's
+//                       length also changes under it, as sfs_getfilesize counts it
+//   fd_table_lock       which descriptor is open on which inode
+//   alloc_lock          block bitmap, allocator state and inode status table
+//   dentry_lock         the lookup cache
+//   meta_lock           the journal, the metadata regions and B+tree node copies
+//
+// alloc_lock and meta_lock are recursive. disk_emu serializes the transfers.
+// ---------------------------------------------------------------------------
+
+pthread_mutex_t* fd_locks;
+pthread_rwlock_t txn_lock;
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t* inode_locks;
+pthread_mutex_t fd_table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t alloc_lock;
+pthread_mutex_t dentry_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t meta_lock;
+pthread_mutex_t cursor_lock = PTHREAD_MUTEX_INITIALIZER;  // root_cursor, taken before dir_lock
+pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+
+void init_locks() {
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&alloc_lock, &recursive);
+    pthread_mutex_init(&meta_lock, &recursive);
+    pthread_mutexattr_destroy(&recursive);
+
+    // A commit must not wait behind a steady stream of calls holding txn_lock shared
+    pthread_rwlockattr_t writer_first;
+    pthread_rwlockattr_init(&writer_first);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&writer_first, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&txn_lock, &writer_first);
+    pthread_rwlockattr_destroy(&writer_first);
+}
+
+// An in-memory metadata structure and where it lives on disk. Changes are
+// tracked per block so only the blocks that were touched get written back.
+typedef struct meta_region {
+    void* data;
+    size_t size;
+    int start;
+    char* dirty;  // One flag per block of the region
+} meta_region;
+
+meta_region super_region;
+meta_region inode_region;
+meta_region inode_status_region;
+meta_region bitmap_region;
+
+int calc_inode_table_blocks();
+int count_set_bits(const uint64_t* bitmap, int nbits);
+int metadata_changed();
+int flush_fd(int fileID);
+
+// ---------------------------------------------------------------------------
+// Metadata journal. Images made by mksfs(1) reserve JOURNAL_BLOCKS blocks: a
+// header block followed by a log of transactions. Each call that changes
+// metadata ends with one transaction holding the bytes it changed, as
+// (block, offset, len) records copied from the in-memory tables and from
+// the B+tree nodes it wrote. Transactions are appended to an in-memory copy
+// of the log and written out together at the next sync (group commit). The
+// home blocks are only written at a checkpoint, which applies the log once
+// it is full. mksfs(0) replays whatever log it finds first.
+//
+// Until a checkpoint, B+tree nodes live in node_copies, and blocks freed
+// since the last checkpoint stay marked in alloc_map so they are not reused
+// while an older transaction in the log could still write to them.
+// ---------------------------------------------------------------------------
+
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t seq;  // Sequence number of the first transaction in the log
+} journal_header;
+
+typedef struct txn_header {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t len;  // Bytes of records after the header
+    uint32_t checksum;  // Of seq and the records
+} txn_header;
+
+typedef struct txn_record {
+    uint32_t block;
+    uint16_t offset;
+    uint16_t len;  // Followed by len bytes of data
+} txn_record;
+
+// A range of a region changed by the open transaction
+typedef struct meta_range {
+    meta_region* region;
+    size_t offset;
+    size_t len;
+} meta_range;
+
+// The latest contents of a B+tree node written since the last checkpoint
+typedef struct node_copy {
+    uint32_t block;
+    int lo, hi;  // Bytes changed by the open transaction, empty when lo >= hi
+    char* data;
+} node_copy;
+
+int journal_start;  // First block of the journal, 0 when the image has none
+int journal_len;
+uint32_t journal_seq;  // Sequence number of the next transaction
+char* journal_log;  // In-memory copy of the log, NULL when journaling is off
+int journal_used;  // Bytes of committed transactions in journal_log
+int journal_written;  // Bytes of journal_log already passed to write_blocks
+int strict_sync;  // Commit each transaction to disk as soon as it is made
+
+meta_range* txn_ranges;
+int txn_num_ranges, txn_max_ranges;
+node_copy* node_copies;
+int num_node_copies, max_node_copies;
+
+// Index from block number to node copy: an open-addressed hash table kept at
+// most half full, and rebuilt whenever node_copies is compacted
+typedef struct copy_slot {
+    uint32_t block;
+    int copy;  // Index in node_copies, -1 for an empty slot
+} copy_slot;
+
+copy_slot* copy_index;
+int copy_index_bits;
+uint64_t* txn_freed;  // Blocks freed by the open transaction
+
+int journal_capacity() {
+    return (journal_len - 1) * BLOCK_SIZE;
+}
+
+uint32_t journal_checksum(uint32_t seq, const char* data, int len) {
+    uint32_t hash = 2166136261u ^ seq;  // FNV-1a
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void txn_add_range(meta_region* region, size_t offset, size_t len) {
+    if (txn_num_ranges == txn_max_ranges) {
+        txn_max_ranges = txn_max_ranges == 0 ? 64 : txn_max_ranges * 2;
+        txn_ranges = realloc(txn_ranges, txn_max_ranges * sizeof(meta_range));
+    }
+    txn_ranges[txn_num_ranges].region = region;
+    txn_ranges[txn_num_ranges].offset = offset;
+    txn_ranges[txn_num_ranges].len = len;
+    txn_num_ranges++;
+}
+
+// Returns the slot holding block in copy_index, or the empty slot where it
+// would go
+unsigned int copy_slot_of(uint32_t block) {
+    unsigned int mask = (1u << copy_index_bits) - 1;
+    unsigned int i = block * 2654435761u >> (32 - copy_index_bits);
+    while (copy_index[i].copy != -1 && copy_index[i].block != block) i = (i + 1) & mask;
+    return i;
+}
+
+// Fills copy_index from node_copies, resizing it to at least twice their number
+void index_node_copies() {
+    int bits = 4;
+    while ((1 << bits) < 2 * num_node_copies) bits++;
+    if (bits != copy_index_bits) {
+        free(copy_index);
+        copy_index = malloc(sizeof(copy_slot) << bits);
+        copy_index_bits = bits;
+    }
+    for (int i = 0; i < 1 << bits; i++) {
+        copy_index[i].copy = -1;
+    }
+    for (int i = 0; i < num_node_copies; i++) {
+        unsigned int slot = copy_slot_of(node_copies[i].block);
+        copy_index[slot].block = node_copies[i].block;
+        copy_index[slot].copy = i;
+    }
+}
+
+node_copy* find_node_copy(uint32_t block) {
+    if (num_node_copies == 0) return NULL;
+    int i = copy_index[copy_slot_of(block)].copy;
+    return i == -1 ? NULL : &node_copies[i];
+}
+
+// B+tree nodes are read and written through these, so that while journaling
+// a node's home block is left alone until the next checkpoint. A node with
+// no copy is current on disk and only its tree's writer can change that, so
+// it is read without holding meta_lock.
+void read_node(uint32_t block, void* node) {
+    pthread_mutex_lock(&meta_lock);
+    node_copy* copy = find_node_copy(block);
+    if (copy != NULL) {
+        memcpy(node, copy->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    if (copy == NULL) {
+        read_blocks(block, 1, node);
+    }
+}
+
+void write_node(uint32_t block, void* node) {
+    if (journal_log == NULL) {
+        write_blocks(block, 1, node);
+        return;
+    }
+
+    pthread_mutex_lock(&meta_lock);
+    node_copy* copy = find_node_copy(block);
+    if (copy == NULL) {
+        if (num_node_copies == max_node_copies) {
+            max_node_copies = max_node_copies == 0 ? 16 : max_node_copies * 2;
+            node_copies = realloc(node_copies, max_node_copies * sizeof(node_copy));
+        }
+        copy = &node_copies[num_node_copies++];
+        copy->block = block;
+        copy->lo = BLOCK_SIZE;
+        copy->hi = 0;
+        copy->data = malloc(BLOCK_SIZE);
+        read_blocks(block, 1, copy->data);
+
+        if (2 * num_node_copies > 1 << copy_index_bits) {
+            index_node_copies();
+        } else {
+            unsigned int slot = copy_slot_of(block);
+            copy_index[slot].block = block;
+            copy_index[slot].copy = num_node_copies - 1;
+        }
+    }
+
+    // Only the bytes that differ are logged; replay applies them over the
+    // same contents this copy started from
+    const char* data = node;
+    int lo = 0;
+    int hi = BLOCK_SIZE;
+    while (lo < hi && copy->data[lo] == data[lo]) lo++;
+    while (hi > lo && copy->data[hi - 1] == data[hi - 1]) hi--;
+    if (lo < hi) {
+        memcpy(copy->data + lo, data + lo, hi - lo);
+        if (lo < copy->lo) copy->lo = lo;
+        if (hi > copy->hi) copy->hi = hi;
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+int compare_ranges(const void* a, const void* b) {
+    const meta_range* x = a;
+    const meta_range* y = b;
+    if (x->region->start != y->region->start) return x->region->start - y->region->start;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Appends records for size bytes at offset in block to buf at *len, growing
+// buf as needed. A record holds at most UINT16_MAX bytes, so a whole block
+// of the largest size takes two.
+void add_record(char** buf, int* len, int* max, uint32_t block, int offset, int size, const char* data) {
+    while (size > 0) {
+        int n = size < UINT16_MAX ? size : UINT16_MAX;
+        if (*len + (int)sizeof(txn_record) + n > *max) {
+            *max = (*len + sizeof(txn_record) + n) * 2;
+            *buf = realloc(*buf, *max);
+        }
+        txn_record rec = {block, offset, n};
+        memcpy(*buf + *len, &rec, sizeof(rec));
+        memcpy(*buf + *len + sizeof(rec), data, n);
+        *len += sizeof(rec) + n;
+        offset += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Builds the transaction for everything changed since the last commit: a
+// header, then the changed region ranges merged and split at block
+// boundaries, then the changed bytes of B+tree nodes. Returns its length.
+int build_txn(char** out) {
+    int max = 4096;
+    int len = sizeof(txn_header);
+    char* buf = malloc(max);
+
+    qsort(txn_ranges, txn_num_ranges, sizeof(meta_range), compare_ranges);
+    for (int i = 0; i < txn_num_ranges; ) {
+        meta_region* region = txn_ranges[i].region;
+        size_t from = txn_ranges[i].offset;
+        size_t to = from + txn_ranges[i].len;
+
+        // Ranges closer than a record header are cheaper logged as one
+        for (i++; i < txn_num_ranges && txn_ranges[i].region == region
+                && txn_ranges[i].offset <= to + sizeof(txn_record); i++) {
+            if (txn_ranges[i].offset + txn_ranges[i].len > to) to = txn_ranges[i].offset + txn_ranges[i].len;
+        }
+
+        while (from < to) {
+            size_t block_end = (from / BLOCK_SIZE + 1) * BLOCK_SIZE;
+            size_t end = to < block_end ? to : block_end;
+            add_record(&buf, &len, &max, region->start + from / BLOCK_SIZE, from % BLOCK_SIZE,
+                    end - from, (char*)region->data + from);
+            from = end;
+        }
+    }
+
+    for (int i = 0; i < num_node_copies; i++) {
+        node_copy* copy = &node_copies[i];
+        if (copy->lo < copy->hi) {
+            add_record(&buf, &len, &max, copy->block, copy->lo, copy->hi - copy->lo, copy->data + copy->lo);
+        }
+    }
+
+    txn_header header = {JOURNAL_MAGIC, journal_seq, len - sizeof(txn_header), 0};
+    header.checksum = journal_checksum(header.seq, buf + sizeof(txn_header), header.len);
+    memcpy(buf, &header, sizeof(header));
+
+    *out = buf;
+    return len;
+}
+
+// Writes the records of one transaction to their home blocks
+void apply_records(const char* data, int len) {
+    char* block = malloc(BLOCK_SIZE);
+    for (int pos = 0; pos + (int)sizeof(txn_record) <= len; ) {
+        txn_record rec;
+        memcpy(&rec, data + pos, sizeof(rec));
+        pos += sizeof(rec);
+
+        if (rec.len < BLOCK_SIZE) {
+            read_blocks(rec.block, 1, block);
+        }
+        memcpy(block + rec.offset, data + pos, rec.len);
+        write_blocks(rec.block, 1, block);
+        pos += rec.len;
+    }
+    free(block);
+}
+
+// Applies the transactions at the start of a log, beginning with sequence
+// number *seq and stopping at the first one that is missing, torn or from
+// an earlier round. Leaves *seq at the next sequence number.
+void apply_log(const char* log, int len, uint32_t* seq) {
+    int pos = 0;
+    while (pos + (int)sizeof(txn_header) <= len) {
+        txn_header header;
+        memcpy(&header, log + pos, sizeof(header));
+        if (header.magic != JOURNAL_MAGIC || header.seq != *seq
+                || header.len > (uint32_t)(len - pos - sizeof(header))
+                || header.checksum != journal_checksum(header.seq, log + pos + sizeof(header), header.len)) {
+            break;
+        }
+        apply_records(log + pos + sizeof(header), header.len);
+        pos += sizeof(header) + header.len;
+        (*seq)++;
+    }
+}
+
+void write_journal_header() {
+    journal_header* header = calloc(1, BLOCK_SIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->seq = journal_seq;
+    write_blocks(journal_start, 1, header);
+    free(header);
+}
+
+// Passes the committed transactions not written yet to the disk
+void journal_write() {
+    if (journal_log == NULL || journal_written == journal_used) return;
+
+    int first = journal_written / BLOCK_SIZE;
+    int last = (journal_used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    write_blocks(journal_start + 1 + first, last - first, journal_log + first * BLOCK_SIZE);
+    journal_written = journal_used;
+}
+
+// Makes every committed transaction durable
+int journal_sync() {
+    pthread_mutex_lock(&meta_lock);
+    journal_write();
+    pthread_mutex_unlock(&meta_lock);
+    return sync_disk();
+}
+
+void journal_write_at_exit() {
+    journal_write();
+}
+
+// Applies the log to the home blocks and starts a new, empty one. Blocks
+// freed by committed transactions can be reused afterwards.
+void journal_checkpoint() {
+    if (journal_log == NULL) return;
+    pthread_mutex_lock(&alloc_lock);
+    pthread_mutex_lock(&meta_lock);
+
+    // The log must be durable before any home block changes, and the home
+    // blocks before the header stops pointing at the log
+    journal_sync();
+    for (int pos = 0; pos < journal_used; ) {
+        txn_header header;
+        memcpy(&header, journal_log + pos, sizeof(header));
+        apply_records(journal_log + pos + sizeof(header), header.len);
+        pos += sizeof(header) + header.len;
+    }
+    sync_disk();
+
+    write_journal_header();
+    sync_disk();
+    memset(journal_log, 0, journal_capacity());
+    journal_used = 0;
+    journal_written = 0;
+
+    // Nodes the open transaction has not touched are now current on disk
+    int kept = 0;
+    for (int i = 0; i < num_node_copies; i++) {
+        if (node_copies[i].lo < node_copies[i].hi) {
+            node_copies[kept++] = node_copies[i];
+        } else {
+            free(node_copies[i].data);
+        }
+    }
+    num_node_copies = kept;
+    index_node_copies();
+
+    for (int i = 0; i < BITMAP_SIZE; i++) {
+        alloc_map[i] = block_bitmap[i] | txn_freed[i];
+    }
+    free_block_count = NUM_BLOCKS - count_set_bits(alloc_map, NUM_BLOCKS);
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+void end_txn() {
+    txn_num_ranges = 0;
+    for (int i = 0; i < num_node_copies; i++) {
+        node_copies[i].lo = BLOCK_SIZE;
+        node_copies[i].hi = 0;
+    }
+    memset(txn_freed, 0, BITMAP_SIZE * sizeof(uint64_t));
+}
+
+// Ends the open transaction by appending it to the log
+void journal_commit() {
+    if (!metadata_changed()) return;
+
+    char* txn;
+    int len = build_txn(&txn);
+
+    if (journal_used + len > journal_capacity()) {
+        journal_checkpoint();
+    }
+
+    if (len > journal_capacity()) {
+        // Too big for the log even when it is empty: write it in place
+        apply_records(txn + sizeof(txn_header), len - sizeof(txn_header));
+        sync_disk();
+        end_txn();
+        journal_checkpoint();
+    } else {
+        memcpy(journal_log + journal_used, txn, len);
+        journal_used += len;
+        journal_seq++;
+        end_txn();
+        if (strict_sync) {
+            journal_write();
+        }
+    }
+    free(txn);
+}
+
+// Checks that n blocks can be allocated. If they cannot, blocks held back
+// since the last checkpoint are released first.
+int reserve_blocks(int n) {
+    pthread_mutex_lock(&alloc_lock);
+    pthread_mutex_lock(&meta_lock);
+    if (n > free_block_count && journal_used > 0) {
+        journal_checkpoint();
+    }
+    pthread_mutex_unlock(&meta_lock);
+    int ok = n <= free_block_count;
+    pthread_mutex_unlock(&alloc_lock);
+    return ok;
+}
+
+// Sets up journaling for the mounted image, replaying any transactions a
+// previous mount left in the log. Images without a valid journal are
+// updated in place as before.
+void journal_open() {
+    if (superblock.journal_len < 2 || superblock.journal_len > NUM_BLOCKS / 4
+            || superblock.journal_start < 1 || superblock.journal_start + superblock.journal_len > NUM_BLOCKS) {
+        return;
+    }
+
+    journal_header* header = malloc(BLOCK_SIZE);
+    read_blocks(superblock.journal_start, 1, header);
+    if (header->magic != JOURNAL_MAGIC) {
+        free(header);
+        return;
+    }
+
+    journal_start = superblock.journal_start;
+    journal_len = superblock.journal_len;
+    journal_seq = header->seq;
+    free(header);
+
+    journal_log = malloc(journal_capacity());
+    read_blocks(journal_start + 1, journal_len - 1, journal_log);
+    uint32_t first = journal_seq;
+    apply_log(journal_log, journal_capacity(), &journal_seq);
+    if (journal_seq != first) {
+        sync_disk();
+        write_journal_header();
+        sync_disk();
+    }
+    memset(journal_log, 0, journal_capacity());
+    journal_used = 0;
+    journal_written = 0;
+
+    static int registered = 0;
+    if (!registered) {
+        atexit(journal_write_at_exit);
+        registered = 1;
+    }
+}
+
+// Writes out what the journal holds and turns journaling off, before the
+// disk is closed or reformatted
+void journal_close() {
+    journal_write();
+    free(journal_log);
+    journal_log = NULL;
+    journal_start = 0;
+    journal_len = 0;
+    journal_used = 0;
+    journal_written = 0;
+
+    for (int i = 0; i < num_node_copies; i++) {
+        free(node_copies[i].data);
+    }
+    num_node_copies = 0;
+    index_node_copies();
+    txn_num_ranges = 0;
+}
+
+// Gives a freshly made image an empty journal in the blocks the superblock
+// reserves for it, and starts journaling
+void journal_format() {
+    journal_start = superblock.journal_start;
+    journal_len = superblock.journal_len;
+    journal_seq = 1;
+    write_journal_header();
+    journal_open();
+}
+
+uint64_t blocks_for(uint64_t size, uint64_t block_size) {
+    return (size + block_size - 1) / block_size;
+}
+
+int region_blocks(meta_region* region) {
+    return blocks_for(region->size, BLOCK_SIZE);
+}
+
+void init_region(meta_region* region, void* data, size_t size, int start) {
+    region->data = data;
+    region->size = size;
+    region->start = start;
+    free(region->dirty);
+    region->dirty = calloc(region_blocks(region), sizeof(char));
+}
+
+// Marks the blocks holding bytes [offset, offset + len) of a region as
+// changed, or adds the bytes to the open transaction while journaling
+void mark_region_dirty(meta_region* region, size_t offset, size_t len) {
+    pthread_mutex_lock(&meta_lock);
+    if (journal_log != NULL) {
+        txn_add_range(region, offset, len);
+    } else {
+        for (size_t b = offset / BLOCK_SIZE; b <= (offset + len - 1) / BLOCK_SIZE; b++) {
+            region->dirty[b] = 1;
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+void mark_region_all_dirty(meta_region* region) {
+    mark_region_dirty(region, 0, region->size);
+}
+
+// Writes each run of changed blocks, padding the last block with zeros
+void flush_region(meta_region* region) {
+    int num_blocks = region_blocks(region);
+
+    for (int b = 0; b < num_blocks; b++) {
+        if (!region->dirty[b]) continue;
+
+        int run = 1;
+        while (b + run < num_blocks && region->dirty[b + run]) run++;
+
+        size_t offset = (size_t)b * BLOCK_SIZE;
+        size_t len = (size_t)run * BLOCK_SIZE;
+        if (offset + len > region->size) len = region->size - offset;
+
+        char* buffer = calloc(run, BLOCK_SIZE);
+        memcpy(buffer, (char*)region->data + offset, len);
+        write_blocks(region->start + b, run, buffer);
+        free(buffer);
+
+        memset(region->dirty + b, 0, run);
+        b += run - 1;
+    }
+}
+
+void load_region(meta_region* region) {
+    char* buffer = malloc((size_t)region_blocks(region) * BLOCK_SIZE);
+    read_blocks(region->start, region_blocks(region), buffer);
+    memcpy(region->data, buffer, region->size);
+    free(buffer);
+}
+
+// Whether any metadata changed since the last flush_metadata
+int metadata_changed() {
+    meta_region* regions[] = {&super_region, &inode_region, &inode_status_region, &bitmap_region};
+    pthread_mutex_lock(&meta_lock);
+    int changed = txn_num_ranges > 0;
+    for (int i = 0; i < num_node_copies && !changed; i++) {
+        changed = node_copies[i].lo < node_copies[i].hi;
+    }
+    for (int r = 0; r < 4 && !changed; r++) {
+        for (int b = 0; b < region_blocks(regions[r]) && !changed; b++) {
+            changed = regions[r]->dirty[b];
+        }
+    }
+    pthread_mutex_unlock(&meta_lock);
+    return changed;
+}
+
+// Writes back every metadata block changed since the last flush. While
+// journaling, commits the changes to the log instead.
+void flush_metadata() {
+    pthread_mutex_lock(&alloc_lock);
+    pthread_mutex_lock(&meta_lock);
+    if (journal_log != NULL) {
+        journal_commit();
+    } else {
+        flush_region(&super_region);
+        flush_region(&inode_region);
+        flush_region(&inode_status_region);
+        flush_region(&bitmap_region);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Calls that change metadata run between these. Their changes are flushed
+// together once none of them is part way through.
+void begin_update() {
+    pthread_rwlock_rdlock(&txn_lock);
+}
+
+void end_update() {
+    pthread_rwlock_unlock(&txn_lock);
+    if (!metadata_changed()) return;  // Already flushed along with another call's changes
+
+    pthread_rwlock_wrlock(&txn_lock);
+    flush_metadata();
+    pthread_rwlock_unlock(&txn_lock);
+}
+
+void mark_inode_dirty(int inode_num) {
+    mark_region_dirty(&inode_region, inode_num * sizeof(inode_t), sizeof(inode_t));
+}
+
+void mark_inode_status_dirty(int inode_num) {
+    mark_region_dirty(&inode_status_region, (inode_num / 64) * sizeof(uint64_t), sizeof(uint64_t));
+}
+
+void set_block_used(int block) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!TestBit(alloc_map, block)) free_block_count--;
+    if (!TestBit(block_bitmap, block)) bitmap_free_count--;
+    SetBit(alloc_map, block);
+    SetBit(block_bitmap, block);
+    mark_region_dirty(&bitmap_region, (block / 64) * sizeof(uint64_t), sizeof(uint64_t));
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// While journaling the block stays taken in alloc_map until the next
+// checkpoint, since transactions still in the log may write to it
+void set_block_free(int block) {
+    pthread_mutex_lock(&alloc_lock);
+    if (journal_log != NULL) {
+        SetBit(txn_freed, block);
+    } else {
+        if (TestBit(alloc_map, block)) free_block_count++;
+        ClearBit(alloc_map, block);
+    }
+    if (TestBit(block_bitmap, block)) bitmap_free_count++;
+    ClearBit(block_bitmap, block);
+    mark_region_dirty(&bitmap_region, (block / 64) * sizeof(uint64_t), sizeof(uint64_t));
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Returns the index of the first word at or after word whose bits are not
+// all set, or nwords if there is none. Full words are skipped 256 bits at a time.
+int skip_full_words(const uint64_t* bitmap, int word, int nwords) {
+#ifdef __SSE2__
+    const __m128i ones = _mm_set1_epi32(-1);
+    for (; word + 4 <= nwords; word += 4) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)(bitmap + word));
+        __m128i hi = _mm_loadu_si128((const __m128i*)(bitmap + word + 2));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), ones)) != 0xFFFF) break;
+    }
+#else
+    for (; word + 4 <= nwords; word += 4) {
+        if ((bitmap[word] & bitmap[word + 1] & bitmap[word + 2] & bitmap[word + 3]) != ~0ULL) break;
+    }
+#endif
+    while (word < nwords && bitmap[word] == ~0ULL) word++;
+    return word;
+}
+
+// Returns the first clear bit in [start, nbits) of a bitmap, or -1 if all are set
+int find_clear_bit(const uint64_t* bitmap, int nbits, int start) {
+    if (start >= nbits) return -1;
+
+    int nwords = (nbits + 63) / 64;
+    int word = start / 64;
+
+    // Bits below start in the first word count as taken
+    uint64_t free_bits = ~bitmap[word] & (~0ULL << (start % 64));
+    if (free_bits == 0) {
+        word = skip_full_words(bitmap, word + 1, nwords);
+        if (word >= nwords) return -1;
+        free_bits = ~bitmap[word];
+    }
+
+    int bit = word * 64 + __builtin_ctzll(free_bits);
+    return bit < nbits ? bit : -1;
+}
+
+// Returns the first set bit in [start, nbits) of a bitmap, or nbits if all are clear
+int find_set_bit(const uint64_t* bitmap, int nbits, int start) {
+    if (start >= nbits) return nbits;
+
+    int nwords = (nbits + 63) / 64;
+    int word = start / 64;
+
+    uint64_t used_bits = bitmap[word] & (~0ULL << (start % 64));
+    while (used_bits == 0) {
+        if (++word >= nwords) return nbits;
+        used_bits = bitmap[word];
+    }
+
+    int bit = word * 64 + __builtin_ctzll(used_bits);
+    return bit < nbits ? bit : nbits;
+}
+
+// Counts the set bits among the first nbits of a bitmap
+int count_set_bits(const uint64_t* bitmap, int nbits) {
+    int count = 0;
+    for (int word = 0; word < nbits / 64; word++) {
+        count += __builtin_popcountll(bitmap[word]);
+    }
+    if (nbits % 64 != 0) {
+        count += __builtin_popcountll(bitmap[nbits / 64] & ((1ULL << (nbits % 64)) - 1));
+    }
+    return count;
+}
+
+// Recomputes the allocator state from the bitmaps, done once per mount
+void init_allocator() {
+    memcpy(alloc_map, block_bitmap, BITMAP_SIZE * sizeof(uint64_t));
+    free_block_count = NUM_BLOCKS - count_set_bits(alloc_map, NUM_BLOCKS);
+    bitmap_free_count = free_block_count;
+    free_inode_count = NUM_INODES - count_set_bits(inode_status_table, NUM_INODES);
+    alloc_cursor = first_data_block;
+}
+
+// Looks for a run of want free blocks in [from, to), remembering the longest
+// run seen in best_start/best_len. Returns 1 once a long enough run is found.
+int find_free_run(int from, int to, int want, int* best_start, int* best_len) {
+    int block = from;
+    while ((block = find_clear_bit(alloc_map, to, block)) != -1) {
+        int run_end = find_set_bit(alloc_map, to, block);
+        if (run_end - block > *best_len) {
+            *best_start = block;
+            *best_len = run_end - block < want ? run_end - block : want;
+            if (*best_len == want) return 1;
+        }
+        block = run_end;
+    }
+    return 0;
+}
+
+// Takes up to want adjacent free blocks, starting the search at the cursor
+// and wrapping around to the first data block. If no free run is that long,
+// the longest one is taken instead. Returns the first block and sets got to
+// the number taken, or returns -1 at once when the disk is full.
+int alloc_block_run(int want, int* got) {
+    pthread_mutex_lock(&alloc_lock);
+    int best_start = -1;
+    int best_len = 0;
+    if (free_block_count > 0 && !find_free_run(alloc_cursor, NUM_BLOCKS, want, &best_start, &best_len)) {
+        find_free_run(first_data_block, alloc_cursor, want, &best_start, &best_len);
+    }
+    if (best_start == -1) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
+
+    for (int i = 0; i < best_len; i++) {
+        set_block_used(best_start + i);
+    }
+    alloc_cursor = best_start + best_len < NUM_BLOCKS ? best_start + best_len : first_data_block;
+    pthread_mutex_unlock(&alloc_lock);
+
+    *got = best_len;
+    return best_start;
+}
+
+// Takes the next free data block, or returns -1 if the disk is full
+int alloc_block() {
+    int got;
+    return alloc_block_run(1, &got);
+}
+
+// Returns the disk block holding block i of a file mapped by direct and
+// indirect pointers. Blocks past the 12th come from indirect, which must
+// already hold the file's indirect block.
+int data_block(int inode_num, const int* indirect, int i) {
+    return i >= 12 ? indirect[i - 12] : (int)inode_table[inode_num].direct_ptrs[i];
+}
+
+// Counts how many blocks of a file from block i (stopping before end) are
+// adjacent on disk, so they can be moved with one read_blocks/write_blocks
+int contiguous_blocks(int inode_num, const int* indirect, int i, int end) {
+    int run = 1;
+    while (i + run < end && data_block(inode_num, indirect, i + run) == data_block(inode_num, indirect, i) + run) {
+        run++;
+    }
+    return run;
+}
+
+// Returns the first free inode after the root, or -1 if there is none. The
+// caller holds alloc_lock until set_inode takes it.
+int find_free_inode() {
+    return find_clear_bit(inode_status_table, NUM_INODES, ROOT_INODE + 1);
+}
+
+// ---------------------------------------------------------------------------
+// On-disk B+tree. Each node is one block: a header, then count entries sorted
+// by key. Leaf entries are a key followed by a fixed-size record; interior
+// entries are the smallest key routed to a child followed by the child's
+// block. Every entry lives in the leaf its key routes to, and deletes never
+// rebalance, so a leaf may be left empty.
+// ---------------------------------------------------------------------------
+
+typedef struct btree_header {
+    uint16_t level;  // 0 for leaves
+    uint16_t count;
+    uint32_t next;  // Next node on the same level, 0 for the last one
+} btree_header;
+
+typedef struct btree {
+    unsigned int* root;  // Where the root block is kept, 0 for an empty tree
+    int rec_size;  // Bytes of record stored with each key in the leaves
+    int owner;  // Inode holding the root pointer, marked dirty when it changes
+} btree;
+
+typedef int (*btree_match)(const void* rec, const void* ctx);
+typedef int (*btree_visit)(uint32_t key, void* rec, void* ctx);
+
+int btree_entry_size(btree* tree, btree_header* node) {
+    return sizeof(uint32_t) + (node->level == 0 ? tree->rec_size : sizeof(uint32_t));
+}
+
+int btree_capacity(btree* tree, btree_header* node) {
+    return (BLOCK_SIZE - sizeof(btree_header)) / btree_entry_size(tree, node);
+}
+
+char* btree_entry(btree* tree, btree_header* node, int i) {
+    return (char*)(node + 1) + i * btree_entry_size(tree, node);
+}
+
+uint32_t btree_key(btree* tree, btree_header* node, int i) {
+    uint32_t key;
+    memcpy(&key, btree_entry(tree, node, i), sizeof(key));
+    return key;
+}
+
+// Record of a leaf entry, or the child block of an interior entry
+void* btree_value(btree* tree, btree_header* node, int i) {
+    return btree_entry(tree, node, i) + sizeof(uint32_t);
+}
+
+uint32_t btree_child(btree* tree, btree_header* node, int i) {
+    uint32_t child;
+    memcpy(&child, btree_value(tree, node, i), sizeof(child));
+    return child;
+}
+
+// Node buffers have room for one entry past capacity so a full node can take
+// the insert before it is split
+btree_header* btree_node_alloc() {
+    return malloc(BLOCK_SIZE + 2 * sizeof(uint32_t) + sizeof(directory_entry));
+}
+
+// Index of the last entry with a key <= key, or -1 if every key is larger
+int btree_floor_index(btree* tree, btree_header* node, uint32_t key) {
+    int lo = 0;
+    int hi = node->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (btree_key(tree, node, mid) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+// Child an interior node routes key to; keys below the first entry go left
+int btree_route(btree* tree, btree_header* node, uint32_t key) {
+    int i = btree_floor_index(tree, node, key);
+    return i < 0 ? 0 : i;
+}
+
+// Reads the leaf key routes to into node and returns its block, or 0 for an empty tree
+uint32_t btree_find_leaf(btree* tree, uint32_t key, btree_header* node) {
+    uint32_t block = *tree->root;
+    if (block == 0) return 0;
+
+    read_node(block, node);
+    while (node->level > 0) {
+        block = btree_child(tree, node, btree_route(tree, node, key));
+        read_node(block, node);
+    }
+    return block;
+}
+
+void btree_insert_entry(btree* tree, btree_header* node, int pos, uint32_t key, const void* value) {
+    int size = btree_entry_size(tree, node);
+    char* at = btree_entry(tree, node, pos);
+    memmove(at + size, at, (node->count - pos) * size);
+    memcpy(at, &key, sizeof(key));
+    memcpy(at + sizeof(key), value, size - sizeof(key));
+    node->count++;
+}
+
+void btree_remove_entry(btree* tree, btree_header* node, int pos) {
+    int size = btree_entry_size(tree, node);
+    char* at = btree_entry(tree, node, pos);
+    memmove(at, at + size, (node->count - pos - 1) * size);
+    node->count--;
+}
+
+// Counts the blocks an insert of key could allocate: one per full node on
+// the path that would split, plus a new root if the root splits too
+int btree_blocks_needed(btree* tree, uint32_t key) {
+    if (*tree->root == 0) return 1;
+
+    btree_header* node = btree_node_alloc();
+    uint32_t path[16];
+    int depth = 0;
+    uint32_t block = *tree->root;
+    for (;;) {
+        read_node(block, node);
+        path[depth++] = node->count >= btree_capacity(tree, node);
+        if (node->level == 0 || depth == 16) break;
+        block = btree_child(tree, node, btree_route(tree, node, key));
+    }
+    free(node);
+
+    int needed = 0;
+    while (depth > 0 && path[--depth]) needed++;
+    if (depth == 0 && path[0]) needed++;
+    return needed;
+}
+
+// Splits an overfull node into itself and a new right sibling. Leaves are
+// split between two different keys so equal keys stay in one leaf.
+int btree_split(btree* tree, uint32_t block, btree_header* node, uint32_t* split_key, uint32_t* split_block) {
+    int mid = node->count / 2;
+    while (mid < node->count && btree_key(tree, node, mid) == btree_key(tree, node, mid - 1)) mid++;
+    if (mid == node->count) {
+        mid = node->count / 2;
+        while (mid > 0 && btree_key(tree, node, mid) == btree_key(tree, node, mid - 1)) mid--;
+        if (mid == 0) return -1;  // Every key is the same
+    }
+
+    int right_block = alloc_block();
+    if (right_block == -1) return -1;
+
+    btree_header* right = btree_node_alloc();
+    memset(right, 0, BLOCK_SIZE);
+    right->level = node->level;
+    right->count = node->count - mid;
+    right->next = node->next;
+    memcpy(right + 1, btree_entry(tree, node, mid), right->count * btree_entry_size(tree, node));
+
+    node->count = mid;
+    node->next = right_block;
+
+    *split_key = btree_key(tree, right, 0);
+    *split_block = right_block;
+    write_node(right_block, right);
+    write_node(block, node);
+    free(right);
+    return 1;
+}
+
+// Inserts below block. Returns 1 if the node split, with the new sibling in
+// split_key/split_block, 0 if it did not, or -1 on failure.
+int btree_insert_at(btree* tree, uint32_t block, uint32_t key, const void* rec,
+        uint32_t* split_key, uint32_t* split_block) {
+    btree_header* node = btree_node_alloc();
+    read_node(block, node);
+
+    int res;
+    if (node->level == 0) {
+        btree_insert_entry(tree, node, btree_floor_index(tree, node, key) + 1, key, rec);
+    } else {
+        int i = btree_route(tree, node, key);
+        uint32_t child_key, child_block;
+        res = btree_insert_at(tree, btree_child(tree, node, i), key, rec, &child_key, &child_block);
+        if (res != 1) {
+            free(node);
+            return res;
+        }
+        btree_insert_entry(tree, node, i + 1, child_key, &child_block);
+    }
+
+    if (node->count <= btree_capacity(tree, node)) {
+        write_node(block, node);
+        res = 0;
+    } else {
+        res = btree_split(tree, block, node, split_key, split_block);
+    }
+    free(node);
+    return res;
+}
+
+// Adds key with its record. Fails with -1, changing nothing, if the disk
+// cannot hold the nodes a split would need. The caller holds alloc_lock, so
+// the blocks found free here are still free when a split takes them.
+int btree_insert(btree* tree, uint32_t key, const void* rec) {
+    if (!reserve_blocks(btree_blocks_needed(tree, key))) return -1;
+
+    if (*tree->root == 0) {
+        int root = alloc_block();
+        btree_header* node = btree_node_alloc();
+        memset(node, 0, BLOCK_SIZE);
+        write_node(root, node);
+        free(node);
+        *tree->root = root;
+        mark_inode_dirty(tree->owner);
+    }
+
+    uint32_t split_key, split_block;
+    int res = btree_insert_at(tree, *tree->root, key, rec, &split_key, &split_block);
+    if (res != 1) return res;
+
+    // The root split, so the tree grows a level
+    btree_header* node = btree_node_alloc();
+    read_node(*tree->root, node);
+    uint32_t old_root = *tree->root;
+    uint32_t first_key = 0;
+    int new_root = alloc_block();
+
+    node->level++;
+    node->count = 0;
+    node->next = 0;
+    memset(node + 1, 0, BLOCK_SIZE - sizeof(btree_header));
+    btree_insert_entry(tree, node, 0, first_key, &old_root);
+    btree_insert_entry(tree, node, 1, split_key, &split_block);
+    write_node(new_root, node);
+    free(node);
+
+    *tree->root = new_root;
+    mark_inode_dirty(tree->owner);
+    return 0;
+}
+
+// Finds the entry with key and a record accepted by match (NULL accepts any)
+// in the leaf key routes to. Copies the record to rec if given. Returns 1 if found.
+int btree_find(btree* tree, uint32_t key, btree_match match, const void* ctx, void* rec) {
+    btree_header* node = btree_node_alloc();
+    int found = 0;
+
+    if (btree_find_leaf(tree, key, node) != 0) {
+        for (int i = btree_floor_index(tree, node, key); i >= 0 && btree_key(tree, node, i) == key; i--) {
+            if (match == NULL || match(btree_value(tree, node, i), ctx)) {
+                if (rec != NULL) memcpy(rec, btree_value(tree, node, i), tree->rec_size);
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(node);
+    return found;
+}
+
+// Finds the entry with the largest key <= key below block. Deletes leave
+// separators behind and leaves empty, so the leaf key routes to may hold
+// no such entry; the children before it are then searched, right to left.
+int btree_floor_at(btree* tree, uint32_t block, uint32_t key, uint32_t* found_key, void* rec) {
+    btree_header* node = btree_node_alloc();
+    int found = 0;
+
+    read_node(block, node);
+    if (node->level == 0) {
+        int i = btree_floor_index(tree, node, key);
+        if (i >= 0) {
+            *found_key = btree_key(tree, node, i);
+            memcpy(rec, btree_value(tree, node, i), tree->rec_size);
+            found = 1;
+        }
+    } else {
+        for (int i = btree_route(tree, node, key); i >= 0 && !found; i--) {
+            found = btree_floor_at(tree, btree_child(tree, node, i), key, found_key, rec);
+        }
+    }
+    free(node);
+    return found;
+}
+
+// Finds the entry with the largest key <= key. Returns 1 if there is one.
+int btree_floor(btree* tree, uint32_t key, uint32_t* found_key, void* rec) {
+    return *tree->root != 0 && btree_floor_at(tree, *tree->root, key, found_key, rec);
+}
+
+// Replaces the record of the entry found as in btree_find. Returns 1 if found.
+int btree_update(btree* tree, uint32_t key, btree_match match, const void* ctx, const void* rec) {
+    btree_header* node = btree_node_alloc();
+    int found = 0;
+
+    uint32_t block = btree_find_leaf(tree, key, node);
+    if (block != 0) {
+        for (int i = btree_floor_index(tree, node, key); i >= 0 && btree_key(tree, node, i) == key; i--) {
+            if (match == NULL || match(btree_value(tree, node, i), ctx)) {
+                memcpy(btree_value(tree, node, i), rec, tree->rec_size);
+                write_node(block, node);
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(node);
+    return found;
+}
+
+// Deletes the entry found as in btree_find. Returns 1 if found.
+int btree_delete(btree* tree, uint32_t key, btree_match match, const void* ctx) {
+    btree_header* node = btree_node_alloc();
+    int found = 0;
+
+    uint32_t block = btree_find_leaf(tree, key, node);
+    if (block != 0) {
+        for (int i = btree_floor_index(tree, node, key); i >= 0 && btree_key(tree, node, i) == key; i--) {
+            if (match == NULL || match(btree_value(tree, node, i), ctx)) {
+                btree_remove_entry(tree, node, i);
+                write_node(block, node);
+                found = 1;
+                break;
+            }
+        }
+    }
+    free(node);
+    return found;
+}
+
+// Calls visit on every entry with a key >= from, in key order, until visit
+// returns non-zero. Returns what visit returned last, or 0.
+int btree_iterate(btree* tree, uint32_t from, btree_visit visit, void* ctx) {
+    btree_header* node = btree_node_alloc();
+    int res = 0;
+
+    // Start at the first entry with a key >= from
+    uint32_t block = btree_find_leaf(tree, from, node);
+    int i = block != 0 && from > 0 ? btree_floor_index(tree, node, from - 1) + 1 : 0;
+
+    while (block != 0 && res == 0) {
+        for (; i < node->count && res == 0; i++) {
+            res = visit(btree_key(tree, node, i), btree_value(tree, node, i), ctx);
+        }
+        block = node->next;
+        i = 0;
+        if (block != 0 && res == 0) read_node(block, node);
+    }
+    free(node);
+    return res;
+}
 
-inode_t inode_table[NUM_INODES];  // Hold all inodes in memory
-int inode_status_table[INODE_TABLE_SIZE];  // For each bit, 1 = occupied, 0 = not occupied
-int block_bitmap[BITMAP_SIZE];  // For each bit, 1 = occupied, 0 = not occupied
+void btree_free_at(btree* tree, uint32_t block) {
+    btree_header* node = btree_node_alloc();
+    read_node(block, node);
+    for (int i = 0; node->level > 0 && i < node->count; i++) {
+        btree_free_at(tree, btree_child(tree, node, i));
+    }
+    free(node);
+    set_block_free(block);
+}
 
-file_descriptor fd_table[NUM_INODES];  // Holds inode index, pointer and r/w pointer for each file
-directory_entry root_dir[NUM_INODES];  // Holds inode number and file name for each file
-int current_file_inode_num;  // Tracks the inode number of the current file in directory
+// Frees every node of the tree and leaves it empty
+void btree_free(btree* tree) {
+    if (*tree->root == 0) return;
+    btree_free_at(tree, *tree->root);
+    *tree->root = 0;
+    mark_inode_dirty(tree->owner);
+}
 
-superblock_t superblock;
+// ---------------------------------------------------------------------------
+// Extent mapping. An inode flagged INODE_EXTENT_FL maps its data with sorted
+// (logical, start, len) extents: up to INODE_EXTENTS in the inode itself,
+// after which all of them move to a B+tree keyed by logical block. Inodes
+// without the flag use the original 12 direct pointers and indirect block;
+// they stay readable and are converted the first time they grow.
+// ---------------------------------------------------------------------------
+
+typedef struct extent_rec {
+    unsigned int start;
+    unsigned int len;
+} extent_rec;
+
+int uses_extents(int inode_num) {
+    return (inode_table[inode_num].mode & INODE_EXTENT_FL) != 0;
+}
+
+btree extent_tree(int inode_num) {
+    btree tree = {&inode_table[inode_num].extent_root, sizeof(extent_rec), inode_num};
+    return tree;
+}
+
+int inline_extent_count(int inode_num) {
+    int count = 0;
+    while (count < INODE_EXTENTS && inode_table[inode_num].extents[count].len != 0) count++;
+    return count;
+}
+
+// Finds the last extent starting at or before logical. Returns 0 if there is none.
+int extent_floor(int inode_num, unsigned int logical, extent_t* out) {
+    inode_t* inode = &inode_table[inode_num];
+
+    if (inode->extent_root != 0) {
+        btree tree = extent_tree(inode_num);
+        extent_rec rec;
+        uint32_t key;
+        if (!btree_floor(&tree, logical, &key, &rec)) return 0;
+        out->logical = key;
+        out->start = rec.start;
+        out->len = rec.len;
+        return 1;
+    }
+
+    int found = 0;
+    for (int i = 0; i < inline_extent_count(inode_num) && inode->extents[i].logical <= logical; i++) {
+        *out = inode->extents[i];
+        found = 1;
+    }
+    return found;
+}
+
+int first_extent_visit(uint32_t key, void* rec, void* ctx) {
+    extent_t* out = ctx;
+    out->logical = key;
+    memcpy(&out->start, rec, sizeof(extent_rec));
+    return 1;
+}
+
+// Finds the first extent starting after logical. Returns 0 if there is none.
+int extent_after(int inode_num, unsigned int logical, extent_t* out) {
+    inode_t* inode = &inode_table[inode_num];
+
+    if (inode->extent_root != 0) {
+        btree tree = extent_tree(inode_num);
+        return btree_iterate(&tree, logical + 1, first_extent_visit, out);
+    }
+
+    for (int i = 0; i < inline_extent_count(inode_num); i++) {
+        if (inode->extents[i].logical > logical) {
+            *out = inode->extents[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int insert_extent_visit(uint32_t key, void* rec, void* ctx) {
+    extent_rec* value = rec;
+    return btree_insert(ctx, key, value) < 0;
+}
+
+// Records that blocks [logical, logical + len) of a file live at start. The
+// range must be a hole. Grows the extent before it when the blocks follow on
+// from it, else adds an extent, moving the inline extents to a tree when full.
+int add_extent(int inode_num, unsigned int logical, unsigned int start, unsigned int len) {
+    inode_t* inode = &inode_table[inode_num];
+    extent_t prev;
+
+    if (extent_floor(inode_num, logical, &prev)
+            && prev.logical + prev.len == logical && prev.start + prev.len == start) {
+        prev.len += len;
+        if (inode->extent_root != 0) {
+            btree tree = extent_tree(inode_num);
+            btree_update(&tree, prev.logical, NULL, NULL, &prev.start);
+        } else {
+            for (int i = 0; i < INODE_EXTENTS; i++) {
+                if (inode->extents[i].logical == prev.logical && inode->extents[i].len != 0) {
+                    inode->extents[i].len = prev.len;
+                    break;
+                }
+            }
+            mark_inode_dirty(inode_num);
+        }
+        return 0;
+    }
+
+    extent_rec rec = {start, len};
+    if (inode->extent_root != 0) {
+        btree tree = extent_tree(inode_num);
+        return btree_insert(&tree, logical, &rec);
+    }
+
+    int count = inline_extent_count(inode_num);
+    if (count < INODE_EXTENTS) {
+        int pos = count;
+        while (pos > 0 && inode->extents[pos - 1].logical > logical) {
+            inode->extents[pos] = inode->extents[pos - 1];
+            pos--;
+        }
+        inode->extents[pos].logical = logical;
+        inode->extents[pos].start = start;
+        inode->extents[pos].len = len;
+        mark_inode_dirty(inode_num);
+        return 0;
+    }
+
+    // The inode is full: move every extent into a new tree. The inline
+    // extents are only cleared once all of them are in it.
+    if (!reserve_blocks(1)) return -1;
+    btree tree = extent_tree(inode_num);
+    for (int i = 0; i < INODE_EXTENTS; i++) {
+        if (btree_insert(&tree, inode->extents[i].logical, &inode->extents[i].start) < 0) {
+            btree_free(&tree);
+            return -1;
+        }
+    }
+    memset(inode->extents, 0, sizeof(inode->extents));
+    mark_inode_dirty(inode_num);
+    return btree_insert(&tree, logical, &rec);
+}
+
+// Finds where block logical of a file is stored. Returns the disk block, or 0
+// if it is a hole, and sets run to how many blocks from logical (at most
+// max_run) continue the same way: adjacent on disk, or all holes.
+int map_file_block(int inode_num, int logical, int max_run, int* run) {
+    inode_t* inode = &inode_table[inode_num];
+
+    if (!uses_extents(inode_num)) {
+        if (logical >= (int)inode->link_cnt) {
+            *run = max_run;
+            return 0;
+        }
+        int indirect[BLOCK_SIZE / sizeof(int)];
+        if (logical + max_run > 12 && inode->link_cnt > 12) {
+            read_blocks(inode->indirect_ptr, 1, indirect);
+        }
+        int end = logical + max_run < (int)inode->link_cnt ? logical + max_run : (int)inode->link_cnt;
+        *run = contiguous_blocks(inode_num, indirect, logical, end);
+        return data_block(inode_num, indirect, logical);
+    }
+
+    extent_t extent;
+    if (extent_floor(inode_num, logical, &extent) && (unsigned int)logical < extent.logical + extent.len) {
+        int left = extent.logical + extent.len - logical;
+        *run = left < max_run ? left : max_run;
+        return extent.start + (logical - extent.logical);
+    }
+
+    *run = max_run;
+    if (extent_after(inode_num, logical, &extent) && (int)(extent.logical - logical) < max_run) {
+        *run = extent.logical - logical;
+    }
+    return 0;
+}
+
+// Reads file block logical into buffer; a hole reads as zeros
+void load_file_block(int inode_num, int logical, char* buffer) {
+    int run;
+    int block = map_file_block(inode_num, logical, 1, &run);
+    if (block == 0) {
+        memset(buffer, 0, BLOCK_SIZE);
+    } else {
+        read_blocks(block, 1, buffer);
+    }
+}
+
+// Counts the blocks in [logical, logical + count) that have no disk block yet
+int count_holes(int inode_num, int logical, int count) {
+    int holes = 0;
+    for (int i = logical; i < logical + count; ) {
+        int run;
+        if (map_file_block(inode_num, i, logical + count - i, &run) == 0) holes += run;
+        i += run;
+    }
+    return holes;
+}
+
+// Gives every hole in [logical, logical + count) a disk block, in runs of
+// adjacent blocks where possible. Returns -1 if the disk fills up.
+int alloc_file_blocks(int inode_num, int logical, int count) {
+    for (int i = logical; i < logical + count; ) {
+        int run;
+        if (map_file_block(inode_num, i, logical + count - i, &run) != 0) {
+            i += run;
+            continue;
+        }
+
+        int got;
+        int start = alloc_block_run(run, &got);
+        if (start == -1) return -1;
+        if (add_extent(inode_num, i, start, got) < 0) {
+            for (int j = 0; j < got; j++) set_block_free(start + j);
+            return -1;
+        }
+        inode_table[inode_num].link_cnt += got;
+        mark_inode_dirty(inode_num);
+        i += got;
+    }
+    return 0;
+}
+
+int free_extent_visit(uint32_t key, void* rec, void* ctx) {
+    extent_rec* extent = rec;
+    for (unsigned int i = 0; i < extent->len; i++) set_block_free(extent->start + i);
+    return 0;
+}
+
+// Frees every data block of a file, and its indirect block or extent tree
+void free_file_blocks(int inode_num) {
+    inode_t* inode = &inode_table[inode_num];
+
+    if (!uses_extents(inode_num)) {
+        int indirect[BLOCK_SIZE / sizeof(int)];
+        if (inode->link_cnt > 12) {
+            read_blocks(inode->indirect_ptr, 1, indirect);
+        }
+        for (int i = 0; i < (int)inode->link_cnt; i++) {
+            set_block_free(data_block(inode_num, indirect, i));
+        }
+        if (inode->link_cnt > 12) {
+            set_block_free(inode->indirect_ptr);
+        }
+    } else if (inode->extent_root != 0) {
+        btree tree = extent_tree(inode_num);
+        btree_iterate(&tree, 0, free_extent_visit, NULL);
+        btree_free(&tree);
+    } else {
+        for (int i = 0; i < inline_extent_count(inode_num); i++) {
+            free_extent_visit(inode->extents[i].logical, &inode->extents[i].start, NULL);
+        }
+    }
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->extent_root = 0;
+    inode->link_cnt = 0;
+    mark_inode_dirty(inode_num);
+}
+
+// Switches a file from direct/indirect pointers to extents. Blocks that are
+// adjacent on disk become one extent, and the indirect block is freed.
+int convert_to_extents(int inode_num) {
+    inode_t* inode = &inode_table[inode_num];
+    if (uses_extents(inode_num)) return 0;
+
+    int num_blocks = inode->link_cnt;
+    unsigned int* blocks = malloc(sizeof(unsigned int) * (num_blocks + 1));
+    int indirect[BLOCK_SIZE / sizeof(int)];
+    if (num_blocks > 12) {
+        read_blocks(inode->indirect_ptr, 1, indirect);
+    }
+    for (int i = 0; i < num_blocks; i++) {
+        blocks[i] = data_block(inode_num, indirect, i);
+    }
+
+    // Worst case every block is its own extent; leaves are at least half full
+    int leaf_entries = (BLOCK_SIZE - sizeof(btree_header)) / (sizeof(uint32_t) + sizeof(extent_rec)) / 2;
+    if (num_blocks > INODE_EXTENTS && !reserve_blocks(num_blocks / leaf_entries + 3)) {
+        free(blocks);
+        return -1;
+    }
+
+    // The original pointers are kept until every block has its extent, and
+    // put back if one cannot be added
+    inode_t legacy = *inode;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->extent_root = 0;
+    inode->mode |= INODE_EXTENT_FL;
+
+    for (int i = 0; i < num_blocks; i++) {
+        if (add_extent(inode_num, i, blocks[i], 1) < 0) {
+            btree tree = extent_tree(inode_num);
+            btree_free(&tree);
+            *inode = legacy;
+            mark_inode_dirty(inode_num);
+            free(blocks);
+            return -1;
+        }
+    }
+    if (num_blocks > 12) {
+        set_block_free(legacy.indirect_ptr);
+    }
+    mark_inode_dirty(inode_num);
+    free(blocks);
+    return 0;
+}
 
-int indirect_block[BLOCK_SIZE / sizeof(int)];
+typedef struct extent_list {
+    extent_t* items;
+    int count, max;
+} extent_list;
+
+int collect_extent_visit(uint32_t key, void* rec, void* ctx) {
+    extent_list* list = ctx;
+    if (list->count == list->max) {
+        list->max = list->max == 0 ? 16 : list->max * 2;
+        list->items = realloc(list->items, list->max * sizeof(extent_t));
+    }
+    list->items[list->count].logical = key;
+    memcpy(&list->items[list->count].start, rec, sizeof(extent_rec));
+    list->count++;
+    return 0;
+}
+
+// Frees the blocks of an extent-mapped file from file block keep on,
+// shortening the extent that runs past it
+void free_blocks_from(int inode_num, unsigned int keep) {
+    inode_t* inode = &inode_table[inode_num];
+    if (keep == 0) {
+        free_file_blocks(inode_num);
+        return;
+    }
+
+    if (inode->extent_root != 0) {
+        // Extents past keep are collected first, as the tree cannot change while it is walked
+        btree tree = extent_tree(inode_num);
+        extent_list past = {NULL, 0, 0};
+        btree_iterate(&tree, keep, collect_extent_visit, &past);
+        for (int i = 0; i < past.count; i++) {
+            free_extent_visit(past.items[i].logical, &past.items[i].start, NULL);
+            btree_delete(&tree, past.items[i].logical, NULL, NULL);
+            inode->link_cnt -= past.items[i].len;
+        }
+        free(past.items);
+
+        extent_t last;
+        if (extent_floor(inode_num, keep - 1, &last) && last.logical + last.len > keep) {
+            for (unsigned int b = keep - last.logical; b < last.len; b++) set_block_free(last.start + b);
+            inode->link_cnt -= last.logical + last.len - keep;
+            last.len = keep - last.logical;
+            btree_update(&tree, last.logical, NULL, NULL, &last.start);
+        }
+    } else {
+        // Inline extents are sorted, so the ones dropped are at the end
+        int count = inline_extent_count(inode_num);
+        for (int i = 0; i < count; i++) {
+            extent_t* extent = &inode->extents[i];
+            if (extent->logical + extent->len <= keep) continue;
+
+            unsigned int from = extent->logical >= keep ? 0 : keep - extent->logical;
+            for (unsigned int b = from; b < extent->len; b++) set_block_free(extent->start + b);
+            inode->link_cnt -= extent->len - from;
+            extent->len = from;
+            if (from == 0) memset(extent, 0, sizeof(extent_t));
+        }
+    }
+    mark_inode_dirty(inode_num);
+}
+
+// Whether an image of num_blocks blocks of block_size bytes can hold the
+// metadata for num_inodes inodes, the journal and some data
+int valid_geometry(uint64_t block_size, uint64_t num_blocks, uint64_t num_inodes) {
+    if (block_size < SFS_MIN_BLOCK_SIZE || block_size > SFS_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0
+            || num_blocks > SFS_MAX_NUM_BLOCKS || num_inodes < 2 || num_inodes > SFS_MAX_NUM_INODES) {
+        return 0;
+    }
+
+    uint64_t meta_blocks = 1 + blocks_for(num_inodes * sizeof(inode_t), block_size)
+            + blocks_for((num_inodes + 63) / 64 * sizeof(uint64_t), block_size)
+            + blocks_for((num_blocks + 63) / 64 * sizeof(uint64_t), block_size);
+
+    // The journal may take at most a quarter of the disk
+    return num_blocks >= 4 * JOURNAL_BLOCKS && meta_blocks + JOURNAL_BLOCKS < num_blocks;
+}
+
+void free_tables() {
+    for (int i = 0; fd_table != NULL && i < NUM_INODES; i++) {
+        free(fd_table[i].wbuf);
+        pthread_mutex_destroy(&fd_locks[i]);
+        pthread_rwlock_destroy(&inode_locks[i]);
+    }
+    free(inode_table);
+    free(inode_status_table);
+    free(block_bitmap);
+    free(alloc_map);
+    free(txn_freed);
+    free(fd_table);
+    free(fd_locks);
+    free(inode_locks);
+}
+
+// Records the geometry in the superblock, which the layout is computed
+// from, and sizes the in-memory tables for it. No other call may run
+// meanwhile, as the per-inode locks are replaced.
+void init_geometry(int block_size, int num_blocks, int num_inodes) {
+    free_tables();
+    superblock.block_size = block_size;
+    superblock.sfs_size = num_blocks;
+    superblock.inode_table_len = num_inodes;
+
+    inode_table = calloc(NUM_INODES, sizeof(inode_t));
+    inode_status_table = calloc(INODE_TABLE_SIZE, sizeof(uint64_t));
+    block_bitmap = calloc(BITMAP_SIZE, sizeof(uint64_t));
+    alloc_map = calloc(BITMAP_SIZE, sizeof(uint64_t));
+    txn_freed = calloc(BITMAP_SIZE, sizeof(uint64_t));
+    fd_table = calloc(NUM_INODES, sizeof(file_descriptor));
+    fd_locks = malloc(NUM_INODES * sizeof(pthread_mutex_t));
+    inode_locks = malloc(NUM_INODES * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < NUM_INODES; i++) {
+        pthread_mutex_init(&fd_locks[i], NULL);
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+// Reads the geometry of the image on disk into super. The superblock starts
+// the first block whatever the block size. Returns 0, or -1 if there is no
+// image or its geometry is not one mksfs makes.
+int read_geometry(superblock_t* super) {
+    char block[SFS_MIN_BLOCK_SIZE];
+    if (init_disk(DISK_NAME, SFS_MIN_BLOCK_SIZE, 1) == -1 || read_blocks(0, 1, block) == -1) {
+        return -1;
+    }
+    memcpy(super, block, sizeof(superblock_t));
+    return valid_geometry(super->block_size, super->sfs_size, super->inode_table_len) ? 0 : -1;
+}
+
+// Sets up the regions for the layout the superblock describes: superblock,
+// inode table, the journal and data after it, and the inode status followed
+// by the bitmap in the last blocks
+void init_layout() {
+    size_t status_size = INODE_TABLE_SIZE * sizeof(uint64_t);
+    size_t bitmap_size = BITMAP_SIZE * sizeof(uint64_t);
+    int bitmap_start = NUM_BLOCKS - blocks_for(bitmap_size, BLOCK_SIZE);
+
+    init_region(&super_region, &superblock, sizeof(superblock), 0);
+    init_region(&inode_region, inode_table, NUM_INODES * sizeof(inode_t), 1);
+    init_region(&inode_status_region, inode_status_table, status_size, bitmap_start - blocks_for(status_size, BLOCK_SIZE));
+    init_region(&bitmap_region, block_bitmap, bitmap_size, bitmap_start);
+    first_data_block = 1 + calc_inode_table_blocks();
+}
 
 void init_inode_status_table() {
     // Must initialize bitmap to all zeros before use
@@ -61,7 +1741,12 @@ void set_inode(int inode_num, int mode, int link_cnt, int uid, int gid, int file
         inode_table[inode_num].direct_ptrs[i] = direct_ptrs[i];
     }
 
+    pthread_mutex_lock(&alloc_lock);
+    if (!TestBit(inode_status_table, inode_num)) free_inode_count--;
     SetBit(inode_status_table, inode_num);
+    mark_inode_dirty(inode_num);
+    mark_inode_status_dirty(inode_num);
+    pthread_mutex_unlock(&alloc_lock);
 }
 
 void rm_inode(int inode_num) {
@@ -76,187 +1761,716 @@ void rm_inode(int inode_num) {
         inode_table[inode_num].direct_ptrs[i] = -1;
     }
 
-    ClearBit(inode_status_table, inode_num);
+    pthread_mutex_lock(&alloc_lock);
+    if (TestBit(inode_status_table, inode_num)) free_inode_count++;
+    ClearBit(inode_status_table, inode_num);
+    mark_inode_dirty(inode_num);
+    mark_inode_status_dirty(inode_num);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Fills in the superblock around the geometry init_geometry recorded
+void init_super(){
+    superblock.magic_number = MAGIC_NUMBER;
+    superblock.root_dir_inode_ptr = ROOT_INODE;
+    superblock.journal_start = first_data_block;
+    superblock.journal_len = JOURNAL_BLOCKS;
+}
+
+void init_inode_table(){
+    for (int i = 0; i < NUM_INODES; i++){
+        rm_inode(i);
+    }
+}
+
+void init_write_buffer(int fileID) {
+    fd_table[fileID].wbuf = NULL;
+    fd_table[fileID].wbuf_size = 0;
+    fd_table[fileID].wbuf_len = 0;
+}
+
+void init_file_descriptor_table(){
+    for (int i = 0; i < NUM_INODES; i++){
+        free(fd_table[i].wbuf);  // Unflushed writes of descriptors left open are dropped
+        init_write_buffer(i);
+        fd_table[i].inode_index = -1;
+    }
+}
+
+int calc_inode_table_blocks() {
+    return blocks_for(NUM_INODES * sizeof(inode_t), BLOCK_SIZE);
+}
+
+// ---------------------------------------------------------------------------
+// Directories. A directory inode (INODE_DIR_FL) keeps each entry in two
+// B+trees: a list keyed by the position the entry was added at, which
+// readdir walks, and an index keyed by a hash of the name, which lookups
+// use. Either costs one block read per level. Names that share a hash are
+// stored in the same index leaf and told apart by comparing the names.
+// file_size counts the entries.
+// ---------------------------------------------------------------------------
+
+// Index record: the entry and where it is in the list
+typedef struct dir_index_rec {
+    uint32_t pos;
+    directory_entry entry;
+} dir_index_rec;
+
+int is_dir(int inode_num) {
+    return (inode_table[inode_num].mode & INODE_DIR_FL) != 0;
+}
+
+btree dir_list(int inode_num) {
+    btree tree = {&inode_table[inode_num].dir_list_root, sizeof(directory_entry), inode_num};
+    return tree;
+}
+
+btree dir_index(int inode_num) {
+    btree tree = {&inode_table[inode_num].dir_index_root, sizeof(dir_index_rec), inode_num};
+    return tree;
+}
+
+unsigned int name_hash(const char* name) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    for (int i = 0; i < DIR_NAME_LEN && name[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Names fill the whole entry when they are DIR_NAME_LEN long, so they are
+// always compared with a bound
+int match_name(const void* rec, const void* ctx) {
+    return strncmp(((const dir_index_rec*)rec)->entry.name, ctx, DIR_NAME_LEN) == 0;
+}
+
+// Direct-mapped cache of recent lookups, so repeated opens and stats of the
+// same paths do not walk the directory trees
+typedef struct dentry {
+    int parent;
+    int inode_num;  // -1 for an empty slot
+    char name[DIR_NAME_LEN];
+} dentry;
+
+dentry dentry_cache[DENTRY_CACHE_SIZE];
+
+dentry* dentry_slot(int parent, const char* name) {
+    unsigned int hash = name_hash(name) ^ ((unsigned int)parent * 2654435761u);
+    return &dentry_cache[hash & (DENTRY_CACHE_SIZE - 1)];
+}
+
+int dentry_matches(dentry* cached, int parent, const char* name) {
+    return cached->inode_num != -1 && cached->parent == parent
+        && strncmp(cached->name, name, DIR_NAME_LEN) == 0;
+}
+
+void clear_dentry_cache() {
+    pthread_mutex_lock(&dentry_lock);
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dentry_cache[i].inode_num = -1;
+    }
+    pthread_mutex_unlock(&dentry_lock);
+}
+
+// Returns the inode called name in directory dir, or -1. The caller holds
+// dir_lock, so no entry can change while the cache is refilled.
+int dir_lookup(int dir, const char* name) {
+    dentry* cached = dentry_slot(dir, name);
+    pthread_mutex_lock(&dentry_lock);
+    int inode_num = dentry_matches(cached, dir, name) ? cached->inode_num : -1;
+    pthread_mutex_unlock(&dentry_lock);
+    if (inode_num != -1) {
+        return inode_num;
+    }
+
+    btree index = dir_index(dir);
+    dir_index_rec rec;
+    if (!btree_find(&index, name_hash(name), match_name, name, &rec)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dentry_lock);
+    cached->parent = dir;
+    cached->inode_num = rec.entry.inode_num;
+    memcpy(cached->name, rec.entry.name, DIR_NAME_LEN);
+    pthread_mutex_unlock(&dentry_lock);
+    return rec.entry.inode_num;
+}
+
+// Adds name to the end of directory dir. Fails with -1, changing nothing, if
+// the disk cannot hold the tree nodes it would need.
+int dir_add(int dir, const char* name, int inode_num) {
+    dir_index_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.pos = inode_table[dir].dir_next_pos;
+    rec.entry.inode_num = inode_num;
+    strncpy(rec.entry.name, name, DIR_NAME_LEN);
+
+    btree list = dir_list(dir);
+    btree index = dir_index(dir);
+    uint32_t hash = name_hash(name);
+    pthread_mutex_lock(&alloc_lock);
+    int res = -1;
+    if (reserve_blocks(btree_blocks_needed(&list, rec.pos) + btree_blocks_needed(&index, hash))
+            && btree_insert(&index, hash, &rec) != -1) {
+        res = btree_insert(&list, rec.pos, &rec.entry);
+        if (res == -1) {
+            btree_delete(&index, hash, match_name, name);
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (res == -1) {
+        return -1;
+    }
+
+    inode_table[dir].dir_next_pos++;
+    inode_table[dir].file_size++;
+    mark_inode_dirty(dir);
+    return 0;
+}
+
+int dir_remove(int dir, const char* name) {
+    btree list = dir_list(dir);
+    btree index = dir_index(dir);
+    uint32_t hash = name_hash(name);
+    dir_index_rec rec;
+    if (!btree_find(&index, hash, match_name, name, &rec)) {
+        return -1;
+    }
+    btree_delete(&index, hash, match_name, name);
+    btree_delete(&list, rec.pos, NULL, NULL);
+
+    dentry* cached = dentry_slot(dir, name);
+    pthread_mutex_lock(&dentry_lock);
+    if (dentry_matches(cached, dir, name)) {
+        cached->inode_num = -1;
+    }
+    pthread_mutex_unlock(&dentry_lock);
+    inode_table[dir].file_size--;
+    mark_inode_dirty(dir);
+    return 0;
+}
+
+// Copies the next component of *path into name (DIR_NAME_LEN + 1 bytes) and
+// moves *path past it. Returns its length, 0 at the end of the path, or -1
+// if the component is too long.
+int next_component(const char** path, char* name) {
+    const char* p = *path;
+    while (*p == '/') p++;
+
+    int len = 0;
+    while (p[len] != '\0' && p[len] != '/') len++;
+    if (len > DIR_NAME_LEN) return -1;
+
+    memcpy(name, p, len);
+    name[len] = '\0';
+    *path = p + len;
+    return len;
+}
+
+// Returns the inode path names, or -1. Paths are relative to the root
+// whether or not they start with '/'.
+int lookup_path(const char* path) {
+    char name[DIR_NAME_LEN + 1];
+    int inode_num = ROOT_INODE;
+    int len;
+
+    while ((len = next_component(&path, name)) > 0) {
+        if (!is_dir(inode_num)) return -1;
+        inode_num = dir_lookup(inode_num, name);
+        if (inode_num == -1) return -1;
+    }
+    return len == 0 ? inode_num : -1;
+}
+
+// Resolves all but the last component of path and copies that one into name
+// (DIR_NAME_LEN + 1 bytes). Returns the directory it belongs in, or
+// SFS_ERR_NOENT if there is no such directory or path names the root,
+// SFS_ERR_NOTDIR if a component is a file, or SFS_ERR_NAMETOOLONG.
+int lookup_parent(const char* path, char* name) {
+    char next[DIR_NAME_LEN + 1];
+    int dir = ROOT_INODE;
+
+    int len = next_component(&path, name);
+    if (len <= 0) return len == 0 ? SFS_ERR_NOENT : SFS_ERR_NAMETOOLONG;
+
+    while ((len = next_component(&path, next)) > 0) {
+        dir = dir_lookup(dir, name);
+        if (dir == -1) return SFS_ERR_NOENT;
+        if (!is_dir(dir)) return SFS_ERR_NOTDIR;
+        memcpy(name, next, len + 1);
+    }
+    return len == 0 ? dir : SFS_ERR_NAMETOOLONG;
+}
+
+// Returns the inode of the regular file path names, or -1
+int get_file_inode(const char* path) {
+    int inode_num = lookup_path(path);
+    return inode_num == -1 || is_dir(inode_num) ? -1 : inode_num;
+}
+
+// Whether inode_num is in use, and a directory if dir is set. The caller
+// holds dir_lock, so it cannot be removed meanwhile.
+int valid_inode(int inode_num, int dir) {
+    if (inode_num < 0 || inode_num >= NUM_INODES || !TestBit(inode_status_table, inode_num)) {
+        return 0;
+    }
+    return !dir || is_dir(inode_num);
+}
+
+// Whether name can be stored as a single entry of a directory
+int valid_name(const char* name) {
+    size_t len = strnlen(name, DIR_NAME_LEN + 1);
+    return len > 0 && len <= DIR_NAME_LEN && strchr(name, '/') == NULL;
+}
+
+// Older images keep the root directory as a fixed table of NUM_INODES entries
+// in the blocks listed by the root inode. Moves those entries into a tree and
+// frees the table. Names created through FUSE were stored with their leading
+// '/', which is dropped.
+int migrate_flat_root() {
+    inode_t* root = &inode_table[ROOT_INODE];
+    int nblocks = (NUM_INODES * sizeof(directory_entry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    directory_entry* flat = malloc((size_t)nblocks * BLOCK_SIZE);
+
+    for (int i = 0; i < nblocks; i++) {
+        read_blocks(root->direct_ptrs[i], 1, (char*)flat + i * BLOCK_SIZE);
+        set_block_free(root->direct_ptrs[i]);
+    }
+
+    int no_ptrs[12] = {0};
+    set_inode(ROOT_INODE, INODE_DIR_FL, 1, 0, 0, 0, no_ptrs, 0);
+
+    int res = 0;
+    for (int i = 0; i < NUM_INODES && res == 0; i++) {
+        if (flat[i].inode_num == -1) continue;
+
+        char name[DIR_NAME_LEN + 1];
+        memcpy(name, flat[i].name, DIR_NAME_LEN);
+        name[DIR_NAME_LEN] = '\0';
+        char* start = name;
+        while (*start == '/') start++;
+        res = dir_add(ROOT_INODE, start, flat[i].inode_num);
+    }
+    free(flat);
+
+    flush_metadata();
+    return res;
+}
+
+// Makes a fresh image with the given geometry and mounts it. The caller
+// holds txn_lock for writing.
+void format_disk(int block_size, int num_blocks, int num_inodes) {
+    init_geometry(block_size, num_blocks, num_inodes);
+    init_layout();
+    init_bitmap_status_table();
+    init_inode_status_table();
+    init_inode_table();
+    init_file_descriptor_table();
+    init_super();
+    clear_dentry_cache();
+    root_cursor = 0;
+
+    init_fresh_disk(DISK_NAME, BLOCK_SIZE, NUM_BLOCKS);
+
+    // Set super block as taken
+    set_block_used(0);
+
+    // Get number of blocks required for inode table
+    int num_inode_table_blocks = calc_inode_table_blocks();
+
+    // Create inode for rootdir, an empty directory whose tree is allocated on first insert
+    int no_ptrs[12] = {0};
+    set_inode(ROOT_INODE, INODE_DIR_FL, 1, 0, 0, 0, no_ptrs, 0);
+
+    // Allocate blocks for inode_table
+    for (int i = 1; i < num_inode_table_blocks + 1; i++) {
+        set_block_used(i);
+    }
+
+    // Allocate blocks for inode_table_bitmap and bitmap, which fill the end of the disk
+    for (int i = inode_status_region.start; i < NUM_BLOCKS; i++) {
+        set_block_used(i);
+    }
+
+    // Allocate blocks for the journal, right after the inode table
+    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
+        set_block_used(first_data_block + i);
+    }
+
+    // Write every metadata block once
+    mark_region_all_dirty(&super_region);
+    mark_region_all_dirty(&inode_region);
+    mark_region_all_dirty(&inode_status_region);
+    mark_region_all_dirty(&bitmap_region);
+    flush_metadata();
+
+    init_allocator();
+    journal_format();
+}
+
+// Mounts the image on disk with the geometry its superblock records. The
+// caller holds txn_lock for writing.
+void mount_disk() {
+    superblock_t disk_super;
+    if (read_geometry(&disk_super) == 0) {
+        init_geometry(disk_super.block_size, disk_super.sfs_size, disk_super.inode_table_len);
+    } else {
+        init_geometry(SFS_DEFAULT_BLOCK_SIZE, SFS_DEFAULT_NUM_BLOCKS, SFS_DEFAULT_NUM_INODES);
+    }
+
+    init_file_descriptor_table();
+    init_disk(DISK_NAME, BLOCK_SIZE, NUM_BLOCKS);
+    clear_dentry_cache();
+    root_cursor = 0;
+
+    init_layout();
+
+    // Finish the transactions a previous mount left in the journal, so
+    // what is loaded below is consistent
+    load_region(&super_region);
+    journal_open();
+
+    // Read superblock, inode table, inode status and bitmap into memory
+    load_region(&super_region);
+    load_region(&inode_region);
+    load_region(&inode_status_region);
+    load_region(&bitmap_region);
+
+    init_allocator();
+
+    if (!is_dir(ROOT_INODE)) {
+        migrate_flat_root();
+    }
+}
+
+// Makes a fresh image with the default geometry if fresh is 1, or mounts the
+// image on disk
+void mksfs(int fresh) {
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&txn_lock);
+    journal_close();
+
+    if (fresh == 1) {
+        format_disk(SFS_DEFAULT_BLOCK_SIZE, SFS_DEFAULT_NUM_BLOCKS, SFS_DEFAULT_NUM_INODES);
+    } else {  // If opening a previously created filesystem
+        mount_disk();
+    }
+    pthread_rwlock_unlock(&txn_lock);
+}
+
+// As mksfs(1), with num_blocks blocks of block_size bytes and room for
+// num_inodes files and directories. Later mounts read the geometry back
+// from the superblock. Returns 0, or -1, changing nothing, if the geometry
+// is out of range or leaves no room for data.
+int mksfs_geometry(int block_size, int num_blocks, int num_inodes) {
+    if (block_size < 0 || num_blocks < 0 || num_inodes < 0 || !valid_geometry(block_size, num_blocks, num_inodes)) {
+        return -1;
+    }
+
+    pthread_once(&locks_once, init_locks);
+    pthread_rwlock_wrlock(&txn_lock);
+    journal_close();
+    format_disk(block_size, num_blocks, num_inodes);
+    pthread_rwlock_unlock(&txn_lock);
+    return 0;
+}
+
+typedef struct readdir_pos {
+    uint32_t pos;
+    directory_entry entry;
+} readdir_pos;
+
+int readdir_visit(uint32_t key, void* rec, void* ctx) {
+    readdir_pos* found = ctx;
+    found->pos = key;
+    memcpy(&found->entry, rec, sizeof(directory_entry));
+    return 1;
+}
+
+// Copies the next name in directory dir to fname and its inode to
+// *inode_num. The caller holds dir_lock. Returns 1, or 0 at the end.
+int next_dir_entry(int dir, uint64_t* cookie, char* fname, int* inode_num) {
+    // The cookie is the position after the last name returned
+    btree list = dir_list(dir);
+    readdir_pos found;
+    if (*cookie > UINT32_MAX || !btree_iterate(&list, *cookie, readdir_visit, &found)) {
+        return 0;
+    }
+
+    // Only the name is copied, so a buffer as long as the name plus its
+    // NUL is enough
+    size_t len = strnlen(found.entry.name, DIR_NAME_LEN);
+    *cookie = (uint64_t)found.pos + 1;
+    memcpy(fname, found.entry.name, len);
+    fname[len] = '\0';
+    if (inode_num != NULL) {
+        *inode_num = found.entry.inode_num;
+    }
+    return 1;
+}
+
+// Copies the next name in directory path to fname, which needs room for
+// the name and its NUL, at most MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 2
+// bytes. Start with *cookie at 0.
+// Returns 1 for each name, 0 at the end, or -1 if path is not a directory.
+// Names are listed in the order they were added.
+int sfs_readdir(const char* path, uint64_t* cookie, char* fname) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int dir = lookup_path(path);
+    int res = dir == -1 || !is_dir(dir) ? -1 : next_dir_entry(dir, cookie, fname, NULL);
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
 }
 
-void init_super(){
-    superblock.magic_number = MAGIC_NUMBER;
-    superblock.block_size = BLOCK_SIZE;
-    superblock.sfs_size = NUM_BLOCKS;
-    superblock.inode_table_len = NUM_INODES;
-    superblock.root_dir_inode_ptr = ROOT_INODE;
+// As sfs_readdir, for the directory with inode dir, also giving the inode
+// of each name in *inode_num
+int sfs_readdirat(int dir, uint64_t* cookie, char* fname, int* inode_num) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int res = valid_inode(dir, 1) ? next_dir_entry(dir, cookie, fname, inode_num) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
 }
 
-void init_inode_table(){
-    for (int i = 0; i < NUM_INODES; i++){
-        rm_inode(i);
+int sfs_getnextfilename(char *fname) {
+    pthread_mutex_lock(&cursor_lock);
+    int res = sfs_readdir("/", &root_cursor, fname) == 1;
+    if (!res) {
+        root_cursor = 0;
     }
+    pthread_mutex_unlock(&cursor_lock);
+    return res;
 }
 
-void init_file_descriptor_table(){
-    for (int i = 0; i < NUM_INODES; i++){
-        fd_table[i].inode_index = -1;
-    }
+int sfs_isdir(const char* path) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int inode_num = lookup_path(path);
+    int res = inode_num == -1 ? -1 : is_dir(inode_num);
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
 }
 
-void init_root(){
-    for (int i = 0; i < NUM_INODES; i++){
-        root_dir[i].inode_num = -1;
-        for (int j = 0; j < (MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1); j++){
-            root_dir[i].name[j] = '\0';
+// Size of file_inode, counting bytes still held in a write buffer. The
+// caller holds dir_lock.
+int inode_size(int file_inode) {
+    pthread_rwlock_rdlock(&inode_locks[file_inode]);
+    int size = inode_table[file_inode].file_size;
+
+    pthread_mutex_lock(&fd_table_lock);
+    for (int i = 0; i < NUM_INODES; i++) {
+        file_descriptor* fd = &fd_table[i];
+        if (fd->inode_index == file_inode && fd->wbuf_len > 0 && (int)(fd->wbuf_pos + fd->wbuf_len) > size) {
+            size = fd->wbuf_pos + fd->wbuf_len;
         }
     }
+    pthread_mutex_unlock(&fd_table_lock);
+    pthread_rwlock_unlock(&inode_locks[file_inode]);
+    return size;
 }
 
-int calc_inode_table_blocks() {
-    int numInodeBlocks = (sizeof(inode_table)/BLOCK_SIZE);
-    if (sizeof(inode_table) % BLOCK_SIZE != 0) numInodeBlocks++;
-    return numInodeBlocks;
+int sfs_getfilesize(const char* path) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int file_inode = get_file_inode(path);
+    int size = file_inode == -1 ? -1 : inode_size(file_inode);
+    pthread_rwlock_unlock(&dir_lock);
+    return size;
 }
 
-int calc_root_dir_blocks() {
-    int num_root_dir_blocks = sizeof(root_dir)/BLOCK_SIZE;
-    if (sizeof(root_dir) % BLOCK_SIZE != 0) num_root_dir_blocks++;
-    return num_root_dir_blocks;
+// Returns the inode called name in directory dir, or -1
+int sfs_lookup(int dir, const char* name) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int inode_num = valid_inode(dir, 1) && valid_name(name) ? dir_lookup(dir, name) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return inode_num;
 }
 
-int get_file_inode(char* path) {
-    char* buffer = malloc(sizeof(char) * (MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1));
-
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (root_dir[i].inode_num != -1) {
-            strcpy(buffer, root_dir[i].name);
-            if (strcmp(buffer, path) == 0){
-                free(buffer);
-                return root_dir[i].inode_num;
-            }
-        }
+// Returns 1 if inode_num is a directory, 0 if it is a file, and sets *size
+// to its entries or bytes. The caller holds dir_lock.
+int inode_attr(int inode_num, int* size) {
+    if (is_dir(inode_num)) {
+        *size = inode_table[inode_num].file_size;
+        return 1;
     }
-    free(buffer);
-    return -1;
+    *size = inode_size(inode_num);
+    return 0;
 }
 
+// Returns 1 if inode_num is a directory, 0 if it is a file, or -1 if it is
+// not in use. *size is set to the entries in a directory or the bytes in a file.
+int sfs_istat(int inode_num, int* size) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int res = valid_inode(inode_num, 0) ? inode_attr(inode_num, size) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
+}
 
-void mksfs(int fresh) {
-    if (fresh == 1) {
-        init_bitmap_status_table();
-        init_inode_status_table();
-        init_inode_table();
-        init_file_descriptor_table();
-        init_root();
-        init_super();
-        current_file_inode_num = 0;
-
-        init_fresh_disk(DISK_NAME, BLOCK_SIZE, NUM_BLOCKS);
+// Entries collected for sfs_readdirplus
+typedef struct readdir_batch {
+    sfs_dirent* entries;
+    int count;
+    int max;
+} readdir_batch;
+
+int readdir_batch_visit(uint32_t key, void* rec, void* ctx) {
+    readdir_batch* batch = ctx;
+    directory_entry* entry = rec;
+    sfs_dirent* out = &batch->entries[batch->count++];
+    memcpy(out->name, entry->name, DIR_NAME_LEN);
+    out->name[DIR_NAME_LEN] = '\0';
+    out->inode_num = entry->inode_num;
+    out->cookie = (uint64_t)key + 1;
+    return batch->count == batch->max;
+}
 
+// Copies up to max entries of directory dir, from *cookie on, with their
+// attributes, walking the list once. The caller holds dir_lock. Returns how
+// many were copied, 0 at the end.
+int read_dir_entries(int dir, uint64_t* cookie, sfs_dirent* entries, int max) {
+    if (max <= 0 || *cookie > UINT32_MAX) {
+        return 0;
+    }
 
-        // Set super block as taken and write it to disk
-        SetBit(block_bitmap, 0);
-        write_blocks(0, 1, &superblock);
+    btree list = dir_list(dir);
+    readdir_batch batch = {entries, 0, max};
+    btree_iterate(&list, *cookie, readdir_batch_visit, &batch);
 
-        // Get number of blocks required for inode table and root directory
-        int num_inode_table_blocks = calc_inode_table_blocks();
-        int num_root_dir_blocks = calc_root_dir_blocks();
+    for (int i = 0; i < batch.count; i++) {
+        entries[i].is_dir = inode_attr(entries[i].inode_num, &entries[i].size);
+    }
+    if (batch.count > 0) {
+        *cookie = entries[batch.count - 1].cookie;
+    }
+    return batch.count;
+}
 
-        // Create inode for rootdir
-        // TODO: Should this not just loop for i<12?
-        int root_data_ptrs[12];
-        for (int i = 0; i < num_root_dir_blocks; i++) {
-            root_data_ptrs[i] = i + num_inode_table_blocks + 1;
-        }
+// Copies up to max entries of directory path to entries, with their
+// attributes. Start with *cookie at 0; each entry's cookie also resumes the
+// listing after it. Returns how many were copied, 0 at the end, or -1 if
+// path is not a directory.
+int sfs_readdirplus(const char* path, uint64_t* cookie, sfs_dirent* entries, int max) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int dir = lookup_path(path);
+    int res = dir == -1 || !is_dir(dir) ? -1 : read_dir_entries(dir, cookie, entries, max);
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
+}
 
-        set_inode(ROOT_INODE, 0, num_root_dir_blocks, 0, 0, -1, root_data_ptrs, -1);
+// As sfs_readdirplus, for the directory with inode dir
+int sfs_readdirplusat(int dir, uint64_t* cookie, sfs_dirent* entries, int max) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int res = valid_inode(dir, 1) ? read_dir_entries(dir, cookie, entries, max) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return res;
+}
 
-        // Allocate blocks for inode_table and write it
-        for (int i = 1; i < num_inode_table_blocks + 1; i++) {
-            SetBit(block_bitmap, i);
-        }
-        write_blocks(1, num_inode_table_blocks, &inode_table);
+void init_readahead(int fileID) {
+    fd_table[fileID].ra_pos = fd_table[fileID].r_ptr;
+    fd_table[fileID].ra_window = 0;
+    fd_table[fileID].ra_end = 0;
+}
 
-        // Allocate blocks for root_dir and write it
-        void* root_buffer = malloc(BLOCK_SIZE * num_root_dir_blocks);
-        memcpy(root_buffer, &root_dir, sizeof(root_dir));
-        for (int i = num_inode_table_blocks + 1; i < num_root_dir_blocks + (num_inode_table_blocks + 1); i++) {
-            SetBit(block_bitmap, i);
-        }
-        write_blocks(inode_table[ROOT_INODE].direct_ptrs[0], num_root_dir_blocks, root_buffer);
-        free(root_buffer);
+// Sizes the read-ahead window from the access pattern: it doubles each time
+// a read starts where the previous one ended and halves on every other read,
+// so random readers settle at no read-ahead. A sequential reader keeps the
+// cache at least half a window ahead of the blocks it is reading, topping it
+// up one full window at a time.
+void readahead(int fileID, int first_block, int end_block) {
+    file_descriptor* fd = &fd_table[fileID];
+    int inode_num = fd->inode_index;
+
+    if (fd->r_ptr == fd->ra_pos) {
+        fd->ra_window = fd->ra_window == 0 ? READAHEAD_MIN : fd->ra_window * 2;
+        if (fd->ra_window > READAHEAD_MAX) fd->ra_window = READAHEAD_MAX;
+    } else {
+        fd->ra_window /= 2;
+        fd->ra_end = 0;
+        return;
+    }
 
-        // Allocate block and write inode_table_bitmap
-        SetBit(block_bitmap, NUM_BLOCKS - 2);
-        write_blocks(NUM_BLOCKS - 2, 1, &inode_status_table);
+    if (fd->ra_end >= end_block + fd->ra_window / 2) return;
 
-        // Allocate block and write bitmap
-        SetBit(block_bitmap, NUM_BLOCKS - 1);
-        write_blocks(NUM_BLOCKS - 1, 1, &block_bitmap);
+    int file_blocks = (inode_table[inode_num].file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int from = fd->ra_end > first_block ? fd->ra_end : first_block;
+    int to = end_block + fd->ra_window < file_blocks ? end_block + fd->ra_window : file_blocks;
 
-    } else {  // If opening a previously created filesystem
-        init_file_descriptor_table();
-        init_disk(DISK_NAME, BLOCK_SIZE, NUM_BLOCKS);
-        current_file_inode_num = 0;
-
-        // Read superblock
-        void* buffer = malloc(BLOCK_SIZE);
-        read_blocks(0, 1, buffer);
-        memcpy(&superblock, buffer, sizeof(superblock_t));
-        free(buffer);
+    for (int i = from; i < to; ) {
+        int run;
+        int block = map_file_block(inode_num, i, to - i, &run);
+        if (block != 0) {
+            prefetch_blocks(block, run);
+        }
+        i += run;
+    }
+    fd->ra_end = to;
+}
 
-        // Read the inode table into memory
-        int numInodeBlocks = calc_inode_table_blocks();
-        buffer = malloc(BLOCK_SIZE * numInodeBlocks);
-        read_blocks(1, numInodeBlocks, buffer);
-        memcpy(&inode_table, buffer, sizeof(inode_table));
-        free(buffer);
+// Creates an inode with the given mode and link count and adds it to
+// directory dir as name. The caller holds dir_lock for writing. Returns the
+// inode, or -1 if there is no free inode or the directory cannot grow.
+int new_inode(int dir, const char* name, int mode, int link_cnt) {
+    pthread_mutex_lock(&alloc_lock);
+    int inode_num = find_free_inode();
+    if (inode_num == -1) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -1;
+    }
 
-        // Read the inode table status into memory
-        buffer = malloc(BLOCK_SIZE);
-        read_blocks(NUM_BLOCKS - 2, 1 , buffer);
-        memcpy(&inode_status_table, buffer, sizeof(inode_status_table));
-        free(buffer);
+    // Set up the inode with no blocks; they are mapped as it grows
+    int no_ptrs[12] = {0};
+    set_inode(inode_num, mode, link_cnt, 0, 0, 0, no_ptrs, 0);
+    pthread_mutex_unlock(&alloc_lock);
 
-        // Read the bitmap into memory
-        buffer = malloc(BLOCK_SIZE);
-        read_blocks(NUM_BLOCKS - 1, 1, buffer);
-        memcpy(&block_bitmap, buffer, sizeof(block_bitmap));
-        free(buffer);
+    // Add the directory entry, giving the inode back if the directory cannot grow
+    if (dir_add(dir, name, inode_num) == -1) {
+        rm_inode(inode_num);
+        return -1;
+    }
+    return inode_num;
+}
 
-        // Read the root directory into memory
-        buffer = malloc(BLOCK_SIZE * (inode_table[ROOT_INODE].link_cnt));
-        read_blocks(inode_table[ROOT_INODE].direct_ptrs[0], inode_table[ROOT_INODE].link_cnt, buffer);
-        memcpy(&root_dir, buffer, sizeof(root_dir));
-        free(buffer);
+// Returns the file called name in directory dir, creating it if there is
+// none, or -1 if name is a directory. The caller holds dir_lock for writing.
+int create_file(int dir, const char* name) {
+    int file_inode = dir_lookup(dir, name);
+    if (file_inode == -1) {
+        return new_inode(dir, name, INODE_EXTENT_FL, 0);
     }
+    return is_dir(file_inode) ? -1 : file_inode;
 }
 
-int sfs_getnextfilename(char *fname) {
-    if (current_file_inode_num < NUM_INODES) {
-        while (root_dir[current_file_inode_num].inode_num == -1) {
-            current_file_inode_num++;
-            if (current_file_inode_num >= NUM_INODES) {
-                current_file_inode_num = 0;
-                return 0;
-            }
+// Opens file_inode on a free descriptor in append mode. Returns the
+// descriptor, or -1 if the file is already open. The caller holds dir_lock.
+// The slot is claimed under fd_table_lock, held until it is filled in.
+int open_inode(int file_inode) {
+    pthread_mutex_lock(&fd_table_lock);
+    int fileID = -1;
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (fd_table[i].inode_index == file_inode) {
+            pthread_mutex_unlock(&fd_table_lock);
+            return -1;
+        }
+        if (fileID == -1 && fd_table[i].inode_index == -1) {
+            fileID = i;
         }
-        strcpy(fname, root_dir[current_file_inode_num].name);
-        current_file_inode_num++;
-        return 1;
-    } else {
-        current_file_inode_num = 0;
-        return 0;
     }
-}
 
-int sfs_getfilesize(const char* path) {
-    int file_inode = get_file_inode(path);
-    if (file_inode != -1) {
-        return inode_table[file_inode].file_size;
-    } else {
-        return -1;
+    if (fileID != -1) {
+        fd_table[fileID].inode_index = file_inode;
+        fd_table[fileID].inode = &(inode_table[file_inode]);
+        fd_table[fileID].w_ptr = inode_table[file_inode].file_size;  // Open in append mode
+        fd_table[fileID].r_ptr = inode_table[file_inode].file_size;
+        init_readahead(fileID);
+        init_write_buffer(fileID);
     }
+    pthread_mutex_unlock(&fd_table_lock);
+    return fileID;
 }
 
-int sfs_fopen(char *name) {
-    if (strlen(name) > MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1) {
+// sfs_fopen, called with dir_lock held for writing
+int open_file(char *name) {
+    char file_name[DIR_NAME_LEN + 1];
+    int parent = lookup_parent(name, file_name);
+    if (parent < 0) {
         return -1;
     }
 
@@ -272,393 +2486,631 @@ int sfs_fopen(char *name) {
         letter++;
     }
 
-    int first_open_file_desc = -1;
-    for (int i = 0; i < NUM_INODES; i++) {
-        if (fd_table[i].inode_index == -1) {
-            first_open_file_desc = i;
-            break;
-        }
-    }
-
-    if (first_open_file_desc != -1) {
-        int file_inode = get_file_inode(name);
-        if (file_inode != -1) {  // File already exists
-
-            // Check if file already open
-            for (int i = 0; i < NUM_INODES; i++){
-                if (fd_table[i].inode_index == file_inode){
-                    return -1;
-                }
-            }
-
-            // Open file
-            fd_table[first_open_file_desc].inode_index = file_inode;
-            fd_table[first_open_file_desc].inode = &(inode_table[file_inode]);
-            fd_table[first_open_file_desc].w_ptr = inode_table[file_inode].file_size;  // Open in append mode
-            fd_table[first_open_file_desc].r_ptr = inode_table[file_inode].file_size;
-
-            return first_open_file_desc;
-        } else {  // File does not exist
-
-            // Get first open inode
-            int first_open_inode = -1;
-            for (int i = 1; i < NUM_INODES; i++) {
-                if (!TestBit(inode_status_table, i)) {
-                    first_open_inode = i;
-                    SetBit(inode_status_table, i);
-                    break;
-                }
-            }
-
-            // If there are no free inodes, fail
-            if (first_open_inode == -1){
-                return -1;
-            }
-
-            // Get new dir entry
-            int first_open_in_root_dir = -1;
-            for (int i = 0; i < NUM_INODES; i++){
-                if (root_dir[i].inode_num == -1) {
-                    first_open_in_root_dir = i;
-                    break;
-                }
-            }
+    int file_inode = create_file(parent, file_name);
+    return file_inode == -1 ? -1 : open_inode(file_inode);
+}
 
-            // If root dir is full, fail
-            if (first_open_in_root_dir == -1){
-                return -1;
-            }
+int sfs_fopen(char *name) {
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int fileID = open_file(name);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Write the changed inode, status and bitmap blocks
+    end_update();
+    return fileID;
+}
 
+// As sfs_fopen, for the file with inode inode_num
+int sfs_fopen_inode(int inode_num) {
+    pthread_rwlock_rdlock(&dir_lock);
+    int fileID = valid_inode(inode_num, 0) && !is_dir(inode_num) ? open_inode(inode_num) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    return fileID;
+}
 
-            // Select first empty block
-            int first_empty_block = -1;
-            for (int i = 0; i < NUM_BLOCKS; i++) {
-                if (!TestBit(block_bitmap, i)) {
-                    first_empty_block = i;
-                    SetBit(block_bitmap, i);
-                    break;
-                }
-            }
+// Creates an empty file called name in directory dir unless one exists.
+// Returns its inode, or -1 if name is a directory or cannot be added.
+int sfs_createat(int dir, const char* name) {
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int file_inode = valid_inode(dir, 1) && valid_name(name) ? create_file(dir, name) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return file_inode;
+}
 
-            // If no empty blocks, fail
-            if (first_empty_block == -1){
-                return -1;
-            }
+// Locks descriptor fileID. Returns the inode it is open on, or -1, leaving
+// it unlocked, if it is not open.
+int lock_fd(int fileID) {
+    if (fileID < 0 || fileID >= NUM_INODES) return -1;
 
-            // Set up direct access blocks
-            int data_ptrs[12];
-            data_ptrs[0] = first_empty_block;
-            for (int i = 1; i < 12; i++){
-                data_ptrs[i] = -1;
-            }
+    pthread_mutex_lock(&fd_locks[fileID]);
+    if (fd_table[fileID].inode_index == -1) {
+        pthread_mutex_unlock(&fd_locks[fileID]);
+        return -1;
+    }
+    return fd_table[fileID].inode_index;
+}
 
-            fd_table[first_open_file_desc].inode_index = first_open_inode;
+void unlock_fd(int fileID) {
+    pthread_mutex_unlock(&fd_locks[fileID]);
+}
 
-            root_dir[first_open_in_root_dir].inode_num = first_open_inode;
-            strcpy(root_dir[first_open_in_root_dir].name, name);
+int sfs_fclose(int fileID) {
+    int inode_num = lock_fd(fileID);
+    if (inode_num == -1) {
+        return -1;
+    }
 
-            // Set up the inode
-            set_inode(first_open_inode, 0, 1, 0, 0, 0, data_ptrs, -1);
-            fd_table[first_open_file_desc].inode = &(inode_table[first_open_inode]);
-            fd_table[first_open_file_desc].w_ptr = inode_table[first_open_inode].file_size;
-            fd_table[first_open_file_desc].r_ptr = inode_table[first_open_inode].file_size;
+    int flushed = flush_fd(fileID);
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    pthread_mutex_lock(&fd_table_lock);
+    free(fd_table[fileID].wbuf);
+    init_write_buffer(fileID);
+    fd_table[fileID].inode_index = -1;
+    pthread_mutex_unlock(&fd_table_lock);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    unlock_fd(fileID);
+
+    // Closing is a durability point for everything written so far
+    if (journal_sync() < 0 || flushed < 0) {
+        return -1;
+    }
+    return 0;
+}
 
-            // Get size of root dir
-            int num_root_dir_blocks = (sizeof(root_dir)/BLOCK_SIZE);
-            if (sizeof(root_dir) % BLOCK_SIZE != 0){
-                num_root_dir_blocks += 1;
-            }
+int sfs_sync() {
+    return journal_sync();
+}
 
-            // Write root dir
-            void *buffer = malloc(BLOCK_SIZE * num_root_dir_blocks);
-            memcpy(buffer, &root_dir, sizeof(root_dir));
-            write_blocks(inode_table[ROOT_INODE].direct_ptrs[0], num_root_dir_blocks, buffer);
-            free(buffer);
+// Reads the usage counters the allocator keeps, so it costs the same
+// however full the disk is. Blocks the journal holds back until its next
+// checkpoint count as free, since allocating them forces the checkpoint.
+void sfs_statfs(sfs_statfs_t* buf) {
+    pthread_mutex_lock(&alloc_lock);
+    buf->block_size = BLOCK_SIZE;
+    buf->total_blocks = NUM_BLOCKS;
+    buf->free_blocks = bitmap_free_count;
+    buf->total_inodes = NUM_INODES;
+    buf->free_inodes = free_inode_count;
+    buf->max_name_len = DIR_NAME_LEN;
+    pthread_mutex_unlock(&alloc_lock);
+}
 
-            inode_table[ROOT_INODE].file_size += 1;
+int sfs_setsyncmode(int mode) {
+    pthread_mutex_lock(&meta_lock);
+    strict_sync = mode == SFS_SYNC_STRICT;
+    pthread_mutex_unlock(&meta_lock);
+    return set_disk_sync_mode(mode == SFS_SYNC_STRICT ? DISK_SYNC_STRICT : DISK_SYNC_DEFERRED);
+}
 
-            // Write inode table
-            int numInodeBlocks = calc_inode_table_blocks();
-            write_blocks(1, numInodeBlocks, &inode_table);
+int sfs_setcachesize(int nblocks) {
+    return set_disk_cache_size(nblocks);
+}
 
-            // Write inode status
-            write_blocks(1022, 1, &inode_status_table);
+// Selects how the image is accessed, from the next mksfs on
+int sfs_setbackend(int backend) {
+    if (backend == SFS_BACKEND_MMAP) return set_disk_backend(DISK_BACKEND_MMAP);
+    if (backend == SFS_BACKEND_URING) return set_disk_backend(DISK_BACKEND_URING);
+    return backend == SFS_BACKEND_PREAD ? set_disk_backend(DISK_BACKEND_PREAD) : -1;
+}
 
-            // Write bitmap
-            write_blocks(1023, 1, &block_bitmap);
+void sfs_getcachestats(long* hits, long* misses) {
+    get_disk_cache_stats(hits, misses);
+}
 
-            return first_open_file_desc;
-        }
-    } else {
+// Moves the read (write == 0) or write pointer of a descriptor
+int seek_fd(int fileID, int loc, int write) {
+    int inode_num = lock_fd(fileID);
+    if (inode_num == -1) {
         return -1;
     }
-}
-
-int sfs_fclose(int fileID) {
-    if (fd_table[fileID].inode_index == -1) {
+    if (flush_fd(fileID) < 0) {
+        unlock_fd(fileID);
         return -1;
-    } else {
-        fd_table[fileID].inode_index = -1;
-        return 0;
     }
+
+    pthread_rwlock_rdlock(&inode_locks[inode_num]);
+    int res = -1;
+    if (inode_table[inode_num].file_size >= loc) {
+        if (write) {
+            fd_table[fileID].w_ptr = loc;
+        } else {
+            fd_table[fileID].r_ptr = loc;
+        }
+        res = 0;
+    }
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    unlock_fd(fileID);
+    return res;
 }
 
 int sfs_frseek(int fileID, int loc) {
-    if (inode_table[fd_table[fileID].inode_index].file_size < loc) {
-        return -1;
-    } else {
-        fd_table[fileID].r_ptr = loc;
-        return 0;
-    }
+    return seek_fd(fileID, loc, 0);
 }
 
 int sfs_fwseek(int fileID, int loc) {
-    if (inode_table[fd_table[fileID].inode_index].file_size < loc) {
-        return -1;
-    } else {
-        fd_table[fileID].w_ptr = loc;
-        return 0;
-    }
+    return seek_fd(fileID, loc, 1);
 }
 
-int sfs_fwrite(int fileID, char *buf, int length) {
-    if (fileID < 0) {return -1;}  // not valid file ID
-    if (length <= 0) {return length;}  // nothing to write
-
-    int inode_to_write = fd_table[fileID].inode_index;
+// Writes length bytes of buf at byte w_ptr of a file, with the file's inode
+// lock held for writing. Returns the number of bytes written, or -1 if the
+// disk cannot hold them.
+int write_file(int inode_to_write, int w_ptr, char *buf, int length) {
     int bytes_to_write = length;
-
-    if (inode_to_write == -1) {return -1;}  // file not in fd_table
-
-    int required_bytes = fd_table[fileID].w_ptr + length;
-    if (required_bytes > MAX_FILE_SIZE) {
-        required_bytes = MAX_FILE_SIZE;
-        bytes_to_write = MAX_FILE_SIZE - fd_table[fileID].w_ptr;
+    if (length > MAX_FILE_SIZE - w_ptr) {
+        bytes_to_write = MAX_FILE_SIZE - w_ptr;
     }
+    int required_bytes = w_ptr + bytes_to_write;
 
+    int starting_block = w_ptr / BLOCK_SIZE;
+    int offset = w_ptr % BLOCK_SIZE;
     int blocks_needed = required_bytes / BLOCK_SIZE;
     if (required_bytes % BLOCK_SIZE != 0) { blocks_needed++; }
+    int num_blocks = blocks_needed - starting_block;
+
+    // Only a partially covered first or last block needs its old contents,
+    // merged with the new bytes in a bounce buffer. Blocks the write covers
+    // completely are written straight from buf without being read.
+    int last_block = blocks_needed - 1;
+    char* head = NULL;
+    char* tail = NULL;
+    if (offset != 0 || required_bytes < (starting_block + 1) * BLOCK_SIZE) {
+        head = malloc(BLOCK_SIZE);
+        load_file_block(inode_to_write, starting_block, head);
+        int n = BLOCK_SIZE - offset < bytes_to_write ? BLOCK_SIZE - offset : bytes_to_write;
+        memcpy(head + offset, buf, n);
+    }
+    if (last_block > starting_block && required_bytes % BLOCK_SIZE != 0) {
+        tail = malloc(BLOCK_SIZE);
+        load_file_block(inode_to_write, last_block, tail);
+        memcpy(tail, buf + (last_block * BLOCK_SIZE - w_ptr), required_bytes % BLOCK_SIZE);
+    }
 
-    int blocks_to_add = blocks_needed - inode_table[inode_to_write].link_cnt;
-
-    // If file is larger than 12 blocks, load indirect pointer
-    void* buffer = malloc(BLOCK_SIZE);
-    if (inode_table[inode_to_write].link_cnt > 12){
-        read_blocks(inode_table[inode_to_write].indirect_ptr, 1, buffer);
-        memcpy(&indirect_block, buffer, BLOCK_SIZE);
-    }
-    // Else if file will become larger than 12 blocks, create indirect pointer
-    else if (inode_table[inode_to_write].link_cnt + blocks_to_add > 12) {
-        int indirect_ptr = -1;
-        for (int i = 0; i < NUM_BLOCKS; i++) {
-            if(!TestBit(block_bitmap, i)){
-                indirect_ptr = i;
-                SetBit(block_bitmap, i);
-                break;
-            }
+    // Files still mapped by direct and indirect pointers switch to extents
+    // first. Then, failing before anything is allocated if the disk cannot
+    // hold the write, the holes in the range get disk blocks, in as few
+    // adjacent runs as possible.
+    pthread_mutex_lock(&alloc_lock);
+    int res = convert_to_extents(inode_to_write);
+    if (res == 0 && !reserve_blocks(count_holes(inode_to_write, starting_block, num_blocks))) {res = -1;}
+    if (res == 0) {res = alloc_file_blocks(inode_to_write, starting_block, num_blocks);}
+    pthread_mutex_unlock(&alloc_lock);
+    if (res < 0) {
+        free(head);
+        free(tail);
+        return -1;
+    }
+
+    // Write to disk, one call per run of adjacent blocks between the bounce
+    // buffers. The runs are in flight together with the io_uring backend.
+    int failed = 0;
+    for (int i = starting_block; i < blocks_needed; ) {
+        int run;
+        int block = map_file_block(inode_to_write, i, blocks_needed - i, &run);
+        int first = i;
+        int last = i + run;
+        if (first == starting_block && head != NULL) {
+            if (submit_write_blocks(block, 1, head) < 0) {failed = 1;}
+            first++;
         }
-        if (indirect_ptr == -1) {
-            return -1;
+        if (last - 1 == last_block && tail != NULL && last > first) {
+            last--;
+            if (submit_write_blocks(block + (last - i), 1, tail) < 0) {failed = 1;}
         }
-        inode_table[inode_to_write].indirect_ptr = indirect_ptr;
+        if (last > first) {
+            if (submit_write_blocks(block + (first - i), last - first, buf + (first * BLOCK_SIZE - w_ptr)) < 0) {failed = 1;}
+        }
+        i += run;
     }
-    free(buffer);
+    // Waited for even after a failure, as the transfers still use the buffers
+    if (wait_disk_io() < 0) {failed = 1;}
 
-    if (blocks_to_add > 0) {
-        // Add new blocks needed
-        for (int i = inode_table[inode_to_write].link_cnt; i < blocks_needed; i++) {
-            int new_block = -1;
-            for (int j = 0; j < NUM_BLOCKS; j++) {
-                if(!TestBit(block_bitmap, j)){
-                    new_block = j;
-                    SetBit(block_bitmap, j);
-                    break;
-                }
-            }
-            // No space found
-            if (new_block == -1) {
-                return -1;
-            } else {
-                if (i >= 12) {
-                    indirect_block[i - 12] = new_block;
-                } else {
-                    inode_table[inode_to_write].direct_ptrs[i] = new_block;
-                }
-            }
-        }
-    } else {
-        blocks_to_add = 0;
+    free(head);
+    free(tail);
+    if (failed) {return -1;}
+
+    // Update file system stats
+    if (inode_table[inode_to_write].file_size < required_bytes) {
+        inode_table[inode_to_write].file_size = required_bytes;
     }
 
-    int starting_block = fd_table[fileID].w_ptr / BLOCK_SIZE;
-    int offset = fd_table[fileID].w_ptr % BLOCK_SIZE;
+    // The changed inode and bitmap blocks are written when the call ends
+    mark_inode_dirty(inode_to_write);
 
-    // Load file with extra space for write
-    buffer = malloc(BLOCK_SIZE * blocks_needed);
+    return bytes_to_write;
+}
 
-    for (int i = starting_block; i < inode_table[inode_to_write].link_cnt && i < blocks_needed; i++) {
-        if (i >= 12) {
-            read_blocks(indirect_block[i - 12], 1, (buffer + (i - starting_block) * BLOCK_SIZE));
-        } else {
-            read_blocks(inode_table[inode_to_write].direct_ptrs[i], 1, (buffer + (i - starting_block) * BLOCK_SIZE));
-        }
+// Writes out the descriptor's buffered bytes. If the disk cannot hold them
+// they are dropped, the write pointer moves back to where they started and
+// -1 is returned. The caller holds the inode lock for writing.
+int flush_write_buffer(int fileID) {
+    file_descriptor* fd = &fd_table[fileID];
+    if (fd->wbuf_len == 0) {return 0;}
+
+    int len = fd->wbuf_len;
+    fd->wbuf_len = 0;
+    if (write_file(fd->inode_index, fd->wbuf_pos, fd->wbuf, len) != len) {
+        fd->w_ptr = fd->wbuf_pos;
+        return -1;
     }
+    return 0;
+}
 
-    memcpy((buffer + offset), buf, bytes_to_write);
+// Collects a write in the descriptor's buffer. The buffer is flushed first
+// if the write does not continue it, and again whenever it fills.
+int buffered_write(int fileID, char *buf, int length) {
+    file_descriptor* fd = &fd_table[fileID];
 
-    write_blocks(NUM_BLOCKS - 2, 1, &inode_status_table);
+    if (fd->wbuf_len > 0 && fd->w_ptr != fd->wbuf_pos + fd->wbuf_len) {
+        if (flush_write_buffer(fileID) < 0) {return -1;}
+    }
+    if (length > MAX_FILE_SIZE - (int)fd->w_ptr) {
+        length = MAX_FILE_SIZE - fd->w_ptr;
+    }
 
-    // Write file back to disk
-    for (int i = starting_block; i < blocks_needed; i++) {
-        if (i >= 12) {
-            write_blocks(indirect_block[i - 12], 1, (buffer + (i - starting_block) * BLOCK_SIZE));
-        } else {
-            write_blocks(inode_table[inode_to_write].direct_ptrs[i], 1, (buffer + (i-starting_block) * BLOCK_SIZE));
-        }
+    // A write that would fill the buffer by itself goes straight to disk
+    if (fd->wbuf_len == 0 && length >= fd->wbuf_size) {
+        int written = write_file(fd->inode_index, fd->w_ptr, buf, length);
+        if (written > 0) {fd->w_ptr += written;}
+        return written;
     }
 
-    free(buffer);
+    for (int done = 0; done < length; ) {
+        if (fd->wbuf_len == 0) {fd->wbuf_pos = fd->w_ptr;}
 
-    // Update file system stats
-    if (inode_table[inode_to_write].file_size < required_bytes) {
-        inode_table[inode_to_write].file_size = required_bytes;
+        int n = fd->wbuf_size - fd->wbuf_len < length - done ? fd->wbuf_size - fd->wbuf_len : length - done;
+        memcpy(fd->wbuf + fd->wbuf_len, buf + done, n);
+        fd->wbuf_len += n;
+        fd->w_ptr += n;
+        done += n;
+
+        if (fd->wbuf_len == fd->wbuf_size && flush_write_buffer(fileID) < 0) {return -1;}
     }
+    return length;
+}
 
-    inode_table[inode_to_write].link_cnt += blocks_to_add;
-    fd_table[fileID].w_ptr = required_bytes;
+int sfs_fwrite(int fileID, char *buf, int length) {
+    if (length <= 0) {return length;}  // nothing to write
+    int inode_to_write = lock_fd(fileID);
+    if (inode_to_write == -1) {return -1;}  // file not in fd_table
 
-    if (inode_table[inode_to_write].link_cnt > 12) {
-        write_blocks(inode_table[inode_to_write].indirect_ptr, 1, &indirect_block);
+    begin_update();
+    pthread_rwlock_wrlock(&inode_locks[inode_to_write]);
+    int written;
+    if (fd_table[fileID].wbuf != NULL) {
+        written = buffered_write(fileID, buf, length);
+    } else {
+        written = write_file(inode_to_write, fd_table[fileID].w_ptr, buf, length);
+        if (written > 0) {
+            fd_table[fileID].w_ptr += written;
+        }
     }
+    pthread_rwlock_unlock(&inode_locks[inode_to_write]);
+    end_update();
+    unlock_fd(fileID);
+    return written;
+}
 
-    // Write new stats to disk
-    int size_of_inodes = calc_inode_table_blocks();
-    write_blocks(1, size_of_inodes, &inode_table);
+// flush_write_buffer for a descriptor the caller has locked
+int flush_fd(int fileID) {
+    if (fd_table[fileID].wbuf_len == 0) {return 0;}
+
+    int inode_num = fd_table[fileID].inode_index;
+    begin_update();
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    int res = flush_write_buffer(fileID);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    end_update();
+    return res;
+}
 
-    write_blocks(NUM_BLOCKS - 2, 1, &inode_status_table);
+int sfs_fflush(int fileID) {
+    if (lock_fd(fileID) == -1) {return -1;}
+    int res = flush_fd(fileID);
+    unlock_fd(fileID);
+    return res;
+}
 
-    write_blocks(NUM_BLOCKS - 1, 1, &block_bitmap);
+// Turns on write buffering for a descriptor with a buffer of at least one
+// block, or turns it off with a size of 0. Bytes already buffered are flushed.
+int sfs_setwritebuf(int fileID, int size) {
+    if (size < 0 || lock_fd(fileID) == -1) {return -1;}
+    if (flush_fd(fileID) < 0) {
+        unlock_fd(fileID);
+        return -1;
+    }
 
-    return bytes_to_write;
+    file_descriptor* fd = &fd_table[fileID];
+    free(fd->wbuf);
+    fd->wbuf = NULL;
+    fd->wbuf_size = 0;
+    if (size > 0) {
+        fd->wbuf_size = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+        fd->wbuf = malloc(fd->wbuf_size);
+    }
+    unlock_fd(fileID);
+    return 0;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
-    if (fileID < 0) return -1;
+// sfs_fread with the descriptor and the inode locked
+int read_file(int fileID, int inode_to_read, char *buf, int length) {
+    int r_ptr = fd_table[fileID].r_ptr;
+    int file_size = inode_table[inode_to_read].file_size;
+    if (length <= 0 || r_ptr >= file_size) return 0;  // Nothing to read
+
+    int bytes_to_read = file_size - r_ptr < length ? file_size - r_ptr : length;  // Stop at the end of the file
+    int end = r_ptr + bytes_to_read;
+    int first_block = r_ptr / BLOCK_SIZE;
+    int end_block = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    readahead(fileID, first_block, end_block);
+
+    // Whole blocks are read straight into buf; only a partial first or last
+    // block goes through a bounce buffer. The reads are only submitted, so
+    // with the io_uring backend they are in flight together until
+    // wait_disk_io, and the bounce buffers are copied out after it.
+    char* bounce[2] = {NULL, NULL};
+    int bounce_from[2], bounce_len[2];
+    int failed = 0;
+    for (int i = first_block; i < end_block && !failed; ) {
+        int run;
+        int block = map_file_block(inode_to_read, i, end_block - i, &run);
+
+        // Bytes of the read that fall in this run
+        int from = i * BLOCK_SIZE > r_ptr ? i * BLOCK_SIZE : r_ptr;
+        int to = (i + run) * BLOCK_SIZE < end ? (i + run) * BLOCK_SIZE : end;
+
+        if (block == 0) {  // Holes read as zeros
+            memset(buf + (from - r_ptr), 0, to - from);
+        }
+        while (block != 0 && from < to) {
+            int disk_block = block + (from / BLOCK_SIZE - i);
+            int in_block = from % BLOCK_SIZE;
+
+            if (in_block == 0 && to - from >= BLOCK_SIZE) {
+                int whole = (to - from) / BLOCK_SIZE;
+                if (submit_read_blocks(disk_block, whole, buf + (from - r_ptr)) < 0) {failed = 1;}
+                from += whole * BLOCK_SIZE;
+            } else {
+                int n = BLOCK_SIZE - in_block < to - from ? BLOCK_SIZE - in_block : to - from;
+                int k = from / BLOCK_SIZE == first_block ? 0 : 1;
+                bounce[k] = malloc(BLOCK_SIZE);
+                if (bounce[k] == NULL) {
+                    failed = 1;
+                    break;
+                }
+                bounce_from[k] = from;
+                bounce_len[k] = n;
+                if (submit_read_blocks(disk_block, 1, bounce[k]) < 0) {failed = 1;}
+                from += n;
+            }
+        }
+        i += run;
+    }
+
+    // Waited for even after a failure, as the transfers still use the buffers
+    if (wait_disk_io() < 0) {failed = 1;}
+    for (int k = 0; k < 2; k++) {
+        if (bounce[k] == NULL) continue;
+        if (!failed) {
+            memcpy(buf + (bounce_from[k] - r_ptr), bounce[k] + bounce_from[k] % BLOCK_SIZE, bounce_len[k]);
+        }
+        free(bounce[k]);
+    }
+    if (failed) return -1;
+
+    // Move read ptr
+    fd_table[fileID].r_ptr += bytes_to_read;
+    fd_table[fileID].ra_pos = fd_table[fileID].r_ptr;
 
-    int inode_to_read = fd_table[fileID].inode_index;
-    int bytes_to_read, eof;
+    return bytes_to_read;
+}
 
+int sfs_fread(int fileID, char *buf, int length) {
+    int inode_to_read = lock_fd(fileID);
     if (inode_to_read == -1) return -1;  // File not found
-    if (inode_table[inode_to_read].file_size <= 0) return 0;  // Nothing to read
-    if (inode_table[inode_to_read].file_size < fd_table[fileID].r_ptr + length) {  // If we've asked for more bytes than is left
-        bytes_to_read = inode_table[inode_to_read].file_size - fd_table[fileID].r_ptr;
-        eof = inode_table[inode_to_read].file_size / BLOCK_SIZE;
-        if ((inode_table[inode_to_read].file_size % BLOCK_SIZE) != 0) { eof++; }
-    } else {
-        bytes_to_read = length;
-        eof = (fd_table[fileID].r_ptr + length) / BLOCK_SIZE;
-        if (((fd_table[fileID].r_ptr + length) % BLOCK_SIZE) != 0) { eof++; }
+    if (flush_fd(fileID) < 0) {  // Reads see buffered writes
+        unlock_fd(fileID);
+        return -1;
     }
 
-    int first_block = fd_table[fileID].r_ptr / BLOCK_SIZE;
-    int read_offset = fd_table[fileID].r_ptr % BLOCK_SIZE;
+    // Only this file is locked, so reads of different files run in parallel
+    pthread_rwlock_rdlock(&inode_locks[inode_to_read]);
+    int res = read_file(fileID, inode_to_read, buf, length);
+    pthread_rwlock_unlock(&inode_locks[inode_to_read]);
+    unlock_fd(fileID);
+    return res;
+}
+
+// Zeroes block logical of a file from byte offset on, if it has a disk block
+void zero_block_tail(int inode_num, int logical, int offset) {
+    int run;
+    int block = map_file_block(inode_num, logical, 1, &run);
+    if (block == 0) return;
 
-    // If indirect pointer exists, load it
-    void* buffer = malloc(BLOCK_SIZE);
-    if (inode_table[inode_to_read].link_cnt > 12) {
-        read_blocks(inode_table[inode_to_read].indirect_ptr, 1, buffer);
-        memcpy(&indirect_block, buffer, BLOCK_SIZE);
-    }
+    char* buffer = malloc(BLOCK_SIZE);
+    read_blocks(block, 1, buffer);
+    memset(buffer + offset, 0, BLOCK_SIZE - offset);
+    write_blocks(block, 1, buffer);
     free(buffer);
+}
 
-    // Load file
-    buffer = malloc(BLOCK_SIZE * eof);
-    for (int i = first_block; i < inode_table[inode_to_read].link_cnt && i < eof; i++) {
-        if (i >= 12) {
-            read_blocks(indirect_block[i-12], 1, (buffer + (i - first_block) * BLOCK_SIZE));
-        } else {
-            read_blocks(inode_table[inode_to_read].direct_ptrs[i], 1, (buffer + (i - first_block) * BLOCK_SIZE));
+// sfs_ftruncate with the inode lock held for writing
+int truncate_file(int inode_num, int size) {
+    int old_size = inode_table[inode_num].file_size;
+    if (size == old_size) return 0;
+
+    if (size < old_size) {
+        pthread_mutex_lock(&alloc_lock);
+        int res = convert_to_extents(inode_num);
+        if (res == 0) {
+            free_blocks_from(inode_num, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
         }
+        pthread_mutex_unlock(&alloc_lock);
+        if (res < 0) return -1;
     }
 
-    // Get desired data
-    memcpy(buf, (buffer + read_offset), bytes_to_read);
+    // Bytes past the end of the last block must read as zeros if the file grows over them
+    int end = size < old_size ? size : old_size;
+    if (end % BLOCK_SIZE != 0) {
+        zero_block_tail(inode_num, end / BLOCK_SIZE, end % BLOCK_SIZE);
+    }
 
-    // Move read ptr
-    fd_table[fileID].r_ptr += bytes_to_read;
+    inode_table[inode_num].file_size = size;
+    mark_inode_dirty(inode_num);
+    return 0;
+}
 
-    free(buffer);
+// Sets the size of an open file. Blocks past the new end are freed. A file
+// that grows gets a hole, which reads as zeros and takes no blocks until it
+// is written. The read and write pointers are left where they are.
+int sfs_ftruncate(int fileID, int size) {
+    if (size < 0) return -1;
+    int inode_num = lock_fd(fileID);
+    if (inode_num == -1) return -1;
+    if (flush_fd(fileID) < 0) {
+        unlock_fd(fileID);
+        return -1;
+    }
 
-    return bytes_to_read;
+    begin_update();
+    pthread_rwlock_wrlock(&inode_locks[inode_num]);
+    int res = truncate_file(inode_num, size);
+    pthread_rwlock_unlock(&inode_locks[inode_num]);
+    end_update();
+
+    init_readahead(fileID);
+    unlock_fd(fileID);
+    return res;
 }
 
-int sfs_remove(char *file) {
-    int inode_to_remove = get_file_inode(file);
+// Removes the file called name from directory dir. The caller holds
+// dir_lock for writing.
+int remove_file(int parent, const char* file_name) {
+    int inode_to_remove = dir_lookup(parent, file_name);
+
+    // Directories are removed with sfs_rmdir
+    if (inode_to_remove == -1 || is_dir(inode_to_remove)) {return -1;}
 
-    // If file in file descriptor table, do not remove it
+    // If file in file descriptor table, do not remove it. It cannot be
+    // opened meanwhile, as sfs_fopen needs dir_lock.
+    pthread_mutex_lock(&fd_table_lock);
     for (int i = 0; i < NUM_INODES; i++) {
-        if (fd_table[i].inode_index == inode_to_remove) {return -1;}
+        if (fd_table[i].inode_index == inode_to_remove) {
+            pthread_mutex_unlock(&fd_table_lock);
+            return -1;
+        }
     }
+    pthread_mutex_unlock(&fd_table_lock);
 
-    if (inode_to_remove > 0) {
+    // Free all data blocks
+    pthread_rwlock_wrlock(&inode_locks[inode_to_remove]);
+    free_file_blocks(inode_to_remove);
 
-        // Free all data blocks
-        if (inode_table[inode_to_remove].link_cnt <= 12) {
-            for (int i = 0; i < inode_table[inode_to_remove].link_cnt; i++) {
-                ClearBit(block_bitmap, inode_table[inode_to_remove].direct_ptrs[i]);
-            }
-        } else { // Also have to free indirect pointer blocks
-            void* buffer = malloc(BLOCK_SIZE);
-            read_blocks(inode_table[inode_to_remove].indirect_ptr, 1, buffer);
-            memcpy(&indirect_block, buffer, BLOCK_SIZE);
-
-            for (int i = 0; i < inode_table[inode_to_remove].link_cnt; i++) {
-                if (i < 12) {
-                    ClearBit(block_bitmap, inode_table[inode_to_remove].direct_ptrs[i]);
-                } else {
-                    ClearBit(block_bitmap, indirect_block[i-12]);
-                }
-            }
+    rm_inode(inode_to_remove);
+    pthread_rwlock_unlock(&inode_locks[inode_to_remove]);
 
-            free(buffer);
-        }
+    // Remove directory entry
+    dir_remove(parent, file_name);
 
-        rm_inode(inode_to_remove);
+    return 0;
+}
 
-        // Remove directory entry
-        for (int i = 0; i < NUM_INODES; i++) {
-            if (strcmp(root_dir[i].name, file) == 0) {
-                root_dir[i].inode_num = -1;
-                for (int j = 0; j < MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1; j++) {
-                    root_dir[i].name[j] = '\0';
-                }
-                break;
-            }
-        }
+int sfs_remove(char *file) {
+    char file_name[DIR_NAME_LEN + 1];
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int parent = lookup_parent(file, file_name);
+    int res = parent < 0 ? -1 : remove_file(parent, file_name);
+    pthread_rwlock_unlock(&dir_lock);
+
+    // Write the changed inode, status and bitmap blocks
+    end_update();
+    return res;
+}
 
-        inode_table[ROOT_INODE].file_size--;
+int sfs_unlinkat(int dir, const char* name) {
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int res = valid_inode(dir, 1) && valid_name(name) ? remove_file(dir, name) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return res;
+}
 
-        int size_of_root_dir = sizeof(root_dir)/BLOCK_SIZE;
-        if (sizeof(root_dir) % BLOCK_SIZE != 0) size_of_root_dir++;
+// Adds an empty directory called name to directory parent. The caller holds
+// dir_lock for writing. Returns its inode, or SFS_ERR_EXIST or SFS_ERR_NOSPC.
+int make_dir(int parent, const char* dir_name) {
+    if (dir_lookup(parent, dir_name) != -1) {
+        return SFS_ERR_EXIST;
+    }
+    int dir_inode = new_inode(parent, dir_name, INODE_DIR_FL, 1);
+    return dir_inode == -1 ? SFS_ERR_NOSPC : dir_inode;
+}
 
-        // Write new root dir to disk
-        void *buffer = malloc(BLOCK_SIZE * size_of_root_dir);
-        memcpy(buffer, &root_dir, sizeof(root_dir));
-        write_blocks(inode_table[ROOT_INODE].direct_ptrs[0], size_of_root_dir, buffer);
-        free(buffer);
+// Returns 0, or an SFS_ERR_ code saying why the directory was not made
+int sfs_mkdir(const char* path) {
+    char dir_name[DIR_NAME_LEN + 1];
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int parent = lookup_parent(path, dir_name);
+    int res = parent < 0 ? parent : make_dir(parent, dir_name);
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return res < 0 ? res : 0;
+}
 
-        int inode_table_size = calc_inode_table_blocks();
-        // Write the inode table to disk
-        write_blocks(1, inode_table_size, &inode_table);
+// As sfs_mkdir, in directory dir. Returns the new directory's inode, or -1.
+int sfs_mkdirat(int dir, const char* name) {
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int dir_inode = valid_inode(dir, 1) && valid_name(name) ? make_dir(dir, name) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return dir_inode < 0 ? -1 : dir_inode;
+}
 
-        // Write the inode status to disk
-        write_blocks(1022, 1, &inode_status_table);
+// Removes the empty directory called name from directory parent. The caller
+// holds dir_lock for writing. Returns 0, or SFS_ERR_NOENT, SFS_ERR_NOTDIR or
+// SFS_ERR_NOTEMPTY.
+int remove_dir(int parent, const char* dir_name) {
+    int dir_inode = dir_lookup(parent, dir_name);
+
+    // Only empty directories can be removed
+    if (dir_inode == -1) return SFS_ERR_NOENT;
+    if (!is_dir(dir_inode)) return SFS_ERR_NOTDIR;
+    if (inode_table[dir_inode].file_size != 0) return SFS_ERR_NOTEMPTY;
+
+    // Deletes never merge nodes, so an empty directory may still own some
+    btree list = dir_list(dir_inode);
+    btree index = dir_index(dir_inode);
+    btree_free(&list);
+    btree_free(&index);
+
+    rm_inode(dir_inode);
+    dir_remove(parent, dir_name);
+    return 0;
+}
 
-        // Write bitmap to disk
-        write_blocks(1023, 1, &block_bitmap);
+// Returns 0, or an SFS_ERR_ code saying why the directory was not removed
+int sfs_rmdir(const char* path) {
+    char dir_name[DIR_NAME_LEN + 1];
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int parent = lookup_parent(path, dir_name);
+    int res = parent < 0 ? parent : remove_dir(parent, dir_name);
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return res;
+}
 
-        return 0;
-    } else {
-        return -1;
-    }
-}
\ No newline at end of file
+int sfs_rmdirat(int dir, const char* name) {
+    begin_update();
+    pthread_rwlock_wrlock(&dir_lock);
+    int res = valid_inode(dir, 1) && valid_name(name) ? remove_dir(dir, name) : -1;
+    pthread_rwlock_unlock(&dir_lock);
+    end_update();
+    return res < 0 ? -1 : 0;
+}
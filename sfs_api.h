@@ -11,7 +11,31 @@
 #define MAX_FNAME_LENGTH MAXFILENAME
 #define MAX_FILENAME_LEN 16
 #define MAX_EXTENSION_LEN 3
-#define NUM_BLOCKS 1024
+
+#define SFS_DEFAULT_BLOCK_SIZE 1024  // Geometry of images made by mksfs(1)
+#define SFS_DEFAULT_NUM_BLOCKS 1024
+#define SFS_DEFAULT_NUM_INODES 100
+#define SFS_MIN_BLOCK_SIZE 512  // Block sizes are powers of two in this range
+#define SFS_MAX_BLOCK_SIZE 65536
+#define SFS_MAX_NUM_BLOCKS (1 << 30)
+#define SFS_MAX_NUM_INODES (1 << 16)
+
+#define SFS_SYNC_DEFERRED 0  // Writes become durable at sfs_sync() and sfs_fclose()
+#define SFS_SYNC_STRICT 1  // Every block write is durable before the call returns
+
+#define SFS_BACKEND_PREAD 0  // Blocks are read and written with pread/pwrite
+#define SFS_BACKEND_MMAP 1  // The whole image is mapped into memory
+#define SFS_BACKEND_URING 2  // Blocks go through io_uring, or pread/pwrite where it is unavailable
+
+#define SFS_ROOT_INODE 0  // Inode of the root directory, for the calls taking inode numbers
+
+// Why sfs_mkdir or sfs_rmdir failed
+#define SFS_ERR_EXIST -1  // The name is already taken
+#define SFS_ERR_NOTEMPTY -2  // The directory to remove still has entries
+#define SFS_ERR_NOENT -3  // A directory on the path, or the one to remove, does not exist
+#define SFS_ERR_NOTDIR -4  // A name on the path, or the one to remove, is not a directory
+#define SFS_ERR_NAMETOOLONG -5  // A name on the path is longer than a directory entry holds
+#define SFS_ERR_NOSPC -6  // No inode or block is left for the new directory
 
 //TODO: Choose datatypes here, is uint64 needed?
 typedef struct superblock_t {
@@ -20,8 +44,21 @@ typedef struct superblock_t {
     uint64_t sfs_size;
     uint64_t inode_table_len;
     uint64_t root_dir_inode_ptr;
+    uint64_t journal_start;  // First block of the metadata journal
+    uint64_t journal_len;  // Blocks in the journal, 0 on images made without one
 } superblock_t;
 
+#define INODE_EXTENT_FL 0x10000  // Set in mode when the inode maps its blocks with extents
+#define INODE_EXTENTS 4  // Extents held in the inode before they move to an extent tree
+#define INODE_DIR_FL 0x20000  // Set in mode for directories
+
+// A run of len file blocks starting at file block logical, stored from disk block start
+typedef struct extent_t {
+    unsigned int logical;
+    unsigned int start;
+    unsigned int len;
+} extent_t;
+
 //TODO: Maybe remove unsigned?
 typedef struct inode_t {
     unsigned int mode;
@@ -29,8 +66,21 @@ typedef struct inode_t {
     unsigned int uid;
     unsigned int gid;
     unsigned int file_size;
-    unsigned int direct_ptrs[12];
-    unsigned int indirect_ptr;
+    union {
+        struct {  // Original format
+            unsigned int direct_ptrs[12];
+            unsigned int indirect_ptr;
+        };
+        struct {  // With INODE_EXTENT_FL
+            extent_t extents[INODE_EXTENTS];
+            unsigned int extent_root;  // Root of the extent tree, 0 while the extents fit in the inode
+        };
+        struct {  // With INODE_DIR_FL
+            unsigned int dir_list_root;  // Root of the entries in listing order, 0 while empty
+            unsigned int dir_index_root;  // Root of the entries by name hash, 0 while empty
+            unsigned int dir_next_pos;  // Listing position of the next entry added
+        };
+    };
 } inode_t;
 
 typedef struct file_descriptor {
@@ -38,16 +88,57 @@ typedef struct file_descriptor {
     inode_t* inode;
     uint64_t r_ptr;
     uint64_t w_ptr;
+    uint64_t ra_pos;  // Where the last read ended, to spot sequential reads
+    int ra_window;  // Blocks to keep read ahead of a sequential reader, 0 for random reads
+    int ra_end;  // First file block past what has been read ahead
+    char* wbuf;  // Writes not yet passed to the disk, NULL unless buffering is on
+    int wbuf_size;
+    int wbuf_len;
+    uint64_t wbuf_pos;  // File offset of the first buffered byte
 } file_descriptor;
 
+// Usage of the mounted file system, as reported by sfs_statfs
+typedef struct sfs_statfs_t {
+    int block_size;
+    int total_blocks;
+    int free_blocks;
+    int total_inodes;
+    int free_inodes;
+    int max_name_len;  // Longest name a directory entry holds
+} sfs_statfs_t;
+
 typedef struct directory_entry{
     int inode_num;
     char name[MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1];
 } directory_entry;
 
+// A directory entry with its attributes, as listed by sfs_readdirplus
+typedef struct sfs_dirent {
+    char name[MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 2];
+    int inode_num;
+    int is_dir;
+    int size;  // Entries in a directory, bytes in a file
+    uint64_t cookie;  // Resumes the listing after this entry
+} sfs_dirent;
+
 void mksfs(int fresh);
+int mksfs_geometry(int block_size, int num_blocks, int num_inodes);
 int sfs_getnextfilename(char *fname);
+int sfs_readdir(const char* path, uint64_t* cookie, char* fname);
+int sfs_isdir(const char* path);
+int sfs_mkdir(const char* path);
+int sfs_rmdir(const char* path);
 int sfs_getfilesize(const char* path);
+int sfs_lookup(int dir, const char* name);
+int sfs_istat(int inode_num, int* size);
+int sfs_readdirat(int dir, uint64_t* cookie, char* fname, int* inode_num);
+int sfs_readdirplus(const char* path, uint64_t* cookie, sfs_dirent* entries, int max);
+int sfs_readdirplusat(int dir, uint64_t* cookie, sfs_dirent* entries, int max);
+int sfs_mkdirat(int dir, const char* name);
+int sfs_rmdirat(int dir, const char* name);
+int sfs_createat(int dir, const char* name);
+int sfs_unlinkat(int dir, const char* name);
+int sfs_fopen_inode(int inode_num);
 int sfs_fopen(char *name);
 int sfs_fclose(int fileID);
 int sfs_frseek(int fileID,
@@ -58,4 +149,13 @@ int sfs_fwrite(int fileID,
                char *buf, int length);
 int sfs_fread(int fileID,
               char *buf, int length);
+int sfs_ftruncate(int fileID, int size);
 int sfs_remove(char *file);
+int sfs_setwritebuf(int fileID, int size);
+int sfs_fflush(int fileID);
+int sfs_sync();
+int sfs_setsyncmode(int mode);
+void sfs_statfs(sfs_statfs_t* buf);
+int sfs_setcachesize(int nblocks);
+int sfs_setbackend(int backend);
+void sfs_getcachestats(long* hits, long* misses);
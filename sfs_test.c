@@ -47,7 +47,7 @@ static char modified_pasta[] = "Ok boomer, you have to have a very high IQ to un
  
 char *rand_name() 
 {
-  char fname[MAX_FNAME_LENGTH];
+  char fname[MAX_FNAME_LENGTH + 1];
   int i;
 
   for (i = 0; i < MAX_FNAME_LENGTH; i++) {
@@ -44,7 +44,7 @@ static char test_str[] = "The quick brown fox jumps over the lazy dog.\n";
 
 char *rand_name()
 {
-  char fname[MAX_FNAME_LENGTH];
+  char fname[MAX_FNAME_LENGTH + 1];
   int i;
 
   for (i = 0; i < MAX_FNAME_LENGTH; i++) {
@@ -82,7 +82,7 @@ main(int argc, char **argv)
   /* First we open two files and attempt to write data to them.
    */
   {
-  char fname[MAX_FNAME_LENGTH+10];
+  char fname[MAX_FNAME_LENGTH+11];
   int i;
 
   for (i = 0; i < MAX_FNAME_LENGTH+10; i++) {
@@ -376,7 +376,7 @@ main(int argc, char **argv)
   }
 
   printf("Directory listing\n");
-  char *filename = (char *)malloc(MAXFILENAME);
+  char *filename = (char *)malloc(MAXFILENAME + 1);
   int max = 0;
   while (sfs_getnextfilename(filename)) {
 	  if (strcmp(filename, names[max]) != 0) {
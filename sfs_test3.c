@@ -0,0 +1,2246 @@
+/* sfs_test3.c
+ *
+ * Tests for what sfs and disk_emu do beyond the assignment. Each test
+ * checks one feature and reports what it finds wrong on stderr, the
+ * way sfs_test2 does.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define TEST_DISK "sfs_test3.disk"   /* For the tests below sfs */
+#define SFS_DISK "sfs_will_guthrie.disk"  /* The image sfs mounts */
+#define GUARD_BYTE 0x5a  /* Fills memory nothing should write to */
+#define NAME_BUF (MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 2)
+#define NTHREADS 4
+#define THREAD_FILES 6
+#define THREAD_ROUNDS 12
+
+static int error_count = 0;
+
+/* fill_data() - fills buf with bytes that depend on the offset and a
+ * seed, so data read back can be checked without keeping it.
+ */
+static void
+fill_data(char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (char)((offset + i) * 31 + (offset + i) / 1021 + seed);
+  }
+}
+
+/* check_data() - returns 1 if buf holds what fill_data() put there.
+ */
+static int
+check_data(const char *buf, int offset, int len, int seed)
+{
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (buf[i] != (char)((offset + i) * 31 + (offset + i) / 1021 + seed)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* write_file() - creates path holding size bytes of fill_data().
+ */
+static void
+write_file(char *path, int size, int seed)
+{
+  char *buf = malloc(size);
+  int fd = sfs_fopen(path);
+
+  fill_data(buf, 0, size, seed);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: creating %s\n", path);
+    error_count++;
+  }
+  else {
+    if (sfs_fwrite(fd, buf, size) != size) {
+      fprintf(stderr, "ERROR: writing %d bytes to %s\n", size, path);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+  free(buf);
+}
+
+/* verify_file() - checks that path holds size bytes of fill_data().
+ */
+static void
+verify_file(char *path, int size, int seed)
+{
+  char *buf = malloc(size + 1);
+  int fd = sfs_fopen(path);
+  int n;
+
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: opening %s\n", path);
+    error_count++;
+    free(buf);
+    return;
+  }
+  if (sfs_getfilesize(path) != size) {
+    fprintf(stderr, "ERROR: %s has size %d, expected %d\n",
+            path, sfs_getfilesize(path), size);
+    error_count++;
+  }
+  sfs_frseek(fd, 0);
+  n = sfs_fread(fd, buf, size + 1);
+  if (n != size || !check_data(buf, 0, size, seed)) {
+    fprintf(stderr, "ERROR: wrong data in %s (%d bytes read)\n", path, n);
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* crash() - runs fn in a child process that is then killed, so nothing
+ * it left in memory reaches the disk, and waits for it.
+ */
+static void
+crash(void (*fn)(void))
+{
+  pid_t pid;
+  int status;
+
+  /* The child must not find writes of ours still to be flushed */
+  sfs_sync();
+  pid = fork();
+  if (pid == 0) {
+    fn();
+    kill(getpid(), SIGKILL);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+    fprintf(stderr, "ERROR: running the child process\n");
+    error_count++;
+  }
+}
+
+/* Ranges of blocks go to and from the disk whole, from one buffer or
+ * from one buffer per block, and ranges past the end of the disk are
+ * refused. The vectored transfers are longer than one system call
+ * takes, so they are split.
+ */
+static void
+test_block_io()
+{
+  int bs = 512, nblocks = 2100, run = 2050;
+  char *data = malloc((size_t)nblocks * bs);
+  char *back = malloc((size_t)nblocks * bs);
+  void **blocks = malloc(run * sizeof(void *));
+  int i;
+
+  if (init_fresh_disk(TEST_DISK, bs, nblocks) != 0) {
+    fprintf(stderr, "ERROR: creating %s\n", TEST_DISK);
+    error_count++;
+    return;
+  }
+
+  fill_data(data, 0, nblocks * bs, 1);
+  if (write_blocks(3, 40, data) != 40) {
+    fprintf(stderr, "ERROR: writing 40 blocks\n");
+    error_count++;
+  }
+  memset(back, 0, 40 * bs);
+  if (read_blocks(3, 40, back) != 40 || !check_data(back, 0, 40 * bs, 1)) {
+    fprintf(stderr, "ERROR: reading back 40 blocks\n");
+    error_count++;
+  }
+
+  /* One buffer per block, in reverse order through the data */
+  for (i = 0; i < run; i++) {
+    blocks[i] = data + (size_t)(run - 1 - i) * bs;
+  }
+  if (writev_blocks(nblocks - run, run, blocks) != run) {
+    fprintf(stderr, "ERROR: writing %d blocks from separate buffers\n", run);
+    error_count++;
+  }
+  for (i = 0; i < run; i++) {
+    blocks[i] = back + (size_t)i * bs;
+  }
+  memset(back, 0, (size_t)run * bs);
+  if (readv_blocks(nblocks - run, run, blocks) != run) {
+    fprintf(stderr, "ERROR: reading %d blocks into separate buffers\n", run);
+    error_count++;
+  }
+  for (i = 0; i < run; i++) {
+    if (!check_data(back + (size_t)i * bs, (run - 1 - i) * bs, bs, 1)) {
+      fprintf(stderr, "ERROR: block %d read back wrong\n", nblocks - run + i);
+      error_count++;
+      break;
+    }
+  }
+
+  if (read_blocks(nblocks - 1, 2, back) != -1 || read_blocks(-1, 1, back) != -1
+      || write_blocks(nblocks, 1, data) != -1 || readv_blocks(nblocks - 1, 2, blocks) != -1) {
+    fprintf(stderr, "ERROR: a transfer past the end of the disk was accepted\n");
+    error_count++;
+  }
+
+  /* What was written is there when the disk is opened again */
+  close_disk();
+  if (init_disk(TEST_DISK, bs, nblocks) != 0
+      || read_blocks(3, 1, back) != 1 || !check_data(back, 0, bs, 1)) {
+    fprintf(stderr, "ERROR: data lost when the disk was reopened\n");
+    error_count++;
+  }
+  close_disk();
+
+  free(data);
+  free(back);
+  free(blocks);
+}
+
+/* A fresh disk has its full size at once, reads as 0's throughout,
+ * even where an old image had data, and takes no storage until blocks
+ * are written.
+ */
+static void
+test_fresh_disk()
+{
+  int bs = 4096, nblocks = 25600;
+  int probe[4] = {0, 3, 12800, 25599};
+  char *data = malloc(bs), *zeros = calloc(bs, 1);
+  struct stat st;
+  int i;
+
+  init_fresh_disk(TEST_DISK, bs, 8);
+  fill_data(data, 0, bs, 5);
+  for (i = 0; i < 8; i++) {
+    write_blocks(i, 1, data);
+  }
+  close_disk();
+
+  if (init_fresh_disk(TEST_DISK, bs, nblocks) != 0 || stat(TEST_DISK, &st) != 0) {
+    fprintf(stderr, "ERROR: making a fresh disk of %d blocks\n", nblocks);
+    error_count++;
+    free(data);
+    free(zeros);
+    return;
+  }
+  if (st.st_size != (off_t)bs * nblocks) {
+    fprintf(stderr, "ERROR: fresh disk of %lld bytes, expected %lld\n",
+            (long long)st.st_size, (long long)bs * nblocks);
+    error_count++;
+  }
+  if ((long long)st.st_blocks * 512 > 64 * 1024) {
+    fprintf(stderr, "ERROR: fresh disk already takes %lld bytes\n",
+            (long long)st.st_blocks * 512);
+    error_count++;
+  }
+  for (i = 0; i < 4; i++) {
+    if (read_blocks(probe[i], 1, data) != 1 || memcmp(data, zeros, bs) != 0) {
+      fprintf(stderr, "ERROR: block %d of a fresh disk is not 0's\n", probe[i]);
+      error_count++;
+    }
+  }
+  close_disk();
+  free(data);
+  free(zeros);
+}
+
+static void
+write_strict()
+{
+  int fd;
+  char buf[5000];
+
+  sfs_setsyncmode(SFS_SYNC_STRICT);
+  fd = sfs_fopen("STRICT");
+  fill_data(buf, 0, sizeof(buf), 2);
+  sfs_fwrite(fd, buf, sizeof(buf));
+}
+
+static void
+write_deferred()
+{
+  int fd;
+  char buf[5000];
+
+  sfs_setsyncmode(SFS_SYNC_DEFERRED);
+  fd = sfs_fopen("DEFERRED");
+  fill_data(buf, 0, sizeof(buf), 3);
+  sfs_fwrite(fd, buf, sizeof(buf));
+  sfs_sync();
+}
+
+/* A write in strict mode is durable once the call returns, and in
+ * deferred mode once sfs_sync() returns. Each file is written by a
+ * process that is killed right after.
+ */
+static void
+test_durability()
+{
+  if (set_disk_sync_mode(2) != -1) {
+    fprintf(stderr, "ERROR: an unknown sync mode was accepted\n");
+    error_count++;
+  }
+
+  /* The parent mounts again after each child, to see what it did */
+  mksfs(1);
+  crash(write_strict);
+  mksfs(0);
+  verify_file("STRICT", 5000, 2);
+  crash(write_deferred);
+  mksfs(0);
+  verify_file("DEFERRED", 5000, 3);
+  verify_file("STRICT", 5000, 2);
+}
+
+/* An image written through one backend reads back the same through
+ * the other.
+ */
+static void
+test_backends(int backend)
+{
+  int other = backend == SFS_BACKEND_MMAP ? SFS_BACKEND_PREAD : SFS_BACKEND_MMAP;
+
+  if (sfs_setbackend(-1) != -1) {
+    fprintf(stderr, "ERROR: an unknown backend was accepted\n");
+    error_count++;
+  }
+
+  mksfs(1);
+  write_file("SHARED", 30000, 4);
+  sfs_setbackend(other);
+  mksfs(0);
+  verify_file("SHARED", 30000, 4);
+  sfs_setbackend(backend);
+  mksfs(0);
+  verify_file("SHARED", 30000, 4);
+}
+
+/* Reading a file again is served from a cache large enough to hold it,
+ * and never from one that is turned off. Configurations with a cache
+ * small enough to evict on nearly every call run the other tests.
+ */
+static void
+test_cache(int cache_blocks)
+{
+  long hits, misses, hits_before;
+  int nblocks = 20, bs = 1024, fd;
+  char *buf = malloc(nblocks * bs);
+
+  if (sfs_setcachesize(-1) != -1) {
+    fprintf(stderr, "ERROR: a negative cache size was accepted\n");
+    error_count++;
+  }
+
+  mksfs(1);
+  write_file("CACHED", nblocks * bs, 9);
+  verify_file("CACHED", nblocks * bs, 9);
+
+  sfs_getcachestats(&hits_before, &misses);
+  fd = sfs_fopen("CACHED");
+  sfs_frseek(fd, 0);
+  sfs_fread(fd, buf, nblocks * bs);
+  sfs_fclose(fd);
+  sfs_getcachestats(&hits, &misses);
+  if (cache_blocks >= 2 * nblocks && hits - hits_before < nblocks) {
+    fprintf(stderr, "ERROR: %ld cache hits rereading %d blocks\n",
+            hits - hits_before, nblocks);
+    error_count++;
+  }
+  if (cache_blocks == 0 && hits != 0) {
+    fprintf(stderr, "ERROR: %ld cache hits with the cache off\n", hits);
+    error_count++;
+  }
+
+  mksfs(0);
+  verify_file("CACHED", nblocks * bs, 9);
+  free(buf);
+}
+
+/* Metadata written a piece at a time comes back whole. Files are made,
+ * rewritten and removed over several rounds, touching inodes on both
+ * sides of every inode table block boundary, and everything is checked
+ * after each remount.
+ */
+static void
+test_metadata()
+{
+  int nfiles = 80, rounds = 4;
+  int sizes[80];
+  char path[16];
+  int round, i;
+
+  mksfs(1);
+  for (i = 0; i < nfiles; i++) {
+    sizes[i] = -1;
+  }
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < nfiles; i++) {
+      sprintf(path, "META%02d", i);
+      if (sizes[i] >= 0) {
+        sfs_remove(path);
+        sizes[i] = -1;
+      }
+      if ((i + round) % 3 != 0) {
+        sizes[i] = (i * 397 + round * 1013) % 6000;
+        write_file(path, sizes[i], i + round);
+      }
+    }
+
+    mksfs(0);
+    for (i = 0; i < nfiles; i++) {
+      sprintf(path, "META%02d", i);
+      if (sizes[i] >= 0) {
+        verify_file(path, sizes[i], i + round);
+      }
+      else if (sfs_getfilesize(path) != -1) {
+        fprintf(stderr, "ERROR: removed %s is back after a remount\n", path);
+        error_count++;
+      }
+    }
+  }
+}
+
+/* fill_disk() - writes files named prefix0, prefix1, ... a block at a
+ * time, at most max_blocks each, until the disk is full. Returns the
+ * number of blocks written.
+ */
+static int
+fill_disk(char *prefix, int max_blocks)
+{
+  char path[16];
+  char block[1024];
+  int total = 0, n, k, fd;
+
+  memset(block, 0x3c, sizeof(block));
+  for (k = 0; ; k++) {
+    sprintf(path, "%s%d", prefix, k);
+    fd = sfs_fopen(path);
+    if (fd < 0) {
+      return total;
+    }
+    for (n = 0; n < max_blocks; n++) {
+      if (sfs_fwrite(fd, block, sizeof(block)) != sizeof(block)) {
+        sfs_fclose(fd);
+        return total;
+      }
+      total++;
+    }
+    sfs_fclose(fd);
+  }
+}
+
+/* remove_files() - removes the files fill_disk() made with prefix.
+ */
+static void
+remove_files(char *prefix)
+{
+  char path[16];
+  int k;
+
+  for (k = 0; ; k++) {
+    sprintf(path, "%s%d", prefix, k);
+    if (sfs_remove(path) != 0) {
+      return;
+    }
+  }
+}
+
+/* The free blocks and inodes left on a nearly full disk are found
+ * wherever they are, and a full disk or inode table is reported
+ * instead of reusing what is taken.
+ */
+static void
+test_full_disk()
+{
+  char path[16];
+  int capacity, refill, i, fd;
+
+  mksfs(1);
+  capacity = fill_disk("FILL", 150);
+  if (capacity < 800) {
+    fprintf(stderr, "ERROR: only %d blocks fit on a fresh disk\n", capacity);
+    error_count++;
+  }
+
+  /* A file from the middle of the disk, and the odd blocks of others */
+  sfs_remove("FILL2");
+  refill = fill_disk("REFILL", 150);
+  if (refill != 150) {
+    fprintf(stderr, "ERROR: %d blocks written after freeing 150\n", refill);
+    error_count++;
+  }
+  for (i = 0; i < 5; i++) {
+    sprintf(path, "FILL%d", i);
+    sfs_remove(path);
+  }
+  if (fill_disk("AGAIN", 150) != 5 * 150 - 150) {
+    fprintf(stderr, "ERROR: freed blocks were not all found again\n");
+    error_count++;
+  }
+
+  /* Every inode, then one freed in the middle of the table */
+  mksfs(1);
+  for (i = 0; ; i++) {
+    sprintf(path, "I%d", i);
+    fd = sfs_fopen(path);
+    if (fd < 0) {
+      break;
+    }
+    sfs_fclose(fd);
+  }
+  sfs_remove("I40");
+  fd = sfs_fopen("LAST");
+  if (i < 90 || fd < 0 || sfs_fopen("ONEMORE") >= 0) {
+    fprintf(stderr, "ERROR: %d files fit, then the freed inode %s\n",
+            i, fd < 0 ? "was not found" : "was found twice");
+    error_count++;
+  }
+  sfs_fclose(fd);
+}
+
+/* image_block() - returns the block of the sfs image that holds len
+ * bytes of fill_data() from offset, or -1. Only blocks sfs has synced
+ * are seen.
+ */
+static int
+image_block(int offset, int len, int seed)
+{
+  FILE *image = fopen(SFS_DISK, "rb");
+  char *block = malloc(len);
+  int n, found = -1;
+
+  for (n = 0; image != NULL && fread(block, len, 1, image) == 1; n++) {
+    if (check_data(block, offset, len, seed)) {
+      found = n;
+      break;
+    }
+  }
+  if (image != NULL) {
+    fclose(image);
+  }
+  free(block);
+  return found;
+}
+
+/* Allocation carries on past the blocks it last handed out, so blocks
+ * freed behind it are not reused at once, and a write the disk cannot
+ * hold fails before it takes any blocks.
+ */
+static void
+test_allocator()
+{
+  int bs = 1024, nblocks = 10, i, left;
+  char *buf = malloc(200 * bs);
+
+  mksfs(1);
+  write_file("FIRST", nblocks * bs, 20);
+  sfs_remove("FIRST");
+  write_file("SECOND", nblocks * bs, 21);
+  for (i = 0; i < nblocks; i++) {
+    if (image_block(i * bs, bs, 20) < 0 || image_block(i * bs, bs, 21) < 0) {
+      fprintf(stderr, "ERROR: block %d of the removed file was reused at once\n", i);
+      error_count++;
+      break;
+    }
+  }
+
+  /* 150 blocks are free; a write of 200 must take none of them */
+  mksfs(1);
+  fill_disk("FILL", 150);
+  sfs_remove("FILL1");
+  i = sfs_fopen("BIG");
+  if (sfs_fwrite(i, buf, 200 * bs) == 200 * bs) {
+    fprintf(stderr, "ERROR: a write larger than the free space succeeded\n");
+    error_count++;
+  }
+  sfs_fclose(i);
+  sfs_remove("BIG");
+  left = fill_disk("REST", 150);
+  if (left != 150) {
+    fprintf(stderr, "ERROR: %d blocks left after a failed write, expected 150\n", left);
+    error_count++;
+  }
+  free(buf);
+}
+
+/* A multi-block write goes to one run of adjacent blocks when the disk
+ * has one, even with one-block holes nearer the start of the disk.
+ */
+static void
+test_contiguous()
+{
+  int bs = 1024, nblocks = 40, first, i;
+  char path[16];
+
+  mksfs(1);
+  for (i = 0; i < 60; i++) {
+    sprintf(path, "HOLE%d", i);
+    write_file(path, bs, 100 + i);
+  }
+  for (i = 0; i < 60; i += 2) {
+    sprintf(path, "HOLE%d", i);
+    sfs_remove(path);
+  }
+
+  /* Mounting again starts the allocator from the holes. A new file may */
+  /* be given its first block when it is created, so the run is checked */
+  /* from the second.                                                    */
+  mksfs(0);
+  write_file("RUN", nblocks * bs, 23);
+  first = image_block(bs, bs, 23);
+  for (i = 2; i < nblocks; i++) {
+    if (image_block(i * bs, bs, 23) != first + i - 1) {
+      fprintf(stderr, "ERROR: block %d of a %d-block write is not next to block 1\n",
+              i, nblocks);
+      error_count++;
+      break;
+    }
+  }
+  verify_file("RUN", nblocks * bs, 23);
+}
+
+/* Two files written a block at a time in turn each end up in as many
+ * pieces as blocks, too many to keep in the inode, while a file that
+ * grows into the blocks after it stays one piece and takes nothing but
+ * its data. All of them read back, and removing them gives back every
+ * block they took.
+ */
+static void
+test_extents()
+{
+  int bs = 1024, nblocks = 120, capacity, before, after, i, fa, fb;
+  char block[1024];
+
+  mksfs(1);
+  capacity = fill_disk("FILL", 150);
+  mksfs(1);
+  fa = sfs_fopen("PIECES");
+  fb = sfs_fopen("SPACER");
+  for (i = 0; i < nblocks; i++) {
+    fill_data(block, i * bs, bs, 24);
+    sfs_fwrite(fa, block, bs);
+    fill_data(block, i * bs, bs, 25);
+    sfs_fwrite(fb, block, bs);
+  }
+  sfs_fclose(fa);
+  sfs_fclose(fb);
+
+  before = fill_disk("FILL", 150);
+  remove_files("FILL");
+  write_file("WHOLE", 300 * bs, 26);
+  after = fill_disk("FILL", 150);
+  remove_files("FILL");
+  if (before - after != 300) {
+    fprintf(stderr, "ERROR: a 300-block file written in order took %d blocks\n",
+            before - after);
+    error_count++;
+  }
+
+  mksfs(0);
+  verify_file("PIECES", nblocks * bs, 24);
+  verify_file("SPACER", nblocks * bs, 25);
+  verify_file("WHOLE", 300 * bs, 26);
+
+  sfs_remove("PIECES");
+  sfs_remove("SPACER");
+  sfs_remove("WHOLE");
+  after = fill_disk("FILL", 150);
+  if (after != capacity) {
+    fprintf(stderr, "ERROR: %d blocks free after removing everything, expected %d\n",
+            after, capacity);
+    error_count++;
+  }
+}
+
+/* The layout of the original format, for writing an image by hand */
+struct legacy_super {
+  uint64_t magic_number, block_size, sfs_size, inode_table_len, root_dir_inode_ptr;
+};
+struct legacy_inode {
+  unsigned int mode, link_cnt, uid, gid, file_size;
+  unsigned int direct_ptrs[12];
+  unsigned int indirect_ptr;
+};
+struct legacy_entry {
+  int inode_num;
+  char name[20];
+};
+
+/* legacy_file() - puts a file of nblocks blocks and size bytes of
+ * fill_data() on the image in the original format: its blocks start at
+ * block first and are step apart, and past the twelfth they are found
+ * through the indirect block.
+ */
+static void
+legacy_file(struct legacy_inode *inode, unsigned char *bitmap, int size,
+            int nblocks, int first, int step, int indirect, int seed)
+{
+  unsigned int pointers[256];
+  char block[1024];
+  int i, b;
+
+  memset(inode, 0, sizeof(*inode));
+  inode->link_cnt = nblocks;
+  inode->file_size = size;
+  inode->indirect_ptr = nblocks > 12 ? indirect : -1;
+  for (i = 0; i < nblocks; i++) {
+    b = first + i * step;
+    fill_data(block, i * 1024, 1024, seed);
+    write_blocks(b, 1, block);
+    bitmap[b / 8] |= 1 << (b % 8);
+    if (i < 12) {
+      inode->direct_ptrs[i] = b;
+    }
+    else {
+      pointers[i - 12] = b;
+    }
+  }
+  for (i = nblocks; i < 12; i++) {
+    inode->direct_ptrs[i] = -1;
+  }
+  if (nblocks > 12) {
+    write_blocks(indirect, 1, pointers);
+    bitmap[indirect / 8] |= 1 << (indirect % 8);
+  }
+}
+
+/* An image in the original format, its files mapped by block pointers
+ * and an indirect block, mounts and reads back. A file written to then
+ * carries on in the current format, and the blocks the image had free
+ * are the ones handed out.
+ */
+static void
+test_old_format()
+{
+  struct legacy_super super = {0xACBD0005, 1024, 1024, 100, 0};
+  struct legacy_inode inodes[114];   /* The 8 blocks of the inode table */
+  struct legacy_entry entries[128];  /* The 3 blocks of the root directory */
+  unsigned char status[1024], bitmap[1024];
+  char buf[3000];
+  int i, fd;
+
+  sfs_sync();
+
+  /* Superblock, inode table in blocks 1-8, root directory in 9-11, */
+  /* inode status and block bitmap in the last two                  */
+  init_fresh_disk(SFS_DISK, 1024, 1024);
+  memset(inodes, 0xff, sizeof(inodes));
+  memset(entries, 0, sizeof(entries));
+  memset(status, 0, sizeof(status));
+  memset(bitmap, 0, sizeof(bitmap));
+  for (i = 0; i < 100; i++) {
+    entries[i].inode_num = -1;
+  }
+  for (i = 0; i < 12; i++) {
+    bitmap[i / 8] |= 1 << (i % 8);
+  }
+  bitmap[1022 / 8] |= 3 << (1022 % 8);
+
+  memset(&inodes[0], 0, sizeof(inodes[0]));
+  inodes[0].link_cnt = 3;
+  inodes[0].file_size = -1;
+  inodes[0].indirect_ptr = -1;
+  for (i = 0; i < 12; i++) {
+    inodes[0].direct_ptrs[i] = i < 3 ? 9 + i : -1;
+  }
+  legacy_file(&inodes[1], bitmap, 5000, 5, 20, 1, 0, 30);
+  legacy_file(&inodes[2], bitmap, 19500, 20, 40, 2, 100, 31);
+  entries[0].inode_num = 1;
+  strcpy(entries[0].name, "LEGACY1");
+  entries[1].inode_num = 2;
+  strcpy(entries[1].name, "LEGACY2");
+  status[0] = 7;
+
+  memset(buf, 0, 1024);
+  memcpy(buf, &super, sizeof(super));
+  write_blocks(0, 1, buf);
+  write_blocks(1, 8, inodes);
+  write_blocks(9, 3, entries);
+  write_blocks(1022, 1, status);
+  write_blocks(1023, 1, bitmap);
+  close_disk();
+
+  mksfs(0);
+  verify_file("LEGACY1", 5000, 30);
+  verify_file("LEGACY2", 19500, 31);
+
+  /* With the disk full it cannot move to extents, and keeps its blocks */
+  fill_disk("FILL", 150);
+  fd = sfs_fopen("LEGACY2");
+  fill_data(buf, 19500, sizeof(buf), 31);
+  if (sfs_fwrite(fd, buf, sizeof(buf)) != -1) {
+    fprintf(stderr, "ERROR: appending to a file in the original format on a full disk\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  verify_file("LEGACY2", 19500, 31);
+  remove_files("FILL");
+
+  fd = sfs_fopen("LEGACY2");
+  if (sfs_fwrite(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    fprintf(stderr, "ERROR: appending to a file in the original format\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  sfs_remove("LEGACY1");
+  write_file("NEW", 40 * 1024, 32);
+
+  mksfs(0);
+  verify_file("LEGACY2", 19500 + sizeof(buf), 31);
+  verify_file("NEW", 40 * 1024, 32);
+  if (sfs_getfilesize("LEGACY1") != -1) {
+    fprintf(stderr, "ERROR: removed LEGACY1 is back after a remount\n");
+    error_count++;
+  }
+}
+
+/* check_names() - checks that each name whose size is not -1 is found
+ * with that size, that the others are not found, and that listing the
+ * directory gives each file once.
+ */
+static void
+check_names(char names[][16], int *sizes, int n)
+{
+  char fname[MAX_FNAME_LENGTH + 1];
+  int seen[100];
+  int i, listed = 0, expected = 0;
+
+  memset(seen, 0, sizeof(seen));
+  for (i = 0; i < n; i++) {
+    if (sfs_getfilesize(names[i]) != sizes[i]) {
+      fprintf(stderr, "ERROR: %s has size %d, expected %d\n",
+              names[i], sfs_getfilesize(names[i]), sizes[i]);
+      error_count++;
+    }
+    if (sizes[i] != -1) {
+      expected++;
+    }
+  }
+  while (sfs_getnextfilename(fname)) {
+    for (i = 0; i < n && strcmp(fname, names[i]) != 0; i++)
+      ;
+    if (i == n || sizes[i] == -1 || seen[i]++) {
+      fprintf(stderr, "ERROR: %s listed but not expected\n", fname);
+      error_count++;
+    }
+    listed++;
+  }
+  if (listed != expected) {
+    fprintf(stderr, "ERROR: %d files listed, expected %d\n", listed, expected);
+    error_count++;
+  }
+}
+
+/* Names are found however files come and go. A full directory of names
+ * sharing prefixes is made, emptied and refilled in an order unrelated
+ * to how it was made, and looked up after each step and each remount.
+ */
+static void
+test_names()
+{
+  char names[90][16];
+  int sizes[90];
+  int n = 90, round, i, k;
+
+  mksfs(1);
+  for (i = 0; i < n; i++) {
+    sprintf(names[i], "%.*s%d", i % 4 + 1, "NAME", i);
+    sizes[i] = -1;
+  }
+  for (round = 0; round < 3; round++) {
+    for (i = 0; i < n; i++) {
+      k = (i * 37 + round * 11) % n;
+      if (sizes[k] == -1) {
+        sizes[k] = (k * 13 + round) % 900;
+        write_file(names[k], sizes[k], k);
+      }
+    }
+    check_names(names, sizes, n);
+    for (i = 0; i < n; i++) {
+      k = (i * 53 + round * 7) % n;
+      if ((k + round) % 3 != 0) {
+        sfs_remove(names[k]);
+        sizes[k] = -1;
+      }
+      if (i % 30 == 29) {
+        check_names(names, sizes, n);
+      }
+    }
+    mksfs(0);
+    check_names(names, sizes, n);
+  }
+}
+
+/* Directories nest, hold their own names, list in the order entries
+ * were added from any cookie, and are removed only when empty. All of
+ * it is still there after a remount.
+ */
+static void
+test_directories()
+{
+  char path[64];
+  char name[64];
+  sfs_dirent entries[7];
+  uint64_t cookie, resume;
+  int seen[50];
+  int i, k, n, total;
+
+  mksfs(1);
+  if (sfs_mkdir("/dir") != 0 || sfs_mkdir("dir/sub") != 0) {
+    fprintf(stderr, "ERROR: creating directories\n");
+    error_count++;
+  }
+  if (sfs_mkdir("/dir") == 0 || sfs_mkdir("/missing/sub") == 0) {
+    fprintf(stderr, "ERROR: created /dir twice, or under a missing parent\n");
+    error_count++;
+  }
+  if (sfs_isdir("/dir/sub") != 1 || sfs_isdir("/missing") != -1) {
+    fprintf(stderr, "ERROR: sfs_isdir\n");
+    error_count++;
+  }
+
+  for (i = 0; i < 50; i++) {
+    sprintf(path, "/dir/sub/F%02d", i);
+    write_file(path, i * 100, i);
+  }
+  write_file("/dir/F00", 5000, 99);
+  if (sfs_isdir("/dir/F00") != 0) {
+    fprintf(stderr, "ERROR: sfs_isdir on a file\n");
+    error_count++;
+  }
+
+  /* The same name in two directories names two files */
+  verify_file("/dir/sub/F00", 0, 0);
+  verify_file("/dir/F00", 5000, 99);
+
+  /* Listed in the order they were made, and again from a saved cookie */
+  cookie = 0;
+  resume = 0;
+  for (total = 0; sfs_readdir("/dir/sub", &cookie, name) == 1; total++) {
+    sprintf(path, "F%02d", total);
+    if (strcmp(name, path) != 0) {
+      fprintf(stderr, "ERROR: %s listed where %s was expected\n", name, path);
+      error_count++;
+      break;
+    }
+    if (total == 29) {
+      resume = cookie;
+    }
+  }
+  if (total != 50) {
+    fprintf(stderr, "ERROR: listed %d entries of /dir/sub\n", total);
+    error_count++;
+  }
+  if (sfs_readdir("/dir/sub", &resume, name) != 1 || strcmp(name, "F30") != 0) {
+    fprintf(stderr, "ERROR: resuming the listing of /dir/sub\n");
+    error_count++;
+  }
+
+  /* With attributes, a small batch makes the listing resume from its */
+  /* cookie many times                                                  */
+  memset(seen, 0, sizeof(seen));
+  cookie = 0;
+  total = 0;
+  while ((n = sfs_readdirplus("/dir/sub", &cookie, entries, 7)) > 0) {
+    for (i = 0; i < n; i++) {
+      k = atoi(entries[i].name + 1);
+      if (k < 0 || k >= 50 || entries[i].is_dir || entries[i].size != k * 100) {
+        fprintf(stderr, "ERROR: bad entry %s\n", entries[i].name);
+        error_count++;
+      }
+      else {
+        seen[k]++;
+      }
+    }
+    total += n;
+  }
+  for (i = 0; i < 50; i++) {
+    if (seen[i] != 1) {
+      fprintf(stderr, "ERROR: F%02d listed %d times\n", i, seen[i]);
+      error_count++;
+      break;
+    }
+  }
+  if (n != 0 || total != 50) {
+    fprintf(stderr, "ERROR: listed %d entries of /dir/sub with attributes\n", total);
+    error_count++;
+  }
+  cookie = 0;
+  if (sfs_readdirplus("/dir", &cookie, entries, 7) != 2 || !entries[0].is_dir
+      || entries[0].size != 50 || entries[1].size != 5000) {
+    fprintf(stderr, "ERROR: attributes of the entries in /dir\n");
+    error_count++;
+  }
+
+  /* Subdirectories are listed, and the root is listed as before */
+  cookie = 0;
+  total = 0;
+  while (sfs_readdir("/dir", &cookie, name) == 1) {
+    if (strcmp(name, "sub") != 0 && strcmp(name, "F00") != 0) {
+      fprintf(stderr, "ERROR: unexpected %s in /dir\n", name);
+      error_count++;
+    }
+    total++;
+  }
+  if (total != 2 || sfs_readdir("/dir/F00", &cookie, name) != -1) {
+    fprintf(stderr, "ERROR: listing /dir\n");
+    error_count++;
+  }
+  if (!sfs_getnextfilename(name) || strcmp(name, "dir") != 0 || sfs_getnextfilename(name)) {
+    fprintf(stderr, "ERROR: listing the root\n");
+    error_count++;
+  }
+
+  if (sfs_rmdir("/dir/sub") == 0 || sfs_remove("/dir/sub") == 0) {
+    fprintf(stderr, "ERROR: removed a directory that is not empty\n");
+    error_count++;
+  }
+
+  mksfs(0);
+  for (i = 0; i < 50; i += 7) {
+    sprintf(path, "/dir/sub/F%02d", i);
+    verify_file(path, i * 100, i);
+  }
+
+  for (i = 0; i < 50; i++) {
+    sprintf(path, "/dir/sub/F%02d", i);
+    if (sfs_remove(path) != 0) {
+      fprintf(stderr, "ERROR: removing %s\n", path);
+      error_count++;
+    }
+  }
+  if (sfs_rmdir("/dir/sub") != 0 || sfs_isdir("/dir/sub") != -1) {
+    fprintf(stderr, "ERROR: removing the empty /dir/sub\n");
+    error_count++;
+  }
+  mksfs(0);
+  verify_file("/dir/F00", 5000, 99);
+  if (sfs_isdir("/dir/sub") != -1) {
+    fprintf(stderr, "ERROR: removed /dir/sub is back after a remount\n");
+    error_count++;
+  }
+}
+
+/* Reads return the bytes asked for and stop at the end of the file,
+ * wherever they start and end within a block, and never write past what
+ * they return. A read at the end of the file returns 0.
+ */
+static void
+test_read_bounds()
+{
+  static const int ranges[][2] = {
+    {0, 1}, {5, 1000}, {1000, 48}, {1024, 1024}, {1023, 2050},
+    {3000, 4000}, {0, 10540}, {10239, 301}, {10200, 1000}, {10539, 5},
+    {10540, 1}, {10540, 0},
+  };
+  int size = 10 * 1024 + 300, guard = 64;
+  char *buf = malloc(12 * 1024 + guard);
+  int i, j, fd, n, expected, offset, len;
+
+  mksfs(1);
+  write_file("BOUNDS", size, 27);
+  fd = sfs_fopen("BOUNDS");
+  for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+    offset = ranges[i][0];
+    len = ranges[i][1];
+    expected = offset + len > size ? size - offset : len;
+    memset(buf, GUARD_BYTE, len + guard);
+    sfs_frseek(fd, offset);
+    n = sfs_fread(fd, buf, len);
+    if (n != expected || !check_data(buf, offset, n, 27)) {
+      fprintf(stderr, "ERROR: reading %d bytes at %d gave %d, expected %d\n",
+              len, offset, n, expected);
+      error_count++;
+      continue;
+    }
+    for (j = n; j < len + guard; j++) {
+      if (buf[j] != GUARD_BYTE) {
+        fprintf(stderr, "ERROR: reading %d bytes at %d wrote past byte %d\n",
+                len, offset, n);
+        error_count++;
+        break;
+      }
+    }
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* Overwriting whole blocks does not read them first; overwriting part
+ * of a block reads just that block. Reads are counted as cache misses,
+ * so this is only seen with the cache on, after a remount has emptied
+ * it.
+ */
+static void
+test_overwrite(int cache_blocks)
+{
+  int bs = 1024, size = 12 * 1024;
+  long hits, before, after;
+  char *buf = malloc(size);
+  int fd;
+
+  mksfs(1);
+  write_file("OVER", size, 28);
+  mksfs(0);
+
+  fd = sfs_fopen("OVER");
+  sfs_getcachestats(&hits, &before);
+  fill_data(buf, 2 * bs, 8 * bs, 29);
+  sfs_fwseek(fd, 2 * bs);
+  sfs_fwrite(fd, buf, 8 * bs);
+  sfs_sync();
+  sfs_getcachestats(&hits, &after);
+  if (cache_blocks > 0 && after != before) {
+    fprintf(stderr, "ERROR: overwriting 8 whole blocks read %ld\n", after - before);
+    error_count++;
+  }
+
+  before = after;
+  fill_data(buf, 10 * bs + 100, 200, 29);
+  sfs_fwseek(fd, 10 * bs + 100);
+  sfs_fwrite(fd, buf, 200);
+  sfs_sync();
+  sfs_getcachestats(&hits, &after);
+  if (cache_blocks > 0 && after - before != 1) {
+    fprintf(stderr, "ERROR: overwriting part of a block read %ld\n", after - before);
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  /* The old bytes around the new ones are kept */
+  mksfs(0);
+  fd = sfs_fopen("OVER");
+  sfs_frseek(fd, 0);
+  if (sfs_fread(fd, buf, size) != size || !check_data(buf, 0, 2 * bs, 28)
+      || !check_data(buf + 2 * bs, 2 * bs, 8 * bs, 29)
+      || !check_data(buf + 10 * bs, 10 * bs, 100, 28)
+      || !check_data(buf + 10 * bs + 100, 10 * bs + 100, 200, 29)
+      || !check_data(buf + 10 * bs + 300, 10 * bs + 300, size - 10 * bs - 300, 28)) {
+    fprintf(stderr, "ERROR: wrong data in OVER after overwriting it\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* read_block() - reads block b of an open file and returns the cache
+ * misses the read added.
+ */
+static long
+read_block(int fd, int b, char *buf)
+{
+  long hits, before, after;
+
+  sfs_getcachestats(&hits, &before);
+  sfs_frseek(fd, b * 1024);
+  sfs_fread(fd, buf, 1024);
+  sfs_getcachestats(&hits, &after);
+  return after - before;
+}
+
+/* A file read front to back is loaded ahead of the reader, so nearly
+ * every read is served from the cache. Reads that jump about shrink the
+ * window back, so a later short sequential run only loads a few blocks
+ * ahead. Only a cache large enough to hold the window can show this.
+ */
+static void
+test_readahead(int cache_blocks)
+{
+  static const int jumps[] = {200, 120, 260, 160, 230, 140, 180};
+  int nblocks = 300, size = 300 * 1024, i, fd, n;
+  long hits, before, after;
+  char buf[1024];
+
+  if (cache_blocks < 128) {
+    return;
+  }
+  mksfs(1);
+  write_file("STREAM", size, 33);
+
+  /* The cache starts empty after each remount */
+  mksfs(0);
+  fd = sfs_fopen("STREAM");
+  sfs_frseek(fd, 0);
+  sfs_getcachestats(&hits, &before);
+  for (i = 0; i < size; i += n) {
+    n = sfs_fread(fd, buf, 1000);
+    if (n <= 0 || !check_data(buf, i, n, 33)) {
+      fprintf(stderr, "ERROR: reading STREAM at %d\n", i);
+      error_count++;
+      break;
+    }
+  }
+  sfs_getcachestats(&hits, &after);
+  if (after - before > 10) {
+    fprintf(stderr, "ERROR: %ld cache misses reading %d blocks in order\n",
+            after - before, nblocks);
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  mksfs(0);
+  fd = sfs_fopen("STREAM");
+  for (i = 0; i < 40; i++) {
+    read_block(fd, i, buf);
+  }
+  for (i = 0; i < sizeof(jumps) / sizeof(jumps[0]); i++) {
+    read_block(fd, jumps[i], buf);
+  }
+  read_block(fd, 181, buf);
+  if (read_block(fd, 190, buf) != 1) {
+    fprintf(stderr, "ERROR: random reads left a wide read-ahead window\n");
+    error_count++;
+  }
+  if (read_block(fd, 191, buf) != 0 || !check_data(buf, 191 * 1024, 1024, 33)) {
+    fprintf(stderr, "ERROR: no read-ahead after a read that follows the last\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+}
+
+/* Small writes through a write buffer land where unbuffered ones
+ * would. Reads, sizes and seeks back into the buffered range see them
+ * before the buffer is flushed.
+ */
+static void
+test_writebuf()
+{
+  int size = 40000, chunk = 37;
+  char *buf = malloc(size + 1);
+  int fd, pos, n;
+
+  mksfs(1);
+  fd = sfs_fopen("BUFFERED");
+  if (sfs_setwritebuf(fd, -1) != -1 || sfs_setwritebuf(fd + 1, 4096) != -1) {
+    fprintf(stderr, "ERROR: sfs_setwritebuf accepted a bad size or descriptor\n");
+    error_count++;
+  }
+  if (sfs_setwritebuf(fd, 4096) != 0) {
+    fprintf(stderr, "ERROR: turning on write buffering\n");
+    error_count++;
+  }
+
+  for (pos = 0; pos < size; pos += n) {
+    n = size - pos < chunk ? size - pos : chunk;
+    fill_data(buf, pos, n, 4);
+    if (sfs_fwrite(fd, buf, n) != n) {
+      fprintf(stderr, "ERROR: buffered write at %d\n", pos);
+      error_count++;
+      break;
+    }
+
+    /* Now and then read back the last bytes written */
+    if (pos % 1000 < chunk) {
+      if (sfs_getfilesize("BUFFERED") != pos + n) {
+        fprintf(stderr, "ERROR: size %d with %d bytes written\n",
+                sfs_getfilesize("BUFFERED"), pos + n);
+        error_count++;
+      }
+      sfs_frseek(fd, pos);
+      if (sfs_fread(fd, buf, n) != n || !check_data(buf, pos, n, 4)) {
+        fprintf(stderr, "ERROR: buffered bytes at %d read back wrong\n", pos);
+        error_count++;
+      }
+    }
+  }
+
+  /* Rewrite a range the buffer may still hold, then one it has flushed */
+  fill_data(buf, size - 100, 50, 4);
+  sfs_fwseek(fd, size - 100);
+  sfs_fwrite(fd, buf, 50);
+  fill_data(buf, 10, 50, 4);
+  sfs_fwseek(fd, 10);
+  sfs_fwrite(fd, buf, 50);
+  if (sfs_setwritebuf(fd, 0) != 0) {
+    fprintf(stderr, "ERROR: turning off write buffering\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  mksfs(0);
+  verify_file("BUFFERED", size, 4);
+  free(buf);
+}
+
+static void
+change_and_sync()
+{
+  write_file("/keep/NEW", 20000, 6);
+  sfs_remove("/keep/OLD");
+  sfs_mkdir("/made");
+  sfs_sync();
+}
+
+/* Changes a process makes and syncs survive it dying before they reach
+ * their home blocks. A child process makes them and is killed, so they
+ * are left only in the journal, and the parent mounts the image again.
+ */
+static void
+test_replay()
+{
+  mksfs(1);
+  sfs_mkdir("/keep");
+  write_file("/keep/OLD", 3000, 5);
+  crash(change_and_sync);
+
+  mksfs(0);
+  verify_file("/keep/NEW", 20000, 6);
+  if (sfs_getfilesize("/keep/OLD") != -1) {
+    fprintf(stderr, "ERROR: removed file is back after replay\n");
+    error_count++;
+  }
+  if (sfs_isdir("/made") != 1) {
+    fprintf(stderr, "ERROR: directory missing after replay\n");
+    error_count++;
+  }
+
+  /* A second mount finds the log already applied */
+  mksfs(0);
+  verify_file("/keep/NEW", 20000, 6);
+  if (sfs_getfilesize("/keep/OLD") != -1) {
+    fprintf(stderr, "ERROR: removed file is back after a second mount\n");
+    error_count++;
+  }
+}
+
+/* Where an io_uring cannot be set up, the io_uring backend still works,
+ * through pread. A child process is left one file descriptor, which the
+ * image takes, so the ring cannot have one.
+ */
+static void
+test_uring_fallback(int backend)
+{
+  struct rlimit limit;
+  pid_t pid;
+  int status, fd;
+
+  if (backend != SFS_BACKEND_URING) {
+    return;
+  }
+  pid = fork();
+  if (pid == 0) {
+    /* The child reports only its own errors */
+    error_count = 0;
+    close_disk();
+    fd = dup(0);
+    close(fd);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = fd + 1;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    mksfs(1);
+    write_file("NORING", 50000, 34);
+    verify_file("NORING", 50000, 34);
+    mksfs(0);
+    verify_file("NORING", 50000, 34);
+    _exit(error_count);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    fprintf(stderr, "ERROR: running the child process\n");
+    error_count++;
+    return;
+  }
+  error_count += WEXITSTATUS(status);
+}
+
+/* block_size() - the block size of the mounted file system.
+ */
+static int
+block_size()
+{
+  sfs_statfs_t st;
+
+  sfs_statfs(&st);
+  return st.block_size;
+}
+
+/* free_blocks() - the blocks still free on the mounted file system.
+ */
+static int
+free_blocks()
+{
+  sfs_statfs_t st;
+
+  sfs_statfs(&st);
+  return st.free_blocks;
+}
+
+struct worker {
+  pthread_t thread;
+  int id;
+  int sizes[THREAD_FILES];
+  int errors;                   /* Counted apart from error_count, which */
+};                              /* only the main thread changes          */
+
+/* run_worker() - appends to files in the thread's own directory and in
+ * one all the threads share, reading each back after every append.
+ */
+static void *
+run_worker(void *arg)
+{
+  struct worker *w = arg;
+  char path[64];
+  char *buf = malloc(2000), *back = malloc(THREAD_ROUNDS * 2000);
+  int round, f, fd, len;
+
+  for (round = 0; round < THREAD_ROUNDS; round++) {
+    for (f = 0; f < THREAD_FILES; f++) {
+      if (f % 2 == 0) {
+        sprintf(path, "/T%d/F%d", w->id, f);
+      }
+      else {
+        sprintf(path, "/shared/T%dF%d", w->id, f);
+      }
+      fd = sfs_fopen(path);
+      if (fd < 0) {
+        w->errors++;
+        continue;
+      }
+      len = 100 + (round * 1543 + f * 211 + w->id * 37) % 1900;
+      fill_data(buf, w->sizes[f], len, w->id * THREAD_FILES + f);
+      if (sfs_fwrite(fd, buf, len) != len) {
+        w->errors++;
+      }
+      w->sizes[f] += len;
+
+      sfs_frseek(fd, 0);
+      if (sfs_fread(fd, back, w->sizes[f]) != w->sizes[f]
+          || !check_data(back, 0, w->sizes[f], w->id * THREAD_FILES + f)) {
+        w->errors++;
+      }
+      sfs_fclose(fd);
+    }
+  }
+  free(buf);
+  free(back);
+  return NULL;
+}
+
+/* Threads working on their own files at the same time, some of them in
+ * a directory they share, do not disturb each other's data, and what
+ * they wrote is all there once they are done.
+ */
+static void
+test_threads()
+{
+  struct worker workers[NTHREADS];
+  char path[64];
+  char name[64];
+  uint64_t cookie = 0;
+  int i, f, listed = 0, before;
+
+  mksfs(1);
+  sfs_mkdir("/shared");
+  memset(workers, 0, sizeof(workers));
+  for (i = 0; i < NTHREADS; i++) {
+    sprintf(path, "/T%d", i);
+    sfs_mkdir(path);
+  }
+  before = free_blocks();
+  for (i = 0; i < NTHREADS; i++) {
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (i = 0; i < NTHREADS; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].errors != 0) {
+      fprintf(stderr, "ERROR: thread %d saw %d errors\n", i, workers[i].errors);
+      error_count++;
+    }
+  }
+
+  while (sfs_readdir("/shared", &cookie, name) == 1) {
+    listed++;
+  }
+  if (listed != NTHREADS * THREAD_FILES / 2) {
+    fprintf(stderr, "ERROR: %d files in /shared, expected %d\n",
+            listed, NTHREADS * THREAD_FILES / 2);
+    error_count++;
+  }
+
+  mksfs(0);
+  for (i = 0; i < NTHREADS; i++) {
+    for (f = 0; f < THREAD_FILES; f++) {
+      if (f % 2 == 0) {
+        sprintf(path, "/T%d/F%d", i, f);
+      }
+      else {
+        sprintf(path, "/shared/T%dF%d", i, f);
+      }
+      verify_file(path, workers[i].sizes[f], i * THREAD_FILES + f);
+      sfs_remove(path);
+    }
+    sprintf(path, "/T%d", i);
+    sfs_rmdir(path);
+  }
+  sfs_rmdir("/shared");
+
+  /* Every block the threads took has been given back, the directories' */
+  /* indexes along with the files                                        */
+  mksfs(0);
+  if (free_blocks() != before) {
+    fprintf(stderr, "ERROR: %d blocks free after removing everything, expected %d\n",
+            free_blocks(), before);
+    error_count++;
+  }
+}
+
+/* Truncating frees the blocks past the new end, and growing a file by
+ * truncation leaves a hole that takes no blocks and reads as zeros,
+ * even where the old bytes of a cut block were.
+ */
+static void
+test_truncate()
+{
+  int bs, nblocks = 100, keep = 10;
+  int fd, other, i, before;
+  char *buf, *zeros;
+
+  mksfs(1);
+  bs = block_size();
+  buf = malloc((size_t)nblocks * bs);
+  zeros = calloc(bs, 1);
+
+  /* Writing a block to each of two files in turn keeps every block of */
+  /* the first file apart from the next                                */
+  fd = sfs_fopen("EXTENTS");
+  other = sfs_fopen("SPACER");
+  for (i = 0; i < nblocks; i++) {
+    fill_data(buf, i * bs, bs, 1);
+    sfs_fwrite(fd, buf, bs);
+    sfs_fwrite(other, buf, bs);
+  }
+  sfs_fclose(other);
+  sfs_remove("SPACER");
+
+  before = free_blocks();
+  if (sfs_ftruncate(fd, keep * bs + 100) != 0 || sfs_getfilesize("EXTENTS") != keep * bs + 100) {
+    fprintf(stderr, "ERROR: truncating to %d blocks\n", keep);
+    error_count++;
+  }
+  if (free_blocks() < before + nblocks - keep - 1) {
+    fprintf(stderr, "ERROR: truncate freed %d blocks, expected %d\n",
+            free_blocks() - before, nblocks - keep - 1);
+    error_count++;
+  }
+  if (sfs_ftruncate(fd, -1) != -1 || sfs_ftruncate(fd + 1, 0) != -1) {
+    fprintf(stderr, "ERROR: sfs_ftruncate accepted a bad size or descriptor\n");
+    error_count++;
+  }
+
+  /* Growing by truncation takes no blocks, and the cut bytes stay gone */
+  before = free_blocks();
+  if (sfs_ftruncate(fd, (nblocks + 5) * bs + 10) != 0 || free_blocks() != before) {
+    fprintf(stderr, "ERROR: growing by truncation\n");
+    error_count++;
+  }
+  sfs_frseek(fd, keep * bs);
+  if (sfs_fread(fd, buf, bs) != bs || !check_data(buf, keep * bs, 100, 1)
+      || memcmp(buf + 100, zeros, bs - 100) != 0) {
+    fprintf(stderr, "ERROR: the cut block does not read as zeros past the cut\n");
+    error_count++;
+  }
+  sfs_frseek(fd, nblocks * bs);
+  if (sfs_fread(fd, buf, bs) != bs || memcmp(buf, zeros, bs) != 0) {
+    fprintf(stderr, "ERROR: the grown part does not read as zeros\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  mksfs(0);
+  fd = sfs_fopen("EXTENTS");
+  sfs_frseek(fd, 5 * bs);
+  if (sfs_getfilesize("EXTENTS") != (nblocks + 5) * bs + 10
+      || sfs_fread(fd, buf, bs) != bs || !check_data(buf, 5 * bs, bs, 1)) {
+    fprintf(stderr, "ERROR: truncated file wrong after remount\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buf);
+  free(zeros);
+}
+
+/* The calls taking inode numbers see the same files as the calls taking
+ * paths: made by one kind, they are found, written, listed and removed
+ * by the other.
+ */
+static void
+test_inode_calls()
+{
+  char name[64];
+  char buf[3000];
+  uint64_t cookie = 0;
+  int dir, file, fd, size, inode;
+
+  mksfs(1);
+  dir = sfs_mkdirat(SFS_ROOT_INODE, "idir");
+  if (dir < 0 || sfs_mkdirat(SFS_ROOT_INODE, "idir") != -1 || sfs_isdir("/idir") != 1
+      || sfs_lookup(SFS_ROOT_INODE, "idir") != dir) {
+    fprintf(stderr, "ERROR: making idir by inode\n");
+    error_count++;
+    return;
+  }
+  if (sfs_istat(dir, &size) != 1 || size != 0) {
+    fprintf(stderr, "ERROR: sfs_istat on an empty directory\n");
+    error_count++;
+  }
+
+  file = sfs_createat(dir, "F");
+  if (file < 0 || sfs_createat(dir, "F") != file || sfs_createat(dir, "a/b") != -1
+      || sfs_lookup(dir, "F") != file) {
+    fprintf(stderr, "ERROR: creating idir/F by inode\n");
+    error_count++;
+    return;
+  }
+  fd = sfs_fopen_inode(file);
+  fill_data(buf, 0, sizeof(buf), 35);
+  if (fd < 0 || sfs_fwrite(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    fprintf(stderr, "ERROR: writing idir/F opened by inode\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  if (sfs_fopen_inode(dir) != -1) {
+    fprintf(stderr, "ERROR: opened a directory as a file\n");
+    error_count++;
+  }
+
+  mksfs(0);
+  verify_file("/idir/F", sizeof(buf), 35);
+  if (sfs_istat(file, &size) != 0 || size != sizeof(buf)) {
+    fprintf(stderr, "ERROR: sfs_istat on idir/F\n");
+    error_count++;
+  }
+  if (sfs_readdirat(dir, &cookie, name, &inode) != 1 || strcmp(name, "F") != 0
+      || inode != file || sfs_readdirat(dir, &cookie, name, &inode) != 0
+      || sfs_readdirat(file, &cookie, name, &inode) != -1) {
+    fprintf(stderr, "ERROR: listing idir by inode\n");
+    error_count++;
+  }
+
+  if (sfs_rmdirat(SFS_ROOT_INODE, "idir") != -1) {
+    fprintf(stderr, "ERROR: removed idir while it held F\n");
+    error_count++;
+  }
+  if (sfs_unlinkat(dir, "F") != 0 || sfs_istat(file, &size) != -1
+      || sfs_getfilesize("/idir/F") != -1) {
+    fprintf(stderr, "ERROR: unlinking idir/F by inode\n");
+    error_count++;
+  }
+  if (sfs_rmdirat(SFS_ROOT_INODE, "idir") != 0 || sfs_lookup(SFS_ROOT_INODE, "idir") != -1) {
+    fprintf(stderr, "ERROR: removing idir by inode\n");
+    error_count++;
+  }
+}
+
+/* Usage counts follow creating, writing and removing files, and blocks
+ * freed since the journal's last checkpoint already count as free.
+ */
+static void
+test_statfs()
+{
+  sfs_statfs_t fresh, base, st;
+  char path[16];
+  int bs, fd, i;
+  char *buf;
+
+  mksfs(1);
+  sfs_statfs(&fresh);
+  bs = fresh.block_size;
+  if (fresh.total_blocks != SFS_DEFAULT_NUM_BLOCKS || fresh.free_blocks <= 0
+      || fresh.free_blocks >= fresh.total_blocks
+      || fresh.free_inodes != fresh.total_inodes - 1
+      || fresh.max_name_len < MAX_FILENAME_LEN + MAX_EXTENSION_LEN + 1) {
+    fprintf(stderr, "ERROR: fresh usage %d/%d blocks, %d/%d inodes, names of %d\n",
+            fresh.free_blocks, fresh.total_blocks, fresh.free_inodes,
+            fresh.total_inodes, fresh.max_name_len);
+    error_count++;
+  }
+
+  /* The first file also gives the root directory its index, which */
+  /* stays once the directory is empty again                       */
+  for (i = 0; i < 5; i++) {
+    sprintf(path, "EMPTY%d", i);
+    sfs_fclose(sfs_fopen(path));
+  }
+  sfs_statfs(&base);
+  if (base.free_inodes != fresh.free_inodes - 5) {
+    fprintf(stderr, "ERROR: %d inodes free after creating 5, expected %d\n",
+            base.free_inodes, fresh.free_inodes - 5);
+    error_count++;
+  }
+
+  /* Ten blocks of data take at least ten blocks */
+  buf = calloc(10, bs);
+  fd = sfs_fopen("DATA");
+  sfs_fwrite(fd, buf, 10 * bs);
+  sfs_fclose(fd);
+  sfs_statfs(&st);
+  if (st.free_blocks > base.free_blocks - 10 || st.free_inodes != base.free_inodes - 1) {
+    fprintf(stderr, "ERROR: %d blocks free after writing 10, from %d\n",
+            st.free_blocks, base.free_blocks);
+    error_count++;
+  }
+
+  sfs_remove("DATA");
+  sfs_statfs(&st);
+  if (st.free_blocks != base.free_blocks || st.free_inodes != base.free_inodes) {
+    fprintf(stderr, "ERROR: usage %d blocks, %d inodes after a remove, expected %d, %d\n",
+            st.free_blocks, st.free_inodes, base.free_blocks, base.free_inodes);
+    error_count++;
+  }
+
+  for (i = 0; i < 5; i++) {
+    sprintf(path, "EMPTY%d", i);
+    sfs_remove(path);
+  }
+  sfs_statfs(&st);
+  if (st.free_inodes != fresh.free_inodes) {
+    fprintf(stderr, "ERROR: %d inodes free after removing everything, expected %d\n",
+            st.free_inodes, fresh.free_inodes);
+    error_count++;
+  }
+  free(buf);
+}
+
+/* check_geometry() - checks the mounted file system has the given
+ * geometry.
+ */
+static void
+check_geometry(int block_size, int num_blocks, int num_inodes)
+{
+  sfs_statfs_t st;
+
+  sfs_statfs(&st);
+  if (st.block_size != block_size || st.total_blocks != num_blocks
+      || st.total_inodes != num_inodes) {
+    fprintf(stderr, "ERROR: geometry %d x %d, %d inodes, expected %d x %d, %d inodes\n",
+            st.block_size, st.total_blocks, st.total_inodes,
+            block_size, num_blocks, num_inodes);
+    error_count++;
+  }
+}
+
+/* Images can be made with another geometry, which a later mount reads
+ * back from the superblock. Geometries that cannot hold the metadata
+ * are refused.
+ */
+static void
+test_geometry()
+{
+  char path[32];
+  int i;
+
+  if (mksfs_geometry(1000, 1024, 100) != -1      /* Not a power of two */
+      || mksfs_geometry(1024, 100, 100) != -1    /* No room for the journal */
+      || mksfs_geometry(1024, 1024, 1) != -1     /* No inode past the root */
+      || mksfs_geometry(-1, 1024, 100) != -1) {
+    fprintf(stderr, "ERROR: an invalid geometry was accepted\n");
+    error_count++;
+  }
+
+  if (mksfs_geometry(4096, 2048, 200) != 0) {
+    fprintf(stderr, "ERROR: mksfs_geometry(4096, 2048, 200) failed\n");
+    error_count++;
+    return;
+  }
+  check_geometry(4096, 2048, 200);
+  for (i = 0; i < 150; i++) {
+    sprintf(path, "G%03d", i);
+    write_file(path, i * 97, i);
+  }
+  write_file("LARGE", 3000000, 8);
+
+  mksfs(0);
+  check_geometry(4096, 2048, 200);
+  for (i = 0; i < 150; i += 11) {
+    sprintf(path, "G%03d", i);
+    verify_file(path, i * 97, i);
+  }
+  verify_file("LARGE", 3000000, 8);
+
+  mksfs(1);
+  check_geometry(SFS_DEFAULT_BLOCK_SIZE, SFS_DEFAULT_NUM_BLOCKS, SFS_DEFAULT_NUM_INODES);
+}
+
+/* resident_kb() - returns how much of this process is in memory, in KB.
+ */
+static long
+resident_kb()
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size, resident = 0;
+
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* The block cache takes memory for the blocks it holds, not for every
+ * block on the disk, so mounting a large image costs little.
+ */
+static void
+test_large_image()
+{
+  long before = resident_kb();
+
+  if (mksfs_geometry(1024, 1 << 24, 100) != 0) {
+    fprintf(stderr, "ERROR: mksfs_geometry(1024, 1 << 24, 100) failed\n");
+    error_count++;
+    return;
+  }
+  write_file("LARGE", 100000, 10);
+  verify_file("LARGE", 100000, 10);
+  if (resident_kb() - before > 16 * 1024) {
+    fprintf(stderr, "ERROR: a disk of 1 << 24 blocks took %ld KB\n",
+            resident_kb() - before);
+    error_count++;
+  }
+  mksfs(1);
+}
+
+/* Names are listed with sfs_getnextfilename() into a buffer that is
+ * only checked up to the name's NUL, so a listing must not write past
+ * it. Names of every length up to a full 16.3 name are tried.
+ */
+static void
+test_listing()
+{
+  char names[4][NAME_BUF] = {"A", "FOURTEENCHARS.", "SIXTEENCHARSLONG",
+                             "SIXTEENCHARSNAME.TXT"};
+  char buf[NAME_BUF + 8];
+  int seen[4] = {0, 0, 0, 0};
+  int i, len;
+
+  mksfs(1);
+  for (i = 0; i < 4; i++) {
+    write_file(names[i], 10, i);
+  }
+
+  memset(buf, GUARD_BYTE, sizeof(buf));
+  while (sfs_getnextfilename(buf)) {
+    len = strlen(buf);
+    for (i = len + 1; i < sizeof(buf); i++) {
+      if (buf[i] != GUARD_BYTE) {
+        fprintf(stderr, "ERROR: listing %s wrote past its NUL\n", buf);
+        error_count++;
+        break;
+      }
+    }
+    for (i = 0; i < 4; i++) {
+      if (strcmp(buf, names[i]) == 0) {
+        seen[i]++;
+      }
+    }
+    memset(buf, GUARD_BYTE, sizeof(buf));
+  }
+
+  for (i = 0; i < 4; i++) {
+    if (seen[i] != 1) {
+      fprintf(stderr, "ERROR: %s listed %d times\n", names[i], seen[i]);
+      error_count++;
+    }
+  }
+}
+
+/* A write whose blocks cannot reach the image fails, and leaves the
+ * file as it was. RLIMIT_FSIZE keeps every write to the image from
+ * landing, on the backends that write through the file; the cache is
+ * turned off so the blocks are written at once.
+ */
+static void
+test_write_failure(int backend, int cache_blocks)
+{
+  struct rlimit saved, limit;
+  char buf[5000];
+  int fd, n;
+
+  if (backend == SFS_BACKEND_MMAP) {
+    return;
+  }
+  sfs_setcachesize(0);
+  mksfs(1);
+  write_file("FAILING", 3000, 5);
+  fd = sfs_fopen("FAILING");
+  fill_data(buf, 3000, sizeof(buf), 6);
+
+  getrlimit(RLIMIT_FSIZE, &saved);
+  limit = saved;
+  limit.rlim_cur = 0;
+  signal(SIGXFSZ, SIG_IGN);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  n = sfs_fwrite(fd, buf, sizeof(buf));
+  setrlimit(RLIMIT_FSIZE, &saved);
+  signal(SIGXFSZ, SIG_DFL);
+
+  if (n != -1 || sfs_getfilesize("FAILING") != 3000) {
+    fprintf(stderr, "ERROR: a failed write returned %d, size %d\n",
+            n, sfs_getfilesize("FAILING"));
+    error_count++;
+  }
+  sfs_fclose(fd);
+  sfs_setcachesize(cache_blocks);
+  mksfs(1);
+}
+
+/* A file cut down from many single-block extents and grown back in one
+ * write finds every block, whichever tree leaf its extent starts in,
+ * and an overwrite after that reuses the block already there.
+ */
+static void
+test_regrowth()
+{
+  int bs, nblocks = 100, keep = 10;
+  int fd, other, i, before;
+  char *buf;
+
+  mksfs(1);
+  bs = block_size();
+  buf = malloc((size_t)nblocks * bs);
+
+  /* Writing a block to each of two files in turn keeps every block of */
+  /* the first file apart from the next                                */
+  fd = sfs_fopen("EXTENTS");
+  other = sfs_fopen("SPACER");
+  for (i = 0; i < nblocks; i++) {
+    fill_data(buf, i * bs, bs, 1);
+    sfs_fwrite(fd, buf, bs);
+    sfs_fwrite(other, buf, bs);
+  }
+  sfs_fclose(other);
+  sfs_remove("SPACER");
+  sfs_ftruncate(fd, keep * bs);
+
+  /* Grow it back in one write */
+  fill_data(buf, keep * bs, (nblocks - keep) * bs, 2);
+  sfs_fwseek(fd, keep * bs);
+  if (sfs_fwrite(fd, buf, (nblocks - keep) * bs) != (nblocks - keep) * bs) {
+    fprintf(stderr, "ERROR: growing the file back\n");
+    error_count++;
+  }
+  for (i = 0; i < nblocks; i++) {
+    sfs_frseek(fd, i * bs);
+    if (sfs_fread(fd, buf, bs) != bs || !check_data(buf, i * bs, bs, i < keep ? 1 : 2)) {
+      fprintf(stderr, "ERROR: block %d wrong after truncate and regrowth\n", i);
+      error_count++;
+      break;
+    }
+  }
+
+  /* Overwriting a block that has one must not allocate another */
+  before = free_blocks();
+  fill_data(buf, 60 * bs, bs, 3);
+  sfs_fwseek(fd, 60 * bs);
+  sfs_fwrite(fd, buf, bs);
+  sfs_frseek(fd, 60 * bs);
+  if (free_blocks() != before || sfs_fread(fd, buf, bs) != bs || !check_data(buf, 60 * bs, bs, 3)) {
+    fprintf(stderr, "ERROR: overwrite after regrowth (free %d -> %d)\n", before, free_blocks());
+    error_count++;
+  }
+  sfs_fclose(fd);
+
+  mksfs(0);
+  fd = sfs_fopen("EXTENTS");
+  sfs_frseek(fd, 50 * bs);
+  if (sfs_fread(fd, buf, bs) != bs || !check_data(buf, 50 * bs, bs, 2)) {
+    fprintf(stderr, "ERROR: regrown file wrong after remount\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  free(buf);
+}
+
+/* image_fd() - returns the descriptor disk_emu holds the sfs image
+ * open on, or -1.
+ */
+static int
+image_fd()
+{
+  struct stat image, st;
+  int fd;
+
+  if (stat(SFS_DISK, &image) != 0) {
+    return -1;
+  }
+  for (fd = 3; fd < 1024; fd++) {
+    if (fstat(fd, &st) == 0 && st.st_dev == image.st_dev && st.st_ino == image.st_ino) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+/* A read whose blocks cannot be fetched fails, whether they go straight
+ * into the caller's buffer or through a bounce buffer. The image's
+ * descriptor is replaced by one opened write-only, on the backends that
+ * read through it; the cache is turned off so every read reaches it.
+ */
+static void
+test_read_failure(int backend, int cache_blocks)
+{
+  static const int ranges[][2] = {{0, 3072}, {100, 200}, {500, 3000}};
+  char buf[5000];
+  int fd, disk, saved, writeonly, i, n;
+
+  if (backend == SFS_BACKEND_MMAP) {
+    return;
+  }
+  sfs_setcachesize(0);
+  mksfs(1);
+  write_file("UNREADABLE", 5000, 7);
+  fd = sfs_fopen("UNREADABLE");
+
+  disk = image_fd();
+  writeonly = open(SFS_DISK, O_WRONLY);
+  if (disk == -1 || writeonly == -1) {
+    fprintf(stderr, "ERROR: cannot reopen the image write-only\n");
+    error_count++;
+    return;
+  }
+  saved = dup(disk);
+  dup2(writeonly, disk);
+  close(writeonly);
+  for (i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+    sfs_frseek(fd, ranges[i][0]);
+    n = sfs_fread(fd, buf, ranges[i][1]);
+    if (n != -1) {
+      fprintf(stderr, "ERROR: a failed read of %d bytes at %d returned %d\n",
+              ranges[i][1], ranges[i][0], n);
+      error_count++;
+    }
+  }
+  dup2(saved, disk);
+  close(saved);
+
+  sfs_frseek(fd, 0);
+  if (sfs_fread(fd, buf, 5000) != 5000 || !check_data(buf, 0, 5000, 7)) {
+    fprintf(stderr, "ERROR: reads do not recover after a failed one\n");
+    error_count++;
+  }
+  sfs_fclose(fd);
+  sfs_setcachesize(cache_blocks);
+  mksfs(1);
+}
+
+/* A write that needs a file's extents to move out of its inode, with
+ * no block left for the tree, fails and leaves the file as it was. It
+ * goes through once a block is free again.
+ */
+static void
+test_extents_full()
+{
+  int bs = 1024, i, fa, fb, fd, left;
+  char block[1024];
+
+  mksfs(1);
+  fa = sfs_fopen("PIECES");
+  fb = sfs_fopen("SPACER");
+  for (i = 0; i < 4; i++) {
+    fill_data(block, i * bs, bs, 33);
+    sfs_fwrite(fa, block, bs);
+    sfs_fwrite(fb, block, bs);
+  }
+  sfs_fclose(fb);
+
+  /* One block is left free, away from the end of PIECES */
+  fill_disk("FILL", 150);
+  fd = sfs_fopen("FILL0");
+  sfs_ftruncate(fd, 149 * bs);
+  sfs_fclose(fd);
+  left = free_blocks();
+
+  fill_data(block, 4 * bs, bs, 33);
+  if (sfs_fwrite(fa, block, bs) != -1) {
+    fprintf(stderr, "ERROR: a fifth extent was added with no room for its tree\n");
+    error_count++;
+  }
+  sfs_fclose(fa);
+  verify_file("PIECES", 4 * bs, 33);
+  if (free_blocks() != left) {
+    fprintf(stderr, "ERROR: %d blocks free after a failed write, expected %d\n",
+            free_blocks(), left);
+    error_count++;
+  }
+
+  sfs_remove("FILL1");
+  fa = sfs_fopen("PIECES");
+  if (sfs_fwrite(fa, block, bs) != bs) {
+    fprintf(stderr, "ERROR: adding a fifth extent once there is room\n");
+    error_count++;
+  }
+  sfs_fclose(fa);
+  mksfs(0);
+  verify_file("PIECES", 5 * bs, 33);
+}
+
+/* sfs_mkdir() and sfs_rmdir() say why they fail: a name taken, a
+ * directory not empty, missing or a file, a name too long, or no inode
+ * left.
+ */
+static void
+test_dir_errors()
+{
+  static const struct {
+    int rmdir;
+    char *path;
+    int expected;
+  } calls[] = {
+    {0, "/d", SFS_ERR_EXIST},
+    {0, "/d/f", SFS_ERR_EXIST},
+    {0, "/missing/sub", SFS_ERR_NOENT},
+    {0, "/d/f/sub", SFS_ERR_NOTDIR},
+    {0, "/d/ANAMEMUCHTOOLONGFORANENTRY", SFS_ERR_NAMETOOLONG},
+    {0, "/ANAMEMUCHTOOLONGFORANENTRY/sub", SFS_ERR_NAMETOOLONG},
+    {1, "/d", SFS_ERR_NOTEMPTY},
+    {1, "/d/missing", SFS_ERR_NOENT},
+    {1, "/d/f", SFS_ERR_NOTDIR},
+    {1, "/missing/sub", SFS_ERR_NOENT},
+    {1, "/d/f/sub", SFS_ERR_NOTDIR},
+  };
+  char path[16];
+  int i, res;
+
+  mksfs(1);
+  sfs_mkdir("/d");
+  write_file("/d/f", 10, 1);
+  for (i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+    res = calls[i].rmdir ? sfs_rmdir(calls[i].path) : sfs_mkdir(calls[i].path);
+    if (res != calls[i].expected) {
+      fprintf(stderr, "ERROR: %s %s gave %d, expected %d\n",
+              calls[i].rmdir ? "rmdir" : "mkdir", calls[i].path, res, calls[i].expected);
+      error_count++;
+    }
+  }
+
+  for (i = 0; i < 1000; i++) {
+    sprintf(path, "/D%d", i);
+    if ((res = sfs_mkdir(path)) != 0) {
+      break;
+    }
+  }
+  if (res != SFS_ERR_NOSPC) {
+    fprintf(stderr, "ERROR: mkdir with no inode left gave %d\n", res);
+    error_count++;
+  }
+}
+
+/* Many tree nodes changed between checkpoints are each found again:
+ * directories with thousands of entries are filled, emptied by half
+ * and read back before and after a remount.
+ */
+static void
+test_many_nodes()
+{
+  char path[32];
+  int ndirs = 4, nfiles = 600, d, i;
+
+  if (mksfs_geometry(1024, 16384, 4096) != 0) {
+    fprintf(stderr, "ERROR: mksfs_geometry(1024, 16384, 4096) failed\n");
+    error_count++;
+    return;
+  }
+  for (d = 0; d < ndirs; d++) {
+    sprintf(path, "/N%d", d);
+    sfs_mkdir(path);
+  }
+  for (i = 0; i < nfiles; i++) {
+    for (d = 0; d < ndirs; d++) {
+      sprintf(path, "/N%d/FILE%04d", d, i);
+      write_file(path, (i % 7) * 300, i + d);
+    }
+  }
+  for (i = 0; i < nfiles; i += 2) {
+    for (d = 0; d < ndirs; d++) {
+      sprintf(path, "/N%d/FILE%04d", d, i);
+      sfs_remove(path);
+    }
+  }
+
+  for (d = 0; d < 2; d++) {
+    for (i = 1; i < nfiles; i += 2) {
+      sprintf(path, "/N%d/FILE%04d", ndirs - 1, i);
+      verify_file(path, (i % 7) * 300, i + ndirs - 1);
+    }
+    sprintf(path, "/N0/FILE%04d", 100);
+    if (sfs_getfilesize(path) != -1) {
+      fprintf(stderr, "ERROR: removed %s is still there\n", path);
+      error_count++;
+    }
+    mksfs(0);
+  }
+  mksfs(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct {
+    int backend;
+    int cache_blocks;
+    char *name;
+  } configs[] = {
+    {SFS_BACKEND_PREAD, DISK_CACHE_DEFAULT_BLOCKS, "pread"},
+    {SFS_BACKEND_PREAD, 0, "pread, uncached"},
+    {SFS_BACKEND_PREAD, 8, "pread, 8 cached blocks"},
+    {SFS_BACKEND_MMAP, 0, "mmap"},
+    {SFS_BACKEND_URING, DISK_CACHE_DEFAULT_BLOCKS, "io_uring"},
+    {SFS_BACKEND_URING, 8, "io_uring, 8 cached blocks"},
+  };
+  int i;
+
+  for (i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+    printf("Testing with %s\n", configs[i].name);
+    /* What sfs still holds goes to its image before other disks are opened */
+    sfs_sync();
+    sfs_setbackend(configs[i].backend);
+    sfs_setcachesize(configs[i].cache_blocks);
+    test_block_io();
+    test_fresh_disk();
+    test_durability();
+    test_backends(configs[i].backend);
+    test_cache(configs[i].cache_blocks);
+    test_metadata();
+    test_full_disk();
+    test_allocator();
+    test_contiguous();
+    test_extents();
+    test_old_format();
+    test_names();
+    test_directories();
+    test_read_bounds();
+    test_overwrite(configs[i].cache_blocks);
+    test_readahead(configs[i].cache_blocks);
+    test_writebuf();
+    test_replay();
+    test_uring_fallback(configs[i].backend);
+    test_threads();
+    test_truncate();
+    test_inode_calls();
+    test_statfs();
+    test_geometry();
+    test_large_image();
+    test_listing();
+    test_write_failure(configs[i].backend, configs[i].cache_blocks);
+    test_regrowth();
+    test_read_failure(configs[i].backend, configs[i].cache_blocks);
+    test_extents_full();
+    test_dir_errors();
+    test_many_nodes();
+  }
+
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}